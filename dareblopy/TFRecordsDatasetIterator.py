@@ -19,11 +19,21 @@ import time
 import numpy as np
 
 
+def _get_seed(seed, num_shards):
+    if seed is None:
+        if num_shards > 1:
+            # Shards are split consistently only if all of them shuffle files the same way
+            raise ValueError("seed must be given explicitly when num_shards > 1")
+        seed = np.uint64(time.time() * 1000)
+    return seed
+
+
 class TFRecordsDatasetIterator:
-    def __init__(self, filenames, batch_size, buffer_size=1000, seed=None, epoch=0):
-        if seed is None:
-            seed = np.uint64(time.time() * 1000)
-        self.record_yielder = db.RecordYielderRandomized(filenames, buffer_size, seed, epoch)
+    def __init__(self, filenames, batch_size, buffer_size=1000, seed=None, epoch=0, prefetch=0, shard_index=0,
+                 num_shards=1, cycle_length=1, block_length=1, deterministic=True):
+        seed = _get_seed(seed, num_shards)
+        self.record_yielder = db.RecordYielderRandomized(filenames, buffer_size, seed, epoch, prefetch, shard_index,
+                                                         num_shards, cycle_length, block_length, deterministic)
         self.batch_size = batch_size
 
     def __iter__(self):
@@ -34,11 +44,13 @@ class TFRecordsDatasetIterator:
 
 
 class ParsedTFRecordsDatasetIterator:
-    def __init__(self, filenames, features, batch_size, buffer_size=1000, seed=None, epoch=0):
-        if seed is None:
-            seed = np.uint64(time.time() * 1000)
+    def __init__(self, filenames, features, batch_size, buffer_size=1000, seed=None, epoch=0, prefetch=0,
+                 shard_index=0, num_shards=1, cycle_length=1, block_length=1, deterministic=True):
+        seed = _get_seed(seed, num_shards)
         self.parser = db.RecordParser(features, True)
-        self.record_yielder = db.ParsedRecordYielderRandomized(self.parser, filenames, buffer_size, seed, epoch)
+        self.record_yielder = db.ParsedRecordYielderRandomized(self.parser, filenames, buffer_size, seed, epoch,
+                                                               prefetch, shard_index, num_shards, cycle_length,
+                                                               block_length, deterministic)
         self.batch_size = batch_size
 
     def __iter__(self):
@@ -257,11 +257,19 @@ jpeg_vanila = """jmemnobs.c jaricom.c jcapimin.c jcapistd.c jcarith.c jccoefct.c
 
 jpeg_vanila = ['libs/libjpeg/' + x for x in jpeg_vanila.split()]
 
+libpng = """png.c pngerror.c pngget.c pngmem.c pngpread.c pngread.c pngrio.c pngrtran.c pngrutil.c pngset.c
+        pngtrans.c pngwio.c pngwrite.c pngwtran.c pngwutil.c"""
+
+libpng = ['libs/libpng/' + x for x in libpng.split()]
+
+libwebp = list(glob.glob('libs/libwebp/src/dec/*.c')) + list(glob.glob('libs/libwebp/src/dsp/*.c')) + \
+          list(glob.glob('libs/libwebp/src/utils/*.c')) + list(glob.glob('libs/libwebp/sharpyuv/*.c'))
+
 
 definitions = {
-    'darwin': [('HAVE_SSE42', 0), ('HAVE_PTHREAD', 0)],
-    'posix': [('HAVE_SSE42', 0), ('HAVE_PTHREAD', 0)],
-    'win32': [('HAVE_SSE42', 0)],
+    'darwin': [('HAVE_SSE42', 0), ('HAVE_PTHREAD', 0), ('PNG_ARM_NEON_OPT', 0)],
+    'posix': [('HAVE_SSE42', 0), ('HAVE_PTHREAD', 0), ('PNG_ARM_NEON_OPT', 0)],
+    'win32': [('HAVE_SSE42', 0), ('PNG_ARM_NEON_OPT', 0)],
 }
 
 file_specific_definitions = {}
@@ -274,7 +282,7 @@ for file in jpeg_vanila:
 
 libs = {
     'darwin': [],
-    'posix': ["rt", "m", "stdc++fs", "gomp"],
+    'posix': ["rt", "m", "stdc++fs"],
     'win32': ["ole32", "shell32"],
 }
 
@@ -291,8 +299,8 @@ extra_compile_args = {
 }
 
 extra_compile_cpp_args = {
-    'darwin': ['-std=c++14', '-lstdc++fs', '-Ofast', '-flto', '-fopenmp'],
-    'posix': ['-std=c++14', '-lstdc++fs', '-Ofast', '-flto', '-fopenmp'],
+    'darwin': ['-std=c++14', '-lstdc++fs', '-Ofast', '-flto'],
+    'posix': ['-std=c++14', '-lstdc++fs', '-Ofast', '-flto'],
     'win32': [],
 }
 
@@ -309,12 +317,15 @@ extra_compile_asm_args = {
 }
 
 extension = Extension("_dareblopy",
-                      jpeg_turbo + jpeg_vanila + jpeg_turbo_simd + dareblopy + fsal + crc32c + zlib + protobuf + lz4,
+                      jpeg_turbo + jpeg_vanila + jpeg_turbo_simd + dareblopy + fsal + crc32c + zlib + protobuf + lz4 + libpng + libwebp,
                              define_macros = definitions[target_os],
                              include_dirs=[
                                  "libs/zlib",
                                  "libs/fsal/sources",
                                  "libs/lz4/lib",
+                                 "libs/libpng",
+                                 "libs/libwebp",
+                                 "libs/libwebp/src",
                                  "libs/pybind11/include",
                                  "libs/crc32c/include",
                                  "libs/protobuf/src",
@@ -0,0 +1,361 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+
+#include "async_reader.h"
+#include "thread_pool.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <deque>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+// liburing is not used, rings are set up with raw system calls
+static int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+#endif
+
+
+AsyncReader::AsyncReader(unsigned queue_depth, bool use_io_uring):
+		m_ring_fd(-1), m_queue_depth(queue_depth), m_sq_ptr(nullptr), m_sq_size(0), m_cq_ptr(nullptr), m_cq_size(0),
+		m_sqes(nullptr), m_sqes_size(0), m_sq_head(nullptr), m_sq_tail(nullptr), m_sq_mask(nullptr),
+		m_sq_array(nullptr), m_cq_head(nullptr), m_cq_tail(nullptr), m_cq_mask(nullptr), m_cqes(nullptr)
+{
+	if (queue_depth == 0)
+	{
+		throw runtime_error("Queue depth must be positive");
+	}
+	if (use_io_uring)
+	{
+		InitRing(queue_depth);
+	}
+}
+
+AsyncReader::~AsyncReader()
+{
+	CloseRing();
+}
+
+bool AsyncReader::InitRing(unsigned queue_depth)
+{
+#ifdef HAVE_IO_URING
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = io_uring_setup(queue_depth, &params);
+	if (fd < 0)
+	{
+		// Not supported by the kernel, or disabled by seccomp or sysctl
+		return false;
+	}
+
+	m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+#else
+	bool single_mmap = false;
+#endif
+	if (single_mmap)
+	{
+		m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+	}
+	m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+	void* sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	void* cq_ptr = sq_ptr;
+	if (!single_mmap && sq_ptr != MAP_FAILED)
+	{
+		cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	void* sqes = MAP_FAILED;
+	if (sq_ptr != MAP_FAILED && cq_ptr != MAP_FAILED)
+	{
+		sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	}
+	if (sqes == MAP_FAILED)
+	{
+		if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		{
+			munmap(cq_ptr, m_cq_size);
+		}
+		if (sq_ptr != MAP_FAILED)
+		{
+			munmap(sq_ptr, m_sq_size);
+		}
+		close(fd);
+		return false;
+	}
+
+	m_ring_fd = fd;
+	m_sq_ptr = sq_ptr;
+	m_cq_ptr = cq_ptr;
+	m_sqes = sqes;
+	auto* sq = (uint8_t*)sq_ptr;
+	auto* cq = (uint8_t*)cq_ptr;
+	m_sq_head = (unsigned*)(sq + params.sq_off.head);
+	m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	m_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	m_sq_array = (unsigned*)(sq + params.sq_off.array);
+	m_cq_head = (unsigned*)(cq + params.cq_off.head);
+	m_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	m_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	m_cqes = cq + params.cq_off.cqes;
+	m_queue_depth = std::min(queue_depth, params.sq_entries);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void AsyncReader::CloseRing()
+{
+#ifdef HAVE_IO_URING
+	if (m_sqes != nullptr)
+	{
+		munmap(m_sqes, m_sqes_size);
+	}
+	if (m_cq_ptr != nullptr && m_cq_ptr != m_sq_ptr)
+	{
+		munmap(m_cq_ptr, m_cq_size);
+	}
+	if (m_sq_ptr != nullptr)
+	{
+		munmap(m_sq_ptr, m_sq_size);
+	}
+	if (m_ring_fd >= 0)
+	{
+		close(m_ring_fd);
+	}
+#endif
+	m_ring_fd = -1;
+	m_sq_ptr = m_cq_ptr = m_sqes = nullptr;
+}
+
+void AsyncReader::Read(std::vector<Request>& requests)
+{
+	for (auto& request: requests)
+	{
+		request.read = 0;
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (uses_io_uring())
+	{
+		ReadRing(requests);
+	}
+	else
+	{
+		ReadFallback(requests);
+	}
+}
+
+void AsyncReader::ReadRing(std::vector<Request>& requests)
+{
+#ifdef HAVE_IO_URING
+	// Requests that still need to be submitted. Short reads are resubmitted for the remaining part
+	std::deque<size_t> pending;
+	for (size_t i = 0; i < requests.size(); ++i)
+	{
+		if (requests[i].size > 0)
+		{
+			pending.push_back(i);
+		}
+	}
+	std::vector<iovec> iovecs(requests.size());
+	auto* sqes = (io_uring_sqe*)m_sqes;
+	auto* cqes = (io_uring_cqe*)m_cqes;
+
+	// After an error, no new reads are submitted, but reads in flight are waited for, since they write to the
+	// destination buffers. If the ring itself failed, it is closed afterwards and next calls use positional reads
+	std::string error;
+	bool ring_failed = false;
+	unsigned in_flight = 0;
+	unsigned not_submitted = 0;
+	while (!pending.empty() || in_flight > 0)
+	{
+		unsigned tail = *m_sq_tail;
+		while (!pending.empty() && in_flight < m_queue_depth)
+		{
+			size_t i = pending.front();
+			pending.pop_front();
+			Request& request = requests[i];
+			iovecs[i].iov_base = request.dst + request.read;
+			iovecs[i].iov_len = request.size - request.read;
+
+			unsigned index = tail & *m_sq_mask;
+			io_uring_sqe* sqe = &sqes[index];
+			memset(sqe, 0, sizeof(io_uring_sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = request.fd;
+			sqe->off = request.offset + request.read;
+			sqe->addr = (uint64_t)&iovecs[i];
+			sqe->len = 1;
+			sqe->user_data = i;
+			m_sq_array[index] = index;
+			++tail;
+			++in_flight;
+			++not_submitted;
+		}
+		__atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+
+		int submitted = io_uring_enter(m_ring_fd, not_submitted, 1, IORING_ENTER_GETEVENTS);
+		if (submitted < 0)
+		{
+			// On these errors, completions are reaped and submission is retried. Once the error is recorded, the
+			// call only waits, and keeps waiting whatever it returns until nothing is in flight
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY && !ring_failed)
+			{
+				error = std::string("io_uring_enter failed: ") + strerror(errno);
+				ring_failed = true;
+				pending.clear();
+				// Entries that the kernel has not consumed are taken back, so they are never submitted
+				unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+				in_flight -= tail - head;
+				not_submitted = 0;
+				__atomic_store_n(m_sq_tail, head, __ATOMIC_RELEASE);
+			}
+			submitted = 0;
+		}
+		not_submitted -= std::min((unsigned)submitted, not_submitted);
+
+		unsigned head = *m_cq_head;
+		while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+		{
+			const io_uring_cqe& cqe = cqes[head & *m_cq_mask];
+			size_t i = cqe.user_data;
+			int result = cqe.res;
+			++head;
+			--in_flight;
+			Request& request = requests[i];
+			if (!error.empty())
+			{
+				continue;
+			}
+			if (result == -EINTR || result == -EAGAIN)
+			{
+				pending.push_back(i);
+			}
+			else if (result < 0)
+			{
+				error = strerror(-result);
+				pending.clear();
+			}
+			else if (result > 0)
+			{
+				request.read += result;
+				if (request.read < request.size)
+				{
+					pending.push_back(i);
+				}
+			}
+			// Zero means the end of file, request stays short
+		}
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (ring_failed)
+	{
+		CloseRing();
+	}
+	if (!error.empty())
+	{
+		throw runtime_error("Error reading file: %s", error.c_str());
+	}
+#endif
+}
+
+void AsyncReader::ReadFallback(std::vector<Request>& requests)
+{
+	ThreadPool::Default().ParallelFor(requests.size(), [&requests](size_t i)
+	{
+		Request& request = requests[i];
+		while (request.read < request.size)
+		{
+			uint8_t* dst = request.dst + request.read;
+			uint64_t offset = request.offset + request.read;
+			size_t size = request.size - request.read;
+#ifdef _WIN32
+			OVERLAPPED overlapped;
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = (DWORD)offset;
+			overlapped.OffsetHigh = (DWORD)(offset >> 32);
+			DWORD result = 0;
+			if (!ReadFile((HANDLE)_get_osfhandle(request.fd), dst, (DWORD)std::min<size_t>(size, MAXDWORD), &result, &overlapped))
+			{
+				if (GetLastError() == ERROR_HANDLE_EOF)
+				{
+					break;
+				}
+				throw runtime_error("Error reading %zd bytes at offset %zd", request.size, request.offset);
+			}
+#else
+			ssize_t result = pread(request.fd, dst, size, offset);
+			if (result < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				throw runtime_error("Error reading %zd bytes at offset %zd: %s", request.size, request.offset, strerror(errno));
+			}
+#endif
+			if (result == 0)
+			{
+				break;
+			}
+			request.read += result;
+		}
+	}, (int)m_queue_depth);
+}
+
+int AsyncReader::Open(const std::string& path)
+{
+#ifdef _WIN32
+	return _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+	return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+void AsyncReader::Close(int fd)
+{
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
@@ -0,0 +1,89 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+#include <mutex>
+#include "common.h"
+
+
+// Reads many byte ranges of files at once, keeping up to `queue_depth` reads in flight. On Linux, io_uring is used if
+// the kernel supports it. Otherwise, if io_uring is not permitted or `use_io_uring` is false, reads are done with
+// positional reads on the shared thread pool. If the ring fails, it is closed and positional reads are used from then
+// on. Does not touch python objects.
+class HIDDEN AsyncReader
+{
+public:
+	AsyncReader(const AsyncReader&) = delete; // non construction-copyable
+	AsyncReader& operator=( const AsyncReader&) = delete; // non copyable
+
+	struct Request
+	{
+		int fd;
+		uint64_t offset;
+		size_t size;
+		uint8_t* dst;
+		// Number of bytes read, is less than `size` only if the file ended
+		size_t read;
+	};
+
+	explicit AsyncReader(unsigned queue_depth = 64, bool use_io_uring = true);
+
+	~AsyncReader();
+
+	// Performs all requests and blocks until they are done. Throws on I/O errors. Is thread-safe, concurrent calls
+	// are serialized.
+	void Read(std::vector<Request>& requests);
+
+	bool uses_io_uring() const { return m_ring_fd >= 0; }
+
+	// Opens file for reading with Read, returns -1 on failure
+	static int Open(const std::string& path);
+
+	static void Close(int fd);
+
+private:
+	bool InitRing(unsigned queue_depth);
+
+	void CloseRing();
+
+	void ReadRing(std::vector<Request>& requests);
+
+	void ReadFallback(std::vector<Request>& requests);
+
+	int m_ring_fd;
+	unsigned m_queue_depth;
+
+	// Mapped rings of io_uring
+	void* m_sq_ptr;
+	size_t m_sq_size;
+	void* m_cq_ptr;
+	size_t m_cq_size;
+	void* m_sqes;
+	size_t m_sqes_size;
+	unsigned* m_sq_head;
+	unsigned* m_sq_tail;
+	unsigned* m_sq_mask;
+	unsigned* m_sq_array;
+	unsigned* m_cq_head;
+	unsigned* m_cq_tail;
+	unsigned* m_cq_mask;
+	void* m_cqes;
+
+	std::mutex m_mutex;
+};
@@ -0,0 +1,113 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <mutex>
+#include "common.h"
+
+
+// Fixed number of buffers, that are handed out for output arrays and taken back once the arrays are released.
+// Reused buffers are already paged in and likely to be in cache, unlike freshly allocated ones.
+// Buffers grow to the largest requested size, smaller requests (e.g. the last batch of an epoch) reuse them.
+// Is shared by the owner and by the leased buffers, so it can outlive the owner. Does not touch python objects.
+class HIDDEN BufferRing
+{
+public:
+	BufferRing(const BufferRing&) = delete; // non construction-copyable
+	BufferRing& operator=( const BufferRing&) = delete; // non copyable
+
+	explicit BufferRing(int capacity): m_capacity(capacity), m_buffer_size(0), m_allocated(0)
+	{
+		if (capacity < 1)
+		{
+			throw runtime_error("Number of buffers must be positive, got %d", capacity);
+		}
+	}
+
+	~BufferRing()
+	{
+		for (auto& buffer: m_free)
+		{
+			free(buffer.data);
+		}
+	}
+
+	// Returns a buffer of at least `size` bytes, or nullptr if all buffers are in use. `capacity` receives actual
+	// size of the buffer, that must be passed to Release.
+	uint8_t* Acquire(size_t size, size_t& capacity)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (size > m_buffer_size)
+		{
+			// Buffers that are smaller are dropped now, or once they are released
+			for (auto& buffer: m_free)
+			{
+				free(buffer.data);
+			}
+			m_allocated -= m_free.size();
+			m_free.clear();
+			m_buffer_size = size;
+		}
+		if (!m_free.empty())
+		{
+			Buffer buffer = m_free.back();
+			m_free.pop_back();
+			capacity = buffer.size;
+			return buffer.data;
+		}
+		if (m_allocated >= (size_t)m_capacity)
+		{
+			return nullptr;
+		}
+		auto data = (uint8_t*)malloc(m_buffer_size);
+		if (data == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		++m_allocated;
+		capacity = m_buffer_size;
+		return data;
+	}
+
+	void Release(uint8_t* data, size_t capacity)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (capacity < m_buffer_size)
+		{
+			free(data);
+			--m_allocated;
+			return;
+		}
+		m_free.push_back({data, capacity});
+	}
+
+	int capacity() const { return m_capacity; }
+
+private:
+	struct Buffer
+	{
+		uint8_t* data;
+		size_t size;
+	};
+
+	int m_capacity;
+	size_t m_buffer_size;
+	// Number of buffers that exist, either free or in use
+	size_t m_allocated;
+	std::vector<Buffer> m_free;
+	std::mutex m_mutex;
+};
@@ -48,6 +48,7 @@ PYBIND11_NUMPY_OBJECT_DTYPE(py::object)
 
 
 typedef py::array_t<uint8_t, py::array::c_style> ndarray_uint8;
+typedef py::array_t<uint16_t, py::array::c_style> ndarray_uint16;
 typedef py::array_t<int64_t, py::array::c_style> ndarray_int64;
 typedef py::array_t<float, py::array::c_style> ndarray_float32;
 typedef py::array_t<py::object, py::array::c_style> ndarray_object;
@@ -112,6 +113,10 @@ inline std::function<void*(size_t)> GetBytesAllocator(PyBytesObject*& bytesObjec
 		// e.g. readying a chunk of data with crc32c checksum in open `read` invocation. This might make a small
 		// difference if the disk is network attached.
 		bytesObject = (PyBytesObject*) PyObject_Malloc(offsetof(PyBytesObject, ob_sval) + size + 1 + sizeof(uint32_t));
+		if (bytesObject == nullptr)
+		{
+			throw std::bad_alloc();
+		}
 		PyObject_INIT_VAR(bytesObject, &PyBytes_Type, size);
 		bytesObject->ob_shash = -1;
 		bytesObject->ob_sval[size] = '\0';
@@ -0,0 +1,34 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+#include <fsal.h>
+
+
+// Sequential stream of decompressed data of a file
+class CompressedInputStream
+{
+public:
+	virtual ~CompressedInputStream() = default;
+
+	// Reads up to `size` bytes, `read` is set to the number of bytes read. Returns true if all `size` bytes were
+	// read, otherwise returns status of the last read of the file, which signals end of file.
+	virtual fsal::Status Read(uint8_t* dst, size_t size, size_t* read) = 0;
+
+	// Position in the decompressed stream
+	virtual uint64_t Tell() const = 0;
+};
@@ -0,0 +1,185 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "dlpack.h"
+#include "example.h"
+#include <string>
+#include <vector>
+
+
+using namespace DLPack;
+
+// Owner of the exported tensor. Shape and strides of the tensor point into it.
+struct HIDDEN ManagerContext
+{
+	DLManagedTensor tensor;
+	PyObject* array;
+	std::vector<int64_t> shape;
+	std::vector<int64_t> strides;
+};
+
+static void DeleteManagedTensor(DLManagedTensor* self)
+{
+	auto* ctx = (ManagerContext*)self->manager_ctx;
+	// Consumers may delete the tensor from their own threads, which do not hold GIL
+	PyGILState_STATE state = PyGILState_Ensure();
+	Py_DECREF(ctx->array);
+	PyGILState_Release(state);
+	delete ctx;
+}
+
+// Consumer renames the capsule to "used_dltensor" when it takes the tensor, otherwise the tensor is still ours
+static void DeleteCapsule(PyObject* capsule)
+{
+	if (!PyCapsule_IsValid(capsule, "dltensor"))
+	{
+		return;
+	}
+	PyObject *type, *value, *traceback;
+	PyErr_Fetch(&type, &value, &traceback);
+	auto* tensor = (DLManagedTensor*)PyCapsule_GetPointer(capsule, "dltensor");
+	tensor->deleter(tensor);
+	PyErr_Restore(type, value, traceback);
+}
+
+// Returns DLPack dtype of the array, throws if the array can not be exported
+static DLDataType GetArrayDataType(const py::array& array)
+{
+	if (!array.writeable())
+	{
+		throw runtime_error("Can not export read-only array through DLPack");
+	}
+	auto kind = py::cast<std::string>(array.dtype().attr("kind"));
+	DLDataType dtype;
+	dtype.bits = (uint8_t)(array.itemsize() * 8);
+	dtype.lanes = 1;
+	switch (kind[0])
+	{
+		case 'i':
+			dtype.code = kDLInt;
+			break;
+		case 'u':
+			dtype.code = kDLUInt;
+			break;
+		case 'f':
+			dtype.code = kDLFloat;
+			break;
+		case 'b':
+			dtype.code = kDLBool;
+			break;
+		default:
+			throw runtime_error("Can not export array of dtype %s through DLPack",
+			                    py::cast<std::string>(py::str(array.dtype())).c_str());
+	}
+	return dtype;
+}
+
+// Returns DLPack dtype of elements of the array, that have the given logical dtype
+static DLDataType GetDataType(const py::array& array, Records::DataType logical_dtype)
+{
+	DLDataType dtype = GetArrayDataType(array);
+	DLDataType result = dtype;
+	switch (logical_dtype)
+	{
+		case Records::DataType::DT_INVALID:
+			return dtype;
+		case Records::DataType::DT_FLOAT:
+			result = {kDLFloat, 32, 1};
+			break;
+		case Records::DataType::DT_HALF:
+			result = {kDLFloat, 16, 1};
+			break;
+		case Records::DataType::DT_BFLOAT16:
+			result = {kDLBfloat, 16, 1};
+			break;
+		case Records::DataType::DT_INT32:
+			result = {kDLInt, 32, 1};
+			break;
+		case Records::DataType::DT_INT64:
+			result = {kDLInt, 64, 1};
+			break;
+		case Records::DataType::DT_UINT8:
+			result = {kDLUInt, 8, 1};
+			break;
+		default:
+			throw runtime_error("Can not export array of dtype %d through DLPack", (int)logical_dtype);
+	}
+	// Numpy has no bfloat16, such outputs are uint16 arrays
+	bool same = result.code == dtype.code && result.bits == dtype.bits;
+	bool bfloat16 = result.code == kDLBfloat && dtype.code == kDLUInt && dtype.bits == 16;
+	if (!same && !bfloat16)
+	{
+		throw runtime_error("Can not export array of dtype %s as dtype %d through DLPack",
+		                    py::cast<std::string>(py::str(array.dtype())).c_str(), (int)logical_dtype);
+	}
+	return result;
+}
+
+py::capsule DLPack::ToCapsule(const py::array& array, const DLDataType& dtype)
+{
+	auto* ctx = new ManagerContext();
+	ctx->array = array.ptr();
+	Py_INCREF(ctx->array);
+	for (py::ssize_t i = 0; i < array.ndim(); ++i)
+	{
+		ctx->shape.push_back(array.shape(i));
+		if (array.strides(i) % array.itemsize() != 0)
+		{
+			Py_DECREF(ctx->array);
+			delete ctx;
+			throw runtime_error("Can not export array through DLPack, strides are not a multiple of the item size");
+		}
+		// DLPack strides are in elements, numpy strides are in bytes
+		ctx->strides.push_back(array.strides(i) / array.itemsize());
+	}
+
+	DLTensor& tensor = ctx->tensor.dl_tensor;
+	tensor.data = const_cast<void*>(array.data());
+	tensor.device = {kDLCPU, 0};
+	tensor.ndim = (int32_t)array.ndim();
+	tensor.dtype = dtype;
+	tensor.shape = ctx->shape.data();
+	tensor.strides = ctx->strides.data();
+	tensor.byte_offset = 0;
+	ctx->tensor.manager_ctx = ctx;
+	ctx->tensor.deleter = DeleteManagedTensor;
+
+	PyObject* capsule = PyCapsule_New(&ctx->tensor, "dltensor", DeleteCapsule);
+	if (capsule == nullptr)
+	{
+		DeleteManagedTensor(&ctx->tensor);
+		throw py::error_already_set();
+	}
+	return py::reinterpret_steal<py::capsule>(capsule);
+}
+
+DLPackArray::DLPackArray(py::array array, Records::DataType dtype): m_array(std::move(array))
+{
+	m_dtype = GetDataType(m_array, dtype);
+}
+
+py::capsule DLPackArray::Export(const py::object& stream) const
+{
+	// Memory is on CPU, there are no streams to synchronize with
+	if (!stream.is(py::none()))
+	{
+		throw runtime_error("Argument `stream` must be None for arrays on CPU");
+	}
+	return ToCapsule(m_array, m_dtype);
+}
+
+py::tuple DLPackArray::Device() const
+{
+	return py::make_tuple((int)kDLCPU, 0);
+}
@@ -0,0 +1,99 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <stdint.h>
+#include "common.h"
+
+namespace Records
+{
+	enum class DataType;
+}
+
+// Export of arrays through DLPack (https://dmlc.github.io/dlpack/latest/), so that PyTorch, JAX, etc. can take
+// the memory without a copy. Structures below follow the ABI of the unversioned `DLManagedTensor`, which is what
+// "dltensor" capsules hold.
+namespace DLPack
+{
+	enum DeviceType
+	{
+		kDLCPU = 1,
+	};
+
+	enum DataTypeCode
+	{
+		kDLInt = 0,
+		kDLUInt = 1,
+		kDLFloat = 2,
+		kDLBfloat = 4,
+		kDLBool = 6,
+	};
+
+	struct DLDevice
+	{
+		int32_t device_type;
+		int32_t device_id;
+	};
+
+	struct DLDataType
+	{
+		uint8_t code;
+		uint8_t bits;
+		uint16_t lanes;
+	};
+
+	struct DLTensor
+	{
+		void* data;
+		DLDevice device;
+		int32_t ndim;
+		DLDataType dtype;
+		int64_t* shape;
+		int64_t* strides;
+		uint64_t byte_offset;
+	};
+
+	struct DLManagedTensor
+	{
+		DLTensor dl_tensor;
+		void* manager_ctx;
+		void (*deleter)(DLManagedTensor* self);
+	};
+
+	// Returns "dltensor" capsule that views memory of the array as elements of `dtype`. The capsule, and after it is
+	// consumed the tensor, holds a reference to the array, so memory stays valid (and a buffer of a ring is not reused)
+	// until the consumer deletes the tensor. Deleter can be called from any thread. Requires GIL.
+	py::capsule ToCapsule(const py::array& array, const DLDataType& dtype);
+}
+
+// Array with the DLPack protocol (`__dlpack__` and `__dlpack_device__`), that can be passed to
+// `torch.from_dlpack`, `jax.dlpack.from_dlpack` or `numpy.from_dlpack`. Arrays of objects and read-only arrays can not
+// be exported. `dtype` is the logical dtype of the elements, if it is DT_INVALID dtype of the array is used. It may
+// differ from dtype of the array only for bfloat16, which numpy holds as uint16. Throws on construction if the array
+// can not be exported.
+class HIDDEN DLPackArray
+{
+public:
+	DLPackArray(py::array array, Records::DataType dtype);
+
+	py::capsule Export(const py::object& stream) const;
+
+	py::tuple Device() const;
+
+	const py::array& array() const { return m_array; }
+
+private:
+	py::array m_array;
+	DLPack::DLDataType m_dtype;
+};
@@ -0,0 +1,102 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Conversion of decoded values to the output dtype of a feature. Loops have no branches and no calls, so they are
+// vectorized by the compiler for the SSE4 baseline of the build. Float conversions work on bits, so they are not
+// affected by -funsafe-math-optimizations.
+namespace Records
+{
+	inline uint32_t FloatBits(float x)
+	{
+		uint32_t bits;
+		memcpy(&bits, &x, sizeof(float));
+		return bits;
+	}
+
+	inline float BitsFloat(uint32_t bits)
+	{
+		float x;
+		memcpy(&x, &bits, sizeof(float));
+		return x;
+	}
+
+	// IEEE half precision, rounded to nearest even. Values that are too large become infinity, NaNs stay NaNs.
+	inline uint16_t FloatToHalf(float x)
+	{
+		const uint32_t f32_infinity = 255u << 23;
+		const uint32_t f16_max = (127u + 16u) << 23;
+		const uint32_t denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+		uint32_t bits = FloatBits(x);
+		uint32_t sign = bits & 0x80000000u;
+		bits ^= sign;
+
+		// Inf or NaN
+		uint32_t special = bits > f32_infinity ? 0x7E00u : 0x7C00u;
+		// Subnormal or zero, addition aligns mantissa bits at the bottom and rounds them
+		uint32_t subnormal = FloatBits(BitsFloat(bits) + BitsFloat(denorm_magic)) - denorm_magic;
+		// Normal, rebias exponent and round mantissa to nearest even
+		uint32_t normal = (bits + ((15u - 127u) << 23) + 0xFFFu + ((bits >> 13) & 1u)) >> 13;
+
+		uint32_t result = bits >= f16_max ? special : (bits < (113u << 23) ? subnormal : normal);
+		return (uint16_t)(result | (sign >> 16));
+	}
+
+	// Upper half of float bits, rounded to nearest even. NaNs stay NaNs.
+	inline uint16_t FloatToBFloat16(float x)
+	{
+		uint32_t bits = FloatBits(x);
+		uint32_t rounded = (bits + 0x7FFFu + ((bits >> 16) & 1u)) >> 16;
+		uint32_t nan = (bits >> 16) | 0x40u;
+		return (uint16_t)((bits & 0x7FFFFFFFu) > 0x7F800000u ? nan : rounded);
+	}
+
+	inline void ConvertFloatToHalf(const float* in, uint16_t* out, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = FloatToHalf(in[i]);
+		}
+	}
+
+	inline void ConvertFloatToBFloat16(const float* in, uint16_t* out, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = FloatToBFloat16(in[i]);
+		}
+	}
+
+	// Values out of range wrap around, same as `astype(np.int32)`
+	inline void ConvertInt64ToInt32(const int64_t* in, int32_t* out, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = (int32_t)(uint32_t)in[i];
+		}
+	}
+
+	inline void ConvertUInt8ToFloat(const uint8_t* in, float* out, size_t n, float scale)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = (float)in[i] * scale;
+		}
+	}
+}
@@ -14,24 +14,37 @@
 
 
 #include "example.h"
-#include <omp.h>
+#include "thread_pool.h"
+#include "dtype_conversion.h"
 
 namespace Records
 {
 	const char* DataTypeString(DataType dtype);
 
+	py::dtype NumpyDType(DataType dtype);
+
+	size_t DataTypeSize(DataType dtype);
+
+	bool IsArrayOf(const py::object& obj, DataType dtype);
+
 	std::pair<py::object, void*> TensorFactoryPtr(DataType dtype, const TensorShape& shape);
 
 	void* GetPtr(py::object& tensor, DataType dtype);
 
 	size_t num_elements(const TensorShape& shape);
 
-	DataType Feature2DataType(const Feature& feature);
+	DataType Feature2DataType(const FeatureRef& feature);
 
 	std::string Shape2str(const TensorShape& shape);
 
-	bool FeatureDecode(std::size_t out_index, const std::string& key, const DataType& dtype,
-	                   const TensorShape& shape, const Feature& feature, void* out_ptr);
+	bool FeatureDecode(std::size_t out_index, const RecordParser::FixedLenFeature& feature_config,
+	                   const FeatureRef& feature, void* out_ptr);
+
+	size_t VarLenFeatureSize(const FeatureRef& feature, DataType dtype);
+
+	void VarLenFeatureDecode(const FeatureRef& feature, DataType dtype, void* out_ptr, size_t offset, size_t size);
+
+	py::object* DecodeObjectStrings(const FeatureRef& feature, py::object* out);
 }
 
 inline const char* Records::DataTypeString(DataType dtype)
@@ -46,12 +59,66 @@ inline const char* Records::DataTypeString(DataType dtype)
 			return "uint8";
 		case DataType::DT_STRING:
 			return "string";
+		case DataType::DT_INT32:
+			return "int32";
+		case DataType::DT_HALF:
+			return "float16";
+		case DataType::DT_BFLOAT16:
+			return "bfloat16";
 		case DataType::DT_INVALID:
 		default:
 			return "invalid";
 	}
 }
 
+// Numpy dtype of outputs. bfloat16 values are stored as uint16.
+inline py::dtype Records::NumpyDType(DataType dtype)
+{
+	switch (dtype)
+	{
+		case DataType::DT_FLOAT:
+			return py::dtype("float32");
+		case DataType::DT_INT64:
+			return py::dtype("int64");
+		case DataType::DT_UINT8:
+			return py::dtype("uint8");
+		case DataType::DT_STRING:
+			return py::dtype("object");
+		case DataType::DT_INT32:
+			return py::dtype("int32");
+		case DataType::DT_HALF:
+			return py::dtype("float16");
+		case DataType::DT_BFLOAT16:
+			return py::dtype("uint16");
+		case DataType::DT_INVALID:
+		default:
+			throw runtime_error("Invalid input dtype: %s", DataTypeString(dtype));
+	}
+}
+
+inline size_t Records::DataTypeSize(DataType dtype)
+{
+	switch (dtype)
+	{
+		case DataType::DT_FLOAT:
+			return sizeof(float);
+		case DataType::DT_INT64:
+			return sizeof(int64_t);
+		case DataType::DT_UINT8:
+			return sizeof(uint8_t);
+		case DataType::DT_STRING:
+			return sizeof(PyObject*);
+		case DataType::DT_INT32:
+			return sizeof(int32_t);
+		case DataType::DT_HALF:
+		case DataType::DT_BFLOAT16:
+			return sizeof(uint16_t);
+		case DataType::DT_INVALID:
+		default:
+			throw runtime_error("Invalid input dtype: %s", DataTypeString(dtype));
+	}
+}
+
 inline size_t Records::num_elements(const TensorShape& shape)
 {
 	size_t num = 1;
@@ -62,16 +129,15 @@ inline size_t Records::num_elements(const TensorShape& shape)
 	return num;
 }
 
-inline Records::DataType Records::Feature2DataType(const Feature& feature)
+inline Records::DataType Records::Feature2DataType(const FeatureRef& feature)
 {
-	auto feature_type = feature.kind_case();
-	switch (feature_type)
+	switch (feature.kind)
 	{
-		case Feature::kInt64List:
+		case FeatureKind::INT64_LIST:
 			return DataType::DT_INT64;
-		case Feature::kFloatList:
+		case FeatureKind::FLOAT_LIST:
 			return DataType::DT_FLOAT;
-		case Feature::kBytesList:
+		case FeatureKind::BYTES_LIST:
 			return DataType::DT_STRING;
 		default:
 			return DataType::DT_INVALID;
@@ -93,6 +159,18 @@ inline std::string Records::Shape2str(const TensorShape& shape)
 }
 
 
+// Returns true if `obj` is a C-contiguous array of numpy dtype of `dtype`
+inline bool Records::IsArrayOf(const py::object& obj, DataType dtype)
+{
+	if (!py::isinstance<py::array>(obj))
+	{
+		return false;
+	}
+	auto array = py::reinterpret_borrow<py::array>(obj);
+	int equal = PyObject_RichCompareBool(array.dtype().ptr(), NumpyDType(dtype).ptr(), Py_EQ);
+	return equal == 1 && (array.flags() & py::array::c_style) != 0;
+}
+
 inline std::pair<py::object, void*> Records::TensorFactoryPtr(DataType dtype, const TensorShape& shape)
 {
 	switch (dtype)
@@ -127,6 +205,13 @@ inline std::pair<py::object, void*> Records::TensorFactoryPtr(DataType dtype, co
 			auto buffer = tensor.request();
 			return std::make_pair(tensor, buffer.ptr);
 		}
+		case DataType::DT_INT32:
+		case DataType::DT_HALF:
+		case DataType::DT_BFLOAT16:
+		{
+			auto tensor = py::array(NumpyDType(dtype), shape);
+			return std::make_pair(tensor, tensor.mutable_data());
+		}
 		case DataType::DT_INVALID:
 		default:
 		{
@@ -159,6 +244,16 @@ inline void* Records::GetPtr(py::object& tensor, DataType dtype)
 			auto buffer = ndarray_object(tensor).request();
 			return buffer.ptr;
 		}
+		case DataType::DT_INT32:
+		case DataType::DT_HALF:
+		case DataType::DT_BFLOAT16:
+		{
+			if (!IsArrayOf(tensor, dtype))
+			{
+				throw runtime_error("Output must be a C-contiguous array of %s", DataTypeString(dtype));
+			}
+			return py::reinterpret_borrow<py::array>(tensor).mutable_data();
+		}
 		case DataType::DT_INVALID:
 		default:
 		{
@@ -167,100 +262,282 @@ inline void* Records::GetPtr(py::object& tensor, DataType dtype)
 	}
 }
 
-bool Records::FeatureDecode(std::size_t out_index, const std::string& key, const DataType& dtype,
-                      const TensorShape& shape, const Feature& feature, void* out_ptr)
+bool Records::FeatureDecode(std::size_t out_index, const RecordParser::FixedLenFeature& feature_config,
+                            const FeatureRef& feature, void* out_ptr)
 {
+	const std::string& key = feature_config.key;
+	const TensorShape& shape = feature_config.shape;
+	const DataType out_dtype = feature_config.OutputType();
 	const std::size_t num = num_elements(shape);
 	const std::size_t offset = out_index * num;
 
-	switch (dtype)
+	// Values that are converted are read to the scratch of the calling thread first
+	static thread_local std::vector<uint64_t> scratch;
+
+	switch (feature_config.dtype)
 	{
 		case DataType::DT_INT64:
 		{
-			const Int64List& values = feature.int64_list();
-			if (static_cast<size_t>(values.value_size()) != num)
+			// Values are written to the output directly, count is checked before anything is written past it
+			auto out_p = (int64_t*)out_ptr + offset;
+			if (out_dtype != DataType::DT_INT64)
 			{
-				throw runtime_error("Key: %s. Number of int64 values != expected. Values size: %zd but output shape: %s", key.c_str(), values.value_size(), Shape2str(shape).c_str());
+				scratch.resize(num);
+				out_p = (int64_t*)scratch.data();
+			}
+			size_t count = ReadInt64List(feature, out_p, num);
+			if (count != num)
+			{
+				throw runtime_error("Key: %s. Number of int64 values != expected. Values size: %zd but output shape: %s", key.c_str(), count, Shape2str(shape).c_str());
+			}
+			if (out_dtype == DataType::DT_INT32)
+			{
+				ConvertInt64ToInt32(out_p, (int32_t*)out_ptr + offset, num);
 			}
-			auto out_p = (int64_t*)out_ptr + offset;
-			memcpy(out_p, values.value().data(), num * sizeof(int64_t));
 			return true;
 		}
 		case DataType::DT_FLOAT:
 		{
-			const FloatList& values = feature.float_list();
-			if (static_cast<size_t>(values.value_size()) != num)
+			auto out_p = (float*)out_ptr + offset;
+			if (out_dtype != DataType::DT_FLOAT)
 			{
-				throw runtime_error("Key: %s. Number of float values != expected. Values size: %zd but output shape: %s", key.c_str(), values.value_size(), Shape2str(shape).c_str());
+				scratch.resize((num + 1) / 2);
+				out_p = (float*)scratch.data();
 			}
-			auto out_p = (float*)out_ptr + offset;
-			memcpy(out_p, values.value().data(), num * sizeof(float));
-			return true;
-		}
-		case DataType::DT_STRING:
-		{
-			const BytesList& values = feature.bytes_list();
-			if (static_cast<size_t>(values.value_size()) != num)
+			size_t count = ReadFloatList(feature, out_p, num);
+			if (count != num)
 			{
-				throw runtime_error("Key: %s. Number of bytes values != expected. Values size: %zd but output shape: %s", key.c_str(), values.value_size(), Shape2str(shape).c_str());
+				throw runtime_error("Key: %s. Number of float values != expected. Values size: %zd but output shape: %s", key.c_str(), count, Shape2str(shape).c_str());
 			}
-			py::object* ptr = (py::object*)out_ptr + offset;
-
-			for (int i = 0; i < num; ++i)
+			if (out_dtype == DataType::DT_HALF)
 			{
-				const std::string& s = *values.value().data()[i];
-				*(ptr + i) = py::bytes(s);
+				ConvertFloatToHalf(out_p, (uint16_t*)out_ptr + offset, num);
+			}
+			else if (out_dtype == DataType::DT_BFLOAT16)
+			{
+				ConvertFloatToBFloat16(out_p, (uint16_t*)out_ptr + offset, num);
 			}
-
 			return true;
 		}
 		case DataType::DT_UINT8:
 		{
-			const BytesList& values = feature.bytes_list();
 			size_t size = 0;
-			for (int i = 0; i < values.value_size(); ++i)
-			{
-				const std::string& s = *values.value().data()[i];
-				size += s.size();
-			}
+			ForEachBytes(feature, [&size](const uint8_t*, size_t value_size) { size += value_size; });
 			if (size != num)
 			{
 				throw runtime_error("Key: %s. Number of uint8 values != expected. Values size: %zd but output shape: %s", key.c_str(), size, Shape2str(shape).c_str());
 			}
+			if (out_dtype == DataType::DT_FLOAT)
+			{
+				float* ptr = (float*)out_ptr + offset;
+				float scale = feature_config.scale;
+				ForEachBytes(feature, [&ptr, scale](const uint8_t* data, size_t value_size)
+				{
+					ConvertUInt8ToFloat(data, ptr, value_size, scale);
+					ptr += value_size;
+				});
+				return true;
+			}
 			uint8_t* ptr = (uint8_t*)out_ptr;
 			ptr += offset;
-			for (int i = 0; i < values.value_size(); ++i)
+			ForEachBytes(feature, [&ptr](const uint8_t* data, size_t value_size)
 			{
-				const std::string& s = *values.value().data()[i];
-				memcpy(ptr, s.data(), s.size());
-				ptr += s.size();
-			}
+				memcpy(ptr, data, value_size);
+				ptr += value_size;
+			});
 			return true;
 		}
 
+		default:
+			throw runtime_error("Invalid input dtype: %s", DataTypeString(feature_config.dtype));
+	}
+}
+
+// Number of values of a var-len feature, for uint8 dtype number of bytes
+size_t Records::VarLenFeatureSize(const FeatureRef& feature, DataType dtype)
+{
+	size_t size = 0;
+	switch (dtype)
+	{
+		case DataType::DT_INT64:
+			return ReadInt64List(feature, nullptr, 0);
+		case DataType::DT_FLOAT:
+			return ReadFloatList(feature, nullptr, 0);
+		case DataType::DT_STRING:
+			ForEachBytes(feature, [&size](const uint8_t*, size_t) { ++size; });
+			return size;
+		case DataType::DT_UINT8:
+			ForEachBytes(feature, [&size](const uint8_t*, size_t value_size) { size += value_size; });
+			return size;
+		default:
+			throw runtime_error("Invalid input dtype: %s", DataTypeString(dtype));
+	}
+}
+
+// Copies `size` values of a var-len feature to the output, starting from `offset`. Does not support string dtype,
+// see DecodeObjectStrings.
+void Records::VarLenFeatureDecode(const FeatureRef& feature, DataType dtype, void* out_ptr, size_t offset, size_t size)
+{
+	switch (dtype)
+	{
+		case DataType::DT_INT64:
+			ReadInt64List(feature, (int64_t*)out_ptr + offset, size);
+			break;
+		case DataType::DT_FLOAT:
+			ReadFloatList(feature, (float*)out_ptr + offset, size);
+			break;
+		case DataType::DT_UINT8:
+		{
+			uint8_t* ptr = (uint8_t*)out_ptr + offset;
+			ForEachBytes(feature, [&ptr](const uint8_t* data, size_t value_size)
+			{
+				memcpy(ptr, data, value_size);
+				ptr += value_size;
+			});
+			break;
+		}
 		default:
 			throw runtime_error("Invalid input dtype: %s", DataTypeString(dtype));
 	}
 }
 
-Records::RecordParser::RecordParser(const py::dict& features, bool run_parallel, int worker_count): m_run_parallel(run_parallel)//, m_threadPool(worker_count)
+// Creates bytes objects of a bytes list, starting from `out`. Returns pointer past the last one. Requires GIL.
+py::object* Records::DecodeObjectStrings(const FeatureRef& feature, py::object* out)
+{
+	ForEachBytes(feature, [&out](const uint8_t* data, size_t size)
+	{
+		*out++ = py::bytes((const char*)data, size);
+	});
+	return out;
+}
+
+// Throws if values of the feature can not be decoded to its output dtype
+static void CheckConversion(const Records::RecordParser::FixedLenFeature& feature_config)
+{
+	using namespace Records;
+	DataType dtype = feature_config.dtype;
+	DataType out_dtype = feature_config.OutputType();
+	bool valid;
+	switch (dtype)
+	{
+		case DataType::DT_FLOAT:
+			valid = out_dtype == DataType::DT_FLOAT || out_dtype == DataType::DT_HALF || out_dtype == DataType::DT_BFLOAT16;
+			break;
+		case DataType::DT_INT64:
+			valid = out_dtype == DataType::DT_INT64 || out_dtype == DataType::DT_INT32;
+			break;
+		case DataType::DT_UINT8:
+			valid = out_dtype == DataType::DT_UINT8 || out_dtype == DataType::DT_FLOAT;
+			break;
+		case DataType::DT_STRING:
+			valid = out_dtype == DataType::DT_STRING;
+			break;
+		default:
+			throw runtime_error("Feature %s. Values can not be stored as %s", feature_config.key.c_str(), DataTypeString(dtype));
+	}
+	if (!valid)
+	{
+		throw runtime_error("Feature %s. Values of %s can not be converted to %s", feature_config.key.c_str(),
+		                    DataTypeString(dtype), DataTypeString(out_dtype));
+	}
+	if (feature_config.scale != 1.0f && !(dtype == DataType::DT_UINT8 && out_dtype == DataType::DT_FLOAT))
+	{
+		throw runtime_error("Feature %s. Scale is only applied to uint8 values that are converted to float32", feature_config.key.c_str());
+	}
+}
+
+Records::RecordParser::RecordParser(const py::dict& features, bool run_parallel, int worker_count, bool native_strings,
+                                    int batch_buffers):
+		m_run_parallel(run_parallel), m_worker_count(worker_count), m_native_strings(native_strings)
 {
 	for (auto item : features)
 	{
 		const std::string& key = py::cast<std::string>(item.first);
-		auto fixedLenFeature = py::cast<FixedLenFeature>(item.second);
-		fixedLenFeature.key = key;
-		fixed_len_features.push_back(fixedLenFeature);
+		if (py::isinstance<VarLenFeature>(item.second))
+		{
+			auto varLenFeature = py::cast<VarLenFeature>(item.second);
+			varLenFeature.key = key;
+			var_len_features.push_back(varLenFeature);
+			m_outputs.push_back({true, var_len_features.size() - 1});
+		}
+		else
+		{
+			auto fixedLenFeature = py::cast<FixedLenFeature>(item.second);
+			fixedLenFeature.key = key;
+			CheckConversion(fixedLenFeature);
+			fixed_len_features.push_back(fixedLenFeature);
+			m_outputs.push_back({false, fixed_len_features.size() - 1});
+		}
+	}
+	for (size_t d = 0; d < fixed_len_features.size(); ++d)
+	{
+		m_keys.push_back(fixed_len_features[d].key);
+		if (fixed_len_features[d].dtype == DataType::DT_STRING)
+		{
+			m_string_features.push_back(d);
+		}
+	}
+	for (const auto& feature_config: var_len_features)
+	{
+		m_keys.push_back(feature_config.key);
+	}
+	if (batch_buffers > 0)
+	{
+		for (size_t d = 0; d < fixed_len_features.size(); ++d)
+		{
+			m_rings.push_back(std::make_shared<BufferRing>(batch_buffers));
+		}
 	}
 }
 
 void Records::RecordParser::ParseSingleExampleInplace(const std::string& serialized, std::vector<py::object>& output, int batch_index)
 {
-	Example example;
-	example.ParseFromString(serialized);
+	if (!var_len_features.empty())
+	{
+		throw runtime_error("VarLenFeature can not be parsed in place");
+	}
+	std::vector<void*> output_ptrs;
+	{
+		py::gil_scoped_acquire acquire;
+		for (size_t d = 0; d < fixed_len_features.size(); ++d)
+		{
+			output_ptrs.push_back(GetPtr(output[d], fixed_len_features[d].OutputType()));
+		}
+	}
+	std::vector<Row> rows(RowsPerExample());
+	ParseSingleExampleImpl({serialized.data(), serialized.size()}, output_ptrs, batch_index, rows.data());
+
+	// Strings are always written as bytes objects here, to the arrays that were passed
+	py::gil_scoped_acquire acquire;
+	for (size_t s = 0; s < m_string_features.size(); ++s)
+	{
+		size_t d = m_string_features[s];
+		auto ptr = (py::object*)output_ptrs[d] + batch_index * num_elements(fixed_len_features[d].shape);
+		DecodeObjectStrings(rows[s].feature, ptr);
+	}
+}
+
+// Counts values of a bytes list and their total size
+static void ScanBytesList(const Records::FeatureRef& feature, size_t& count, size_t& bytes)
+{
+	count = 0;
+	bytes = 0;
+	Records::ForEachBytes(feature, [&count, &bytes](const uint8_t*, size_t size)
+	{
+		++count;
+		bytes += size;
+	});
+}
 
-	const Features& features = example.features();
-	const auto& feature_dict = features.feature();
+void Records::RecordParser::ParseSingleExampleImpl(const SerializedExample& serialized, std::vector<void*>& output, int batch_index,
+                                                   Row* rows)
+{
+	// Scratch of the calling thread, reused by all examples it parses
+	static thread_local std::vector<FeatureRef> features;
+	ScanExample(serialized.data, serialized.size, m_keys, features);
+
+	Row* string_rows = rows;
+	Row* var_len_rows = rows + m_string_features.size();
 
 	for (size_t d = 0; d < fixed_len_features.size(); ++d)
 	{
@@ -268,9 +545,7 @@ void Records::RecordParser::ParseSingleExampleInplace(const std::string& seriali
 		const py::object& default_value = feature_config.default_value;
 		bool required = !default_value;
 
-		const auto& feature_found = feature_dict.find(feature_config.key);
-		const bool feature_has_data = (feature_found != feature_dict.end() &&
-		                               (feature_found->second.kind_case() != Feature::KIND_NOT_SET));
+		const bool feature_has_data = features[d].kind != FeatureKind::NOT_SET;
 
 		const bool required_ok = feature_has_data || !required;
 		if (!required_ok)
@@ -280,7 +555,7 @@ void Records::RecordParser::ParseSingleExampleInplace(const std::string& seriali
 
 		if (feature_has_data)
 		{
-			const Feature& f = feature_found->second;
+			const FeatureRef& f = features[d];
 			DataType tmp_dtype = feature_config.dtype;
 			if (tmp_dtype == DataType::DT_UINT8)
 			{
@@ -292,16 +567,24 @@ void Records::RecordParser::ParseSingleExampleInplace(const std::string& seriali
 				throw runtime_error(
 						//"Name: %s, "
 						"Feature: %s. Data types don't match. Expected type: %s,  Feature is: %s",
-						feature_config.key.c_str(), DataTypeString(feature_config.dtype), f.DebugString().c_str());
+						feature_config.key.c_str(), DataTypeString(feature_config.dtype), DataTypeString(Feature2DataType(f)));
 
 			}
-
-			void* output_ = nullptr;
+			if (feature_config.dtype == DataType::DT_STRING)
 			{
-				py::gil_scoped_acquire acquire;
-				output_ = GetPtr(output[d], feature_config.dtype);
+				// Strings are copied to the output once the whole batch is scanned, see DecodeStringFeatures
+				Row& row = *string_rows++;
+				row.feature = f;
+				ScanBytesList(f, row.size, row.bytes);
+				if (row.size != num_elements(feature_config.shape))
+				{
+					throw runtime_error("Key: %s. Number of bytes values != expected. Values size: %zd but output shape: %s", feature_config.key.c_str(), row.size, Shape2str(feature_config.shape).c_str());
+				}
+			}
+			else
+			{
+				FeatureDecode(batch_index, feature_config, f, output[d]);
 			}
-			FeatureDecode(batch_index, feature_config.key, feature_config.dtype, feature_config.shape, f, output_);
 		}
 		else
 		{
@@ -309,122 +592,430 @@ void Records::RecordParser::ParseSingleExampleInplace(const std::string& seriali
 			throw runtime_error("Feature %s data is missing. Default value is not implemented yet", feature_config.key.c_str());
 		}
 	}
+
+	for (size_t v = 0; v < var_len_features.size(); ++v)
+	{
+		const VarLenFeature& feature_config = var_len_features[v];
+		const FeatureRef& f = features[fixed_len_features.size() + v];
+		var_len_rows[v] = Row();
+		if (f.kind == FeatureKind::NOT_SET)
+		{
+			continue;
+		}
+		DataType tmp_dtype = feature_config.dtype;
+		if (tmp_dtype == DataType::DT_UINT8)
+		{
+			tmp_dtype = DataType::DT_STRING;
+		}
+		if (Feature2DataType(f) != tmp_dtype)
+		{
+			throw runtime_error(
+					"Feature: %s. Data types don't match. Expected type: %s,  Feature is: %s",
+					feature_config.key.c_str(), DataTypeString(feature_config.dtype), DataTypeString(Feature2DataType(f)));
+		}
+		var_len_rows[v].feature = f;
+		if (feature_config.dtype == DataType::DT_STRING)
+		{
+			ScanBytesList(f, var_len_rows[v].size, var_len_rows[v].bytes);
+		}
+		else
+		{
+			var_len_rows[v].size = VarLenFeatureSize(f, feature_config.dtype);
+		}
+	}
 }
 
-void Records::RecordParser::ParseSingleExampleImpl(const std::string& serialized, std::vector<void*>& output, int batch_index)
+// Returns memory of a buffer, that must be contiguous. Requires GIL.
+static Records::SerializedExample BufferToExample(const py::buffer_info& info)
 {
-	Example example;
-	example.ParseFromString(serialized);
+	if (info.ndim > 1 || (info.ndim == 1 && info.strides[0] != info.itemsize))
+	{
+		throw runtime_error("Serialized example must be a contiguous buffer");
+	}
+	return {info.ptr, (size_t)(info.size * info.itemsize)};
+}
 
-	const Features& features = example.features();
-	const auto& feature_dict = features.feature();
+py::list Records::RecordParser::ParseExample(const std::vector<std::string>& serialized, const py::object& out)
+{
+	std::vector<SerializedExample> examples;
+	examples.reserve(serialized.size());
+	for (const auto& s: serialized)
+	{
+		examples.push_back({s.data(), s.size()});
+	}
+	return ParseExampleImpl(examples, out);
+}
 
-	for (size_t d = 0; d < fixed_len_features.size(); ++d)
+py::list Records::RecordParser::ParseExampleBuffers(const std::vector<py::buffer>& serialized, const py::object& out)
+{
+	// Buffers stay acquired until parsing is done
+	std::vector<py::buffer_info> buffers;
+	std::vector<SerializedExample> examples;
+	buffers.reserve(serialized.size());
+	examples.reserve(serialized.size());
+	for (const auto& b: serialized)
 	{
-		const FixedLenFeature& feature_config = fixed_len_features[d];
-		const py::object& default_value = feature_config.default_value;
-		bool required = !default_value;
+		buffers.push_back(b.request());
+		examples.push_back(BufferToExample(buffers.back()));
+	}
+	return ParseExampleImpl(examples, out);
+}
 
-		const auto& feature_found = feature_dict.find(feature_config.key);
-		const bool feature_has_data = (feature_found != feature_dict.end() &&
-		                               (feature_found->second.kind_case() != Feature::KIND_NOT_SET));
+py::list Records::RecordParser::ParseExampleImpl(const std::vector<SerializedExample>& serialized, const py::object& out)
+{
+	const size_t var_count = var_len_features.size();
+	const size_t stride = RowsPerExample();
+	std::vector<py::object> tensors;
+	std::vector<void*> tensor_ptrs;
+	std::vector<py::object> row_splits;
+	std::vector<int64_t*> row_splits_ptrs;
+	std::vector<Row> rows(serialized.size() * stride);
 
-		const bool required_ok = feature_has_data || !required;
-		if (!required_ok)
+	// Outputs given by the caller, for each fixed-len feature
+	std::vector<py::object> fixed_out(fixed_len_features.size(), py::none());
+	if (!out.is(py::none()))
+	{
+		auto out_list = py::cast<std::vector<py::object> >(out);
+		if (out_list.size() != m_outputs.size())
 		{
-			throw runtime_error("Feature %s is required but could not be found.", feature_config.key.c_str());
+			throw runtime_error("Argument `out` must have an entry for each of %zd features, got %zd", m_outputs.size(), out_list.size());
 		}
-
-		if (feature_has_data)
+		for (size_t i = 0; i < m_outputs.size(); ++i)
 		{
-			const Feature& f = feature_found->second;
-			DataType tmp_dtype = feature_config.dtype;
-			if (tmp_dtype == DataType::DT_UINT8)
+			if (m_outputs[i].var_len && !out_list[i].is(py::none()))
 			{
-				tmp_dtype = DataType::DT_STRING;
+				throw runtime_error("Output can not be given for VarLenFeature %s", var_len_features[m_outputs[i].index].key.c_str());
 			}
-
-			if (Feature2DataType(f) != tmp_dtype)
+			if (!m_outputs[i].var_len)
 			{
-				throw runtime_error(
-						//"Name: %s, "
-						"Feature: %s. Data types don't match. Expected type: %s,  Feature is: %s",
-						feature_config.key.c_str(), DataTypeString(feature_config.dtype), f.DebugString().c_str());
+				fixed_out[m_outputs[i].index] = out_list[i];
+			}
+		}
+	}
+
+	for (size_t d = 0; d < fixed_len_features.size(); ++d)
+	{
+		auto result = MakeBatchTensor(d, serialized.size(), fixed_out[d]);
+		tensors.push_back(result.first);
+		tensor_ptrs.push_back(result.second);
+	}
+	for (size_t v = 0; v < var_count; ++v)
+	{
+		auto result = TensorFactoryPtr(DataType::DT_INT64, TensorShape({serialized.size() + 1}));
+		row_splits.push_back(result.first);
+		row_splits_ptrs.push_back((int64_t*)result.second);
+	}
 
+	{
+		py::gil_scoped_release release;
+
+		ForEachExample(serialized.size(), [&](size_t idx)
+		{
+			ParseSingleExampleImpl(serialized[idx], tensor_ptrs, (int)idx, rows.data() + idx * stride);
+		});
+
+		for (size_t v = 0; v < var_count; ++v)
+		{
+			size_t column = m_string_features.size() + v;
+			row_splits_ptrs[v][0] = 0;
+			for (size_t idx = 0; idx < serialized.size(); ++idx)
+			{
+				row_splits_ptrs[v][idx + 1] = row_splits_ptrs[v][idx] + rows[idx * stride + column].size;
 			}
-			FeatureDecode(batch_index, feature_config.key, feature_config.dtype, feature_config.shape, f, output[d]);
+		}
+	}
+
+	DecodeStringFeatures(rows, serialized.size(), tensors, tensor_ptrs);
+	std::vector<py::object> values = DecodeVarLenFeatures(rows, row_splits_ptrs, serialized.size());
+
+	py::list output;
+	for (const auto& slot: m_outputs)
+	{
+		if (!slot.var_len)
+		{
+			output.append(tensors[slot.index]);
+		}
+		else if (var_len_features[slot.index].dtype == DataType::DT_STRING && m_native_strings)
+		{
+			py::tuple strings = values[slot.index];
+			output.append(py::make_tuple(strings[0], strings[1], row_splits[slot.index]));
 		}
 		else
 		{
-			// TODO, If the value is missing, copy the default
-			throw runtime_error("Feature %s data is missing. Default value is not implemented yet", feature_config.key.c_str());
+			output.append(py::make_tuple(values[slot.index], row_splits[slot.index]));
 		}
 	}
+	return output;
 }
 
-py::list Records::RecordParser::ParseExample(const std::vector<std::string>& serialized)
+// Returns data of an array that is given as output, checking that it can be written as is. Requires GIL.
+static void* OutputPtr(const py::object& out, Records::DataType dtype, const Records::TensorShape& shape, const std::string& key)
 {
-	py::list tensors;
-	std::vector<void*> tensor_ptrs;
+	using namespace Records;
+	if (!IsArrayOf(out, dtype))
 	{
-		py::gil_scoped_release release;
-		tensor_ptrs.reserve(fixed_len_features.size());
-		std::vector<std::pair<DataType, TensorShape> > tensorTypeAndShape;
-		for (const auto& feature_config: fixed_len_features)
+		throw runtime_error("Output for feature %s must be a C-contiguous array of %s", key.c_str(), DataTypeString(dtype));
+	}
+	auto array = py::reinterpret_borrow<py::array>(out);
+	bool same_shape = (size_t)array.ndim() == shape.size();
+	for (size_t i = 0; same_shape && i < shape.size(); ++i)
+	{
+		same_shape = (size_t)array.shape(i) == shape[i];
+	}
+	if (!same_shape)
+	{
+		throw runtime_error("Output for feature %s must have shape %s", key.c_str(), Shape2str(shape).c_str());
+	}
+	if (!array.writeable())
+	{
+		throw runtime_error("Output for feature %s is not writeable", key.c_str());
+	}
+	return array.mutable_data();
+}
+
+// Buffer of a ring that is held by an array
+struct HIDDEN RingLease
+{
+	std::shared_ptr<BufferRing> ring;
+	uint8_t* data;
+	size_t capacity;
+};
+
+std::pair<py::object, void*> Records::RecordParser::MakeBatchTensor(size_t d, size_t batch_size, const py::object& out)
+{
+	const FixedLenFeature& feature_config = fixed_len_features[d];
+	DataType dtype = feature_config.OutputType();
+	TensorShape shape(feature_config.shape.size() + 1);
+	memcpy(&shape[1], feature_config.shape.data(), feature_config.shape.size() * sizeof(size_t));
+	shape[0] = batch_size;
+
+	if (dtype == DataType::DT_STRING && m_native_strings)
+	{
+		if (!out.is(py::none()))
 		{
-			TensorShape out_shape(feature_config.shape.size() + 1);
-			memcpy(&out_shape[1], feature_config.shape.data(), feature_config.shape.size() * sizeof(size_t));
-			out_shape[0] = serialized.size();
-			tensorTypeAndShape.push_back(std::make_pair(feature_config.dtype, out_shape));
+			throw runtime_error("Output can not be given for feature %s, strings are native", feature_config.key.c_str());
 		}
+		// Allocated by DecodeStringFeatures, when the size is known
+		return std::make_pair(py::none(), nullptr);
+	}
+	if (!out.is(py::none()))
+	{
+		return std::make_pair(out, OutputPtr(out, dtype, shape, feature_config.key));
+	}
+
+	size_t size = num_elements(shape);
+	if (m_rings.empty() || dtype == DataType::DT_STRING || size == 0)
+	{
+		return TensorFactoryPtr(dtype, shape);
+	}
+	size *= DataTypeSize(dtype);
+	size_t capacity = 0;
+	uint8_t* data = m_rings[d]->Acquire(size, capacity);
+	if (data == nullptr)
+	{
+		// All buffers are still held by previous batches
+		return TensorFactoryPtr(dtype, shape);
+	}
+
+	auto* lease = new RingLease{m_rings[d], data, capacity};
+	py::capsule base(lease, [](void* p)
+	{
+		auto* lease = (RingLease*)p;
+		lease->ring->Release(lease->data, lease->capacity);
+		delete lease;
+	});
+	return std::make_pair(py::array(NumpyDType(dtype), shape, data, base), data);
+}
+
+void Records::RecordParser::DecodeStringFeatures(const std::vector<Row>& rows, size_t batch_size,
+                                                 std::vector<py::object>& tensors, const std::vector<void*>& tensor_ptrs)
+{
+	const size_t stride = RowsPerExample();
+	for (size_t s = 0; s < m_string_features.size(); ++s)
+	{
+		size_t d = m_string_features[s];
+		if (m_native_strings)
 		{
-			py::gil_scoped_acquire acquire;
-			for (const auto& prop: tensorTypeAndShape)
-			{
-				auto result = TensorFactoryPtr(prop.first, prop.second);
-				auto tensor = result.first;
-				auto tensor_ptr = result.second;
-				tensors.append(tensor);
-				tensor_ptrs.push_back(tensor_ptr);
-			}
+			tensors[d] = DecodeNativeStrings(rows, s, batch_size);
+			continue;
 		}
+		auto ptr = (py::object*)tensor_ptrs[d];
+		for (size_t idx = 0; idx < batch_size; ++idx)
+		{
+			ptr = DecodeObjectStrings(rows[idx * stride + s].feature, ptr);
+		}
+	}
+}
 
-		int l = serialized.size();
-		if (m_run_parallel)
+std::vector<py::object> Records::RecordParser::DecodeVarLenFeatures(const std::vector<Row>& rows,
+                                                                    const std::vector<int64_t*>& row_splits,
+                                                                    size_t batch_size)
+{
+	const size_t var_count = var_len_features.size();
+	const size_t stride = RowsPerExample();
+	const size_t first_column = m_string_features.size();
+	std::vector<py::object> values(var_count);
+	std::vector<void*> values_ptrs(var_count);
+	bool has_numeric = false;
+	for (size_t v = 0; v < var_count; ++v)
+	{
+		DataType dtype = var_len_features[v].dtype;
+		if (dtype == DataType::DT_STRING && m_native_strings)
+		{
+			values[v] = DecodeNativeStrings(rows, first_column + v, batch_size);
+			continue;
+		}
+		auto result = TensorFactoryPtr(dtype, TensorShape({(size_t)row_splits[v][batch_size]}));
+		values[v] = result.first;
+		values_ptrs[v] = result.second;
+		if (dtype == DataType::DT_STRING)
 		{
-            #pragma omp parallel for
-			for (int idx = 0; idx < l; ++idx)
+			auto ptr = (py::object*)values_ptrs[v];
+			for (size_t idx = 0; idx < batch_size; ++idx)
 			{
-				ParseSingleExampleImpl(serialized[idx], tensor_ptrs, idx);
+				ptr = DecodeObjectStrings(rows[idx * stride + first_column + v].feature, ptr);
 			}
 		}
 		else
 		{
-			for (int idx = 0; idx < l; ++idx)
+			has_numeric = true;
+		}
+	}
+
+	// Everything except of bytes objects is copied in parallel without GIL
+	if (has_numeric)
+	{
+		py::gil_scoped_release release;
+		ForEachExample(batch_size, [&](size_t idx)
+		{
+			for (size_t v = 0; v < var_count; ++v)
 			{
-				ParseSingleExampleImpl(serialized[idx], tensor_ptrs, idx);
+				const Row& row = rows[idx * stride + first_column + v];
+				if (var_len_features[v].dtype != DataType::DT_STRING && row.size > 0)
+				{
+					VarLenFeatureDecode(row.feature, var_len_features[v].dtype, values_ptrs[v], row_splits[v][idx], row.size);
+				}
 			}
+		});
+	}
+	return values;
+}
+
+py::object Records::RecordParser::DecodeNativeStrings(const std::vector<Row>& rows, size_t column, size_t batch_size)
+{
+	const size_t stride = RowsPerExample();
+	std::vector<size_t> value_starts(batch_size + 1);
+	std::vector<size_t> byte_starts(batch_size + 1);
+	for (size_t idx = 0; idx < batch_size; ++idx)
+	{
+		const Row& row = rows[idx * stride + column];
+		value_starts[idx + 1] = value_starts[idx] + row.size;
+		byte_starts[idx + 1] = byte_starts[idx] + row.bytes;
+	}
+
+	auto data = TensorFactoryPtr(DataType::DT_UINT8, TensorShape({byte_starts[batch_size]}));
+	auto offsets = TensorFactoryPtr(DataType::DT_INT64, TensorShape({value_starts[batch_size] + 1}));
+	auto data_ptr = (uint8_t*)data.second;
+	auto offsets_ptr = (int64_t*)offsets.second;
+	offsets_ptr[0] = 0;
+	{
+		py::gil_scoped_release release;
+		ForEachExample(batch_size, [&](size_t idx)
+		{
+			uint8_t* dst = data_ptr + byte_starts[idx];
+			int64_t* offset = offsets_ptr + value_starts[idx] + 1;
+			ForEachBytes(rows[idx * stride + column].feature, [&](const uint8_t* value, size_t size)
+			{
+				memcpy(dst, value, size);
+				dst += size;
+				*offset++ = dst - data_ptr;
+			});
+		});
+	}
+	return py::make_tuple(data.first, offsets.first);
+}
+
+void Records::RecordParser::ForEachExample(size_t batch_size, const std::function<void(size_t)>& func)
+{
+	if (m_run_parallel)
+	{
+		// Shared pool, so that parsing does not oversubscribe cores together with reading and decoding
+		ThreadPool::Default().ParallelFor(batch_size, func, m_worker_count);
+	}
+	else
+	{
+		for (size_t idx = 0; idx < batch_size; ++idx)
+		{
+			func(idx);
 		}
 	}
-	return tensors;
+}
+
+py::list Records::RecordParser::ParseSingleExampleBuffer(const py::buffer& serialized)
+{
+	py::buffer_info buffer = serialized.request();
+	return ParseSingleExampleRef(BufferToExample(buffer));
 }
 
 py::list Records::RecordParser::ParseSingleExample(const std::string& serialized)
 {
-	py::list  tensors;
+	return ParseSingleExampleRef({serialized.data(), serialized.size()});
+}
+
+py::list Records::RecordParser::OutputDTypes() const
+{
+	py::list output;
+	for (const auto& slot: m_outputs)
+	{
+		DataType dtype = slot.var_len ? DataType::DT_STRING : fixed_len_features[slot.index].OutputType();
+		output.append(dtype == DataType::DT_STRING ? py::none() : py::cast(dtype));
+	}
+	return output;
+}
+
+py::list Records::RecordParser::ParseSingleExampleRef(const SerializedExample& serialized)
+{
+	std::vector<py::object> tensors;
 	std::vector<void*> tensor_ptrs;
 	tensor_ptrs.reserve(fixed_len_features.size());
 
 	for (const auto& feature_config: fixed_len_features)
 	{
-		auto result = TensorFactoryPtr(feature_config.dtype, feature_config.shape);
+		if (feature_config.dtype == DataType::DT_STRING && m_native_strings)
+		{
+			tensors.push_back(py::none());
+			tensor_ptrs.push_back(nullptr);
+			continue;
+		}
+		auto result = TensorFactoryPtr(feature_config.OutputType(), feature_config.shape);
 		auto tensor = result.first;
 		auto tensor_ptr = result.second;
-		tensors.append(tensor);
+		tensors.push_back(tensor);
 		tensor_ptrs.push_back(tensor_ptr);
 	}
 
-	py::gil_scoped_release release;
-	ParseSingleExampleImpl(serialized, tensor_ptrs, 0);
-	return tensors;
+	std::vector<Row> rows(RowsPerExample());
+	{
+		py::gil_scoped_release release;
+		ParseSingleExampleImpl(serialized, tensor_ptrs, 0, rows.data());
+	}
+
+	DecodeStringFeatures(rows, 1, tensors, tensor_ptrs);
+
+	// Values of var-len features of a single example are returned without row splits
+	std::vector<int64_t> splits(var_len_features.size() * 2);
+	std::vector<int64_t*> row_splits;
+	for (size_t v = 0; v < var_len_features.size(); ++v)
+	{
+		splits[v * 2 + 1] = rows[m_string_features.size() + v].size;
+		row_splits.push_back(&splits[v * 2]);
+	}
+	std::vector<py::object> values = DecodeVarLenFeatures(rows, row_splits, 1);
+
+	py::list output;
+	for (const auto& slot: m_outputs)
+	{
+		output.append(slot.var_len ? values[slot.index] : tensors[slot.index]);
+	}
+	return output;
 }
@@ -14,9 +14,13 @@
 
 #pragma once
 #include <string>
-#include "protobuf/example.pb.h"
+#include <vector>
+#include <functional>
+#include <memory>
 #include "MemRefFile.h"
 #include "common.h"
+#include "example_scanner.h"
+#include "buffer_ring.h"
 
 namespace Records
 {
@@ -24,13 +28,25 @@ namespace Records
 	{
 		DT_INVALID = 0,
 		DT_FLOAT = 1,
+		DT_INT32 = 3,
 		DT_UINT8 = 4,
 		DT_STRING = 7,
 		DT_INT64 = 9,
+		// Output only, stored as uint16 bits, numpy has no bfloat16 dtype
+		DT_BFLOAT16 = 14,
+		// Output only
+		DT_HALF = 19,
 	};
 
 	typedef std::vector<size_t> TensorShape;
 
+	// Serialized example, that is not owned, e.g. a part of memory mapped file
+	struct SerializedExample
+	{
+		const void* data;
+		size_t size;
+	};
+
 	class HIDDEN RecordParser
 	{
 	public:
@@ -46,23 +62,129 @@ namespace Records
 			{
 			}
 
+			// Dtype of the output, to which values are converted while decoding
+			DataType OutputType() const
+			{
+				return out_dtype == DataType::DT_INVALID ? dtype : out_dtype;
+			}
+
 			std::string key;
 			TensorShape shape;
 			DataType dtype;
 			py::object default_value;
+			// DT_INVALID if values are not converted
+			DataType out_dtype = DataType::DT_INVALID;
+			// Multiplier of uint8 values that are converted to float32
+			float scale = 1.0f;
+		};
+
+		// Feature with a variable number of values. Batch of such features is returned as `values`, that are
+		// values of all examples concatenated, and `row_splits`, where values of i-th example are
+		// values[row_splits[i]:row_splits[i + 1]], same as `tf.RaggedTensor.from_row_splits`. For uint8 dtype, each
+		// byte of bytes values is a value. Missing features are empty.
+		struct HIDDEN VarLenFeature
+		{
+			VarLenFeature() = default;
+
+			explicit VarLenFeature(DataType dtype): dtype(dtype)
+			{
+			}
+
+			std::string key;
+			DataType dtype = DataType::DT_INVALID;
 		};
 
-		explicit RecordParser(const py::dict& features, bool run_parallel=true, int worker_count=12);
+		// If `batch_buffers` is positive, outputs of fixed-len numeric and uint8 features of batches are placed in that
+		// many reused buffers, see BufferRing.
+		explicit RecordParser(const py::dict& features, bool run_parallel=true, int worker_count=12, bool native_strings=false,
+		                      int batch_buffers=0);
 
 		void ParseSingleExampleInplace(const std::string& serialized, std::vector<py::object>& output, int batch_index);
 
-		py::list ParseExample(const std::vector<std::string>& serialized);
+		// `out` is None, or a list with an entry per feature. Entries that are not None are arrays, that are filled
+		// instead of allocating new ones. Only fixed-len features can have them.
+		py::list ParseExample(const std::vector<std::string>& serialized, const py::object& out = py::none());
+
+		// Same as above, but takes any objects that support buffer protocol, e.g. bytes or record views of memory
+		// mapped files. Buffers are parsed in place, without copying.
+		py::list ParseExampleBuffers(const std::vector<py::buffer>& serialized, const py::object& out = py::none());
 
 		py::list ParseSingleExample(const std::string& serialized);
+
+		py::list ParseSingleExampleBuffer(const py::buffer& serialized);
+
+		// Output dtype of each entry of the feature dict, in order of outputs. None for var-len and string features,
+		// which are never exported as a different dtype. Requires GIL.
+		py::list OutputDTypes() const;
 	private:
-		void ParseSingleExampleImpl(const std::string& serialized, std::vector<void*>& output, int batch_index);
+		// Values of a string or var-len feature in one example. They are copied to the output once the whole batch is
+		// scanned: bytes objects need GIL, and offsets of rows in the output are not known before.
+		struct Row
+		{
+			FeatureRef feature;
+			// Number of values, for uint8 dtype number of bytes
+			size_t size = 0;
+			// Total size of bytes values, for string dtype
+			size_t bytes = 0;
+		};
+
+		// Output for an entry of the feature dict, index into `fixed_len_features` or `var_len_features`
+		struct OutputSlot
+		{
+			bool var_len;
+			size_t index;
+		};
+
+		py::list ParseExampleImpl(const std::vector<SerializedExample>& serialized, const py::object& out);
+
+		// Returns output of the fixed-len feature for the batch: `out`, if it is not None, an array in a buffer of
+		// the ring, or a new array. Requires GIL.
+		std::pair<py::object, void*> MakeBatchTensor(size_t d, size_t batch_size, const py::object& out);
+
+		py::list ParseSingleExampleRef(const SerializedExample& serialized);
+
+		// Rows of the example are string features in order of `m_string_features`, followed by var-len features
+		size_t RowsPerExample() const
+		{
+			return m_string_features.size() + var_len_features.size();
+		}
+
+		// Decodes numeric fixed-len features to `output` and finds values of string and var-len features, `rows` must
+		// have `RowsPerExample()` entries. Does not require GIL.
+		void ParseSingleExampleImpl(const SerializedExample& serialized, std::vector<void*>& output, int batch_index,
+		                            Row* rows);
+
+		// Copies string fixed-len features to their outputs, or replaces them with native strings. Requires GIL.
+		void DecodeStringFeatures(const std::vector<Row>& rows, size_t batch_size, std::vector<py::object>& tensors,
+		                          const std::vector<void*>& tensor_ptrs);
+
+		// Allocates values of var-len features and copies them, `row_splits` are offsets of rows in the output.
+		// Requires GIL.
+		std::vector<py::object> DecodeVarLenFeatures(const std::vector<Row>& rows,
+		                                             const std::vector<int64_t*>& row_splits, size_t batch_size);
+
+		// Copies bytes values of the given row column of all examples to a contiguous uint8 array and returns it
+		// together with int64 offsets, the i-th value is data[offsets[i]:offsets[i + 1]]. Copying is done in parallel
+		// without GIL. Requires GIL.
+		py::object DecodeNativeStrings(const std::vector<Row>& rows, size_t column, size_t batch_size);
+
+		// Calls `func(i)` for each example of the batch. If `m_run_parallel` is set, runs on the shared thread pool
+		// with at most `m_worker_count` threads. Exceptions are rethrown on the calling thread.
+		void ForEachExample(size_t batch_size, const std::function<void(size_t)>& func);
 
 		std::vector<FixedLenFeature> fixed_len_features;
+		std::vector<VarLenFeature> var_len_features;
+		std::vector<OutputSlot> m_outputs;
+		// Indices of `fixed_len_features` of string dtype
+		std::vector<size_t> m_string_features;
+		// Keys of `fixed_len_features` followed by keys of `var_len_features`, that are looked up in serialized
+		// examples
+		std::vector<std::string> m_keys;
 		bool m_run_parallel;
+		int m_worker_count;
+		// Strings are returned as contiguous data and offsets, instead of arrays of bytes objects
+		bool m_native_strings;
+		// Buffer rings for `fixed_len_features`, empty if they are not used
+		std::vector<std::shared_ptr<BufferRing> > m_rings;
 	};
 }
@@ -0,0 +1,218 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "example_scanner.h"
+#include <algorithm>
+
+
+// Returns index of the key, or -1. Number of features is small, so linear search with cheap rejection by size is
+// faster than hashing of the key.
+static int FindKey(const std::vector<std::string>& keys, const uint8_t* key, size_t key_size)
+{
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		if (keys[i].size() == key_size && memcmp(keys[i].data(), key, key_size) == 0)
+		{
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// Reads `Feature` message. Kinds are fields of a oneof, so the last one that is present wins.
+static Records::FeatureRef ScanFeature(const uint8_t* data, size_t size)
+{
+	Records::FeatureRef feature;
+	Records::WireReader reader(data, size);
+	uint32_t field;
+	int wire_type;
+	while (reader.NextField(field, wire_type))
+	{
+		if (field >= 1 && field <= 3 && wire_type == Records::WireReader::LENGTH_DELIMITED)
+		{
+			feature.kind = (Records::FeatureKind)field;
+			reader.ReadLengthDelimited(feature.data, feature.size);
+		}
+		else
+		{
+			reader.Skip(wire_type);
+		}
+	}
+	return feature;
+}
+
+// Reads an entry of `map<string, Feature>` of `Features` message
+static void ScanMapEntry(const uint8_t* data, size_t size, const std::vector<std::string>& keys,
+                         std::vector<Records::FeatureRef>& features)
+{
+	const uint8_t* key = nullptr;
+	size_t key_size = 0;
+	const uint8_t* value = nullptr;
+	size_t value_size = 0;
+
+	Records::WireReader reader(data, size);
+	uint32_t field;
+	int wire_type;
+	while (reader.NextField(field, wire_type))
+	{
+		if (field == 1 && wire_type == Records::WireReader::LENGTH_DELIMITED)
+		{
+			reader.ReadLengthDelimited(key, key_size);
+		}
+		else if (field == 2 && wire_type == Records::WireReader::LENGTH_DELIMITED)
+		{
+			reader.ReadLengthDelimited(value, value_size);
+		}
+		else
+		{
+			reader.Skip(wire_type);
+		}
+	}
+
+	int index = FindKey(keys, key, key_size);
+	if (index >= 0)
+	{
+		features[index] = value != nullptr ? ScanFeature(value, value_size) : Records::FeatureRef();
+	}
+}
+
+void Records::ScanExample(const void* data, size_t size, const std::vector<std::string>& keys,
+                          std::vector<FeatureRef>& features)
+{
+	features.assign(keys.size(), FeatureRef());
+
+	// Example.features, there may be several of them, which are merged
+	WireReader example((const uint8_t*)data, size);
+	uint32_t field;
+	int wire_type;
+	while (example.NextField(field, wire_type))
+	{
+		if (field != 1 || wire_type != WireReader::LENGTH_DELIMITED)
+		{
+			example.Skip(wire_type);
+			continue;
+		}
+		const uint8_t* features_data;
+		size_t features_size;
+		example.ReadLengthDelimited(features_data, features_size);
+
+		// Features.feature
+		WireReader reader(features_data, features_size);
+		while (reader.NextField(field, wire_type))
+		{
+			if (field == 1 && wire_type == WireReader::LENGTH_DELIMITED)
+			{
+				const uint8_t* entry;
+				size_t entry_size;
+				reader.ReadLengthDelimited(entry, entry_size);
+				ScanMapEntry(entry, entry_size, keys, features);
+			}
+			else
+			{
+				reader.Skip(wire_type);
+			}
+		}
+	}
+}
+
+size_t Records::ReadFloatList(const FeatureRef& feature, float* out, size_t capacity)
+{
+	size_t count = 0;
+	WireReader reader(feature.data, feature.size);
+	uint32_t field;
+	int wire_type;
+	while (reader.NextField(field, wire_type))
+	{
+		if (field != 1)
+		{
+			reader.Skip(wire_type);
+		}
+		else if (wire_type == WireReader::LENGTH_DELIMITED)
+		{
+			// Packed values are little endian floats, same as in memory
+			const uint8_t* data;
+			size_t size;
+			reader.ReadLengthDelimited(data, size);
+			if (size % sizeof(float) != 0)
+			{
+				throw runtime_error("Malformed serialized example: packed float list of %zd bytes", size);
+			}
+			size_t n = size / sizeof(float);
+			if (count < capacity)
+			{
+				memcpy(out + count, data, std::min(n, capacity - count) * sizeof(float));
+			}
+			count += n;
+		}
+		else if (wire_type == WireReader::FIXED32)
+		{
+			uint32_t value = reader.ReadFixed32();
+			if (count < capacity)
+			{
+				memcpy(out + count, &value, sizeof(float));
+			}
+			++count;
+		}
+		else
+		{
+			reader.Skip(wire_type);
+		}
+	}
+	return count;
+}
+
+size_t Records::ReadInt64List(const FeatureRef& feature, int64_t* out, size_t capacity)
+{
+	size_t count = 0;
+	WireReader reader(feature.data, feature.size);
+	uint32_t field;
+	int wire_type;
+	while (reader.NextField(field, wire_type))
+	{
+		if (field != 1)
+		{
+			reader.Skip(wire_type);
+		}
+		else if (wire_type == WireReader::LENGTH_DELIMITED)
+		{
+			const uint8_t* data;
+			size_t size;
+			reader.ReadLengthDelimited(data, size);
+			WireReader packed(data, size);
+			while (!packed.AtEnd())
+			{
+				int64_t value = (int64_t)packed.ReadVarint();
+				if (count < capacity)
+				{
+					out[count] = value;
+				}
+				++count;
+			}
+		}
+		else if (wire_type == WireReader::VARINT)
+		{
+			int64_t value = (int64_t)reader.ReadVarint();
+			if (count < capacity)
+			{
+				out[count] = value;
+			}
+			++count;
+		}
+		else
+		{
+			reader.Skip(wire_type);
+		}
+	}
+	return count;
+}
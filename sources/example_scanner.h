@@ -0,0 +1,185 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+// Reading of serialized `Example` messages (see protobuf/example.proto) directly from protobuf wire format, without
+// deserializing them. Values are not copied until they are written to the output, and no protobuf objects are created.
+// None of the functions require GIL.
+namespace Records
+{
+	// Which of `Feature.kind` is set
+	enum class FeatureKind
+	{
+		NOT_SET = 0,
+		BYTES_LIST = 1,
+		FLOAT_LIST = 2,
+		INT64_LIST = 3,
+	};
+
+	// Serialized `BytesList`, `FloatList` or `Int64List` of a feature. Points into the serialized example.
+	struct FeatureRef
+	{
+		FeatureKind kind = FeatureKind::NOT_SET;
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+	};
+
+	// Sequential reader of protobuf wire format. Throws on malformed input.
+	class HIDDEN WireReader
+	{
+	public:
+		enum WireType
+		{
+			VARINT = 0,
+			FIXED64 = 1,
+			LENGTH_DELIMITED = 2,
+			FIXED32 = 5,
+		};
+
+		WireReader(const uint8_t* data, size_t size): m_p(data), m_end(data + size)
+		{
+		}
+
+		// Reads the tag of the next field. Returns false at the end of the message.
+		bool NextField(uint32_t& field, int& wire_type)
+		{
+			if (AtEnd())
+			{
+				return false;
+			}
+			uint64_t tag = ReadVarint();
+			field = (uint32_t)(tag >> 3);
+			wire_type = (int)(tag & 7);
+			return true;
+		}
+
+		bool AtEnd() const
+		{
+			return m_p == m_end;
+		}
+
+		uint64_t ReadVarint()
+		{
+			uint64_t value = 0;
+			for (int shift = 0; shift < 64 && m_p != m_end; shift += 7)
+			{
+				uint8_t byte = *m_p++;
+				value |= (uint64_t)(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+				{
+					return value;
+				}
+			}
+			throw runtime_error("Malformed serialized example: truncated or too long varint");
+		}
+
+		uint32_t ReadFixed32()
+		{
+			Require(sizeof(uint32_t));
+			uint32_t value;
+			memcpy(&value, m_p, sizeof(uint32_t));
+			m_p += sizeof(uint32_t);
+			return value;
+		}
+
+		void ReadLengthDelimited(const uint8_t*& data, size_t& size)
+		{
+			uint64_t length = ReadVarint();
+			Require(length);
+			data = m_p;
+			size = (size_t)length;
+			m_p += size;
+		}
+
+		void Skip(int wire_type)
+		{
+			switch (wire_type)
+			{
+				case VARINT:
+					ReadVarint();
+					break;
+				case FIXED64:
+					Require(sizeof(uint64_t));
+					m_p += sizeof(uint64_t);
+					break;
+				case LENGTH_DELIMITED:
+				{
+					const uint8_t* data;
+					size_t size;
+					ReadLengthDelimited(data, size);
+					break;
+				}
+				case FIXED32:
+					Require(sizeof(uint32_t));
+					m_p += sizeof(uint32_t);
+					break;
+				default:
+					throw runtime_error("Malformed serialized example: unsupported wire type %d", wire_type);
+			}
+		}
+
+	private:
+		void Require(uint64_t size) const
+		{
+			if (size > (uint64_t)(m_end - m_p))
+			{
+				throw runtime_error("Malformed serialized example: field of size %zd exceeds the message", (size_t)size);
+			}
+		}
+
+		const uint8_t* m_p;
+		const uint8_t* m_end;
+	};
+
+	// Walks serialized example once and sets `features[i]` to the value of feature `keys[i]`. Features that are not
+	// present are left not set. Same as protobuf parser, if a key occurs more than once, the last value is taken.
+	void ScanExample(const void* data, size_t size, const std::vector<std::string>& keys,
+	                 std::vector<FeatureRef>& features);
+
+	// Reads values of a float list into `out`, at most `capacity` of them. Returns the number of values in the list,
+	// which may be larger than `capacity`. Both packed and non-packed encodings are accepted.
+	size_t ReadFloatList(const FeatureRef& feature, float* out, size_t capacity);
+
+	// Same as above, for int64 list.
+	size_t ReadInt64List(const FeatureRef& feature, int64_t* out, size_t capacity);
+
+	// Calls `func(data, size)` for each value of a bytes list. Values point into the serialized example.
+	template<typename F>
+	void ForEachBytes(const FeatureRef& feature, F func)
+	{
+		WireReader reader(feature.data, feature.size);
+		uint32_t field;
+		int wire_type;
+		while (reader.NextField(field, wire_type))
+		{
+			if (field == 1 && wire_type == WireReader::LENGTH_DELIMITED)
+			{
+				const uint8_t* data;
+				size_t size;
+				reader.ReadLengthDelimited(data, size);
+				func(data, size);
+			}
+			else
+			{
+				reader.Skip(wire_type);
+			}
+		}
+	}
+}
@@ -0,0 +1,148 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "image_decoder.h"
+#include "image_transforms.h"
+#include "jpeg_decoder.h"
+#include "png_decoder.h"
+#include "webp_decoder.h"
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+
+ImageFormat sniff_image_format(const void* data, size_t size)
+{
+	auto* p = (const uint8_t*)data;
+	if (p == nullptr)
+	{
+		return ImageFormat::Unknown;
+	}
+	if (size >= 3 && p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF)
+	{
+		return ImageFormat::JPEG;
+	}
+	if (size >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0)
+	{
+		return ImageFormat::PNG;
+	}
+	if (size >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0)
+	{
+		return ImageFormat::WebP;
+	}
+	return ImageFormat::Unknown;
+}
+
+py::object DecodedImage::ToNumpy()
+{
+	std::array<size_t, 3> shape = {height, width, (size_t)channels};
+	if (channels_first)
+	{
+		shape = {(size_t)channels, height, width};
+	}
+	uint8_t* ptr = data.release();
+	py::capsule owner(ptr, [](void* p) { delete[] (uint8_t*)p; });
+	return ndarray_uint8(shape, ptr, owner);
+}
+
+void decode_image(const void* data, size_t size, const ImageOptions& options, DecodedImage& image)
+{
+	if (options.channels != 0 && options.channels != 1 && options.channels != 3 && options.channels != 4)
+	{
+		throw runtime_error("Number of channels must be 0, 1, 3 or 4, got %d", options.channels);
+	}
+
+	auto alloc = [&image](size_t height, size_t width, int channels)
+	{
+		image.data.reset(new uint8_t[height * width * channels]);
+		image.height = height;
+		image.width = width;
+		image.channels = channels;
+		return image.data.get();
+	};
+
+	bool resize = false;
+	switch (sniff_image_format(data, size))
+	{
+		case ImageFormat::JPEG:
+		{
+			JpegScaling scaling;
+			scaling.min_height = options.height;
+			scaling.min_width = options.width;
+			scaling.min_side = options.min_side;
+			decode_jpeg_turbo_to(data, size, scaling, options.channels, alloc);
+			// DCT scaling only gets close to the target size, the rest is resized below
+			resize = options.min_side != 0 || (options.height != 0 && options.width != 0);
+			break;
+		}
+		case ImageFormat::PNG:
+		{
+			PngOptions png_options;
+			png_options.channels = options.channels;
+			decode_png_to(data, size, png_options, alloc);
+			resize = options.min_side != 0 || (options.height != 0 && options.width != 0);
+			break;
+		}
+		case ImageFormat::WebP:
+		{
+			// libwebp has no gray output, it is converted from RGB below
+			WebPOptions webp_options;
+			webp_options.channels = options.channels == 1 ? 3 : options.channels;
+			webp_options.height = options.height;
+			webp_options.width = options.width;
+			webp_options.min_side = options.min_side;
+			decode_webp_to(data, size, webp_options, alloc);
+			break;
+		}
+		default:
+			throw runtime_error("Unknown image format. Only JPEG, PNG and WebP are supported");
+	}
+
+	if (options.channels == 1 && image.channels != 1)
+	{
+		std::unique_ptr<uint8_t[]> src = std::move(image.data);
+		int src_channels = image.channels;
+		uint8_t* dst = alloc(image.height, image.width, 1);
+		rgb_to_gray(src.get(), image.height * image.width, src_channels, dst);
+	}
+
+	if (resize)
+	{
+		size_t height = options.height;
+		size_t width = options.width;
+		if (height == 0 || width == 0)
+		{
+			double scale = double(options.min_side) / std::min(image.height, image.width);
+			height = std::max<size_t>(1, (size_t)std::round(image.height * scale));
+			width = std::max<size_t>(1, (size_t)std::round(image.width * scale));
+		}
+		if (height != image.height || width != image.width)
+		{
+			std::unique_ptr<uint8_t[]> src = std::move(image.data);
+			size_t src_height = image.height;
+			size_t src_width = image.width;
+			int channels = image.channels;
+			uint8_t* dst = alloc(height, width, channels);
+			resize_bilinear(src.get(), src_height, src_width, src_width * channels, channels, dst, height, width);
+		}
+	}
+
+	if (options.channels_first && image.channels > 1)
+	{
+		std::unique_ptr<uint8_t[]> src = std::move(image.data);
+		uint8_t* dst = alloc(image.height, image.width, image.channels);
+		hwc_to_chw(src.get(), image.height, image.width, image.channels, dst);
+	}
+	image.channels_first = options.channels_first;
+}
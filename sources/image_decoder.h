@@ -0,0 +1,61 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include "common.h"
+#include <memory>
+
+enum class ImageFormat
+{
+	Unknown,
+	JPEG,
+	PNG,
+	WebP
+};
+
+// Detects format of the image by its magic bytes
+ImageFormat sniff_image_format(const void* data, size_t size);
+
+// Options that are shared by all formats
+struct ImageOptions
+{
+	// Number of channels of the output: 1 - gray, 3 - RGB, 4 - RGBA. Zero keeps the image as stored: gray JPEGs are
+	// decoded to gray, PNGs keep their channels and WebPs are decoded to RGBA if they have alpha, to RGB otherwise.
+	int channels = 0;
+	// Target size. If both `height` and `width` are set, image is scaled to that size, otherwise, if `min_side` is set,
+	// image is scaled so that its shorter side is `min_side`. Output of all formats has exactly the target size.
+	// JPEGs are first downscaled in DCT domain by M/8 to the smallest size that covers the target, and then resized
+	// as PNGs are. WebPs are scaled by the decoder.
+	size_t height = 0;
+	size_t width = 0;
+	size_t min_side = 0;
+	// If true, output has [C, H, W] layout, otherwise [H, W, C]
+	bool channels_first = false;
+};
+
+// Image decoded to native memory, with uint8 samples
+struct DecodedImage
+{
+	std::unique_ptr<uint8_t[]> data;
+	size_t height = 0;
+	size_t width = 0;
+	int channels = 0;
+	bool channels_first = false;
+
+	// Hands memory over to ndarray without copying. Requires GIL.
+	py::object ToNumpy();
+};
+
+// Detects format and decodes image with one of: libjpeg-turbo, libpng, libwebp. Does not require GIL.
+void decode_image(const void* data, size_t size, const ImageOptions& options, DecodedImage& image);
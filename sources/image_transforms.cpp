@@ -0,0 +1,137 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "image_transforms.h"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+
+CropWindow sample_random_resized_crop(size_t width, size_t height, const RandomResizedCropSpec& spec, std::mt19937_64& rnd)
+{
+	const float area = float(width) * float(height);
+	std::uniform_real_distribution<float> scale_dist(spec.scale_min, spec.scale_max);
+	std::uniform_real_distribution<float> log_ratio_dist(std::log(spec.ratio_min), std::log(spec.ratio_max));
+
+	CropWindow window;
+	for (int attempt = 0; attempt < 10; ++attempt)
+	{
+		float target_area = area * scale_dist(rnd);
+		float aspect_ratio = std::exp(log_ratio_dist(rnd));
+
+		auto w = (size_t)std::round(std::sqrt(target_area * aspect_ratio));
+		auto h = (size_t)std::round(std::sqrt(target_area / aspect_ratio));
+
+		if (0 < w && w <= width && 0 < h && h <= height)
+		{
+			window.top = std::uniform_int_distribution<size_t>(0, height - h)(rnd);
+			window.left = std::uniform_int_distribution<size_t>(0, width - w)(rnd);
+			window.height = h;
+			window.width = w;
+			return window;
+		}
+	}
+
+	// Fallback to central crop
+	float in_ratio = float(width) / float(height);
+	if (in_ratio < spec.ratio_min)
+	{
+		window.width = width;
+		window.height = std::min(height, (size_t)std::round(width / spec.ratio_min));
+	}
+	else if (in_ratio > spec.ratio_max)
+	{
+		window.height = height;
+		window.width = std::min(width, (size_t)std::round(height * spec.ratio_max));
+	}
+	else
+	{
+		window.width = width;
+		window.height = height;
+	}
+	window.top = (height - window.height) / 2;
+	window.left = (width - window.width) / 2;
+	return window;
+}
+
+void resize_bilinear(const uint8_t* src, size_t src_height, size_t src_width, size_t src_stride, int channels,
+                     uint8_t* dst, size_t dst_height, size_t dst_width)
+{
+	// Horizontal source positions and weights do not depend on the row, so are computed once.
+	// Pixel centers are aligned, same as in OpenCV and PIL.
+	std::vector<size_t> x0(dst_width);
+	std::vector<size_t> x1(dst_width);
+	std::vector<float> wx(dst_width);
+	const float scale_x = float(src_width) / float(dst_width);
+	for (size_t x = 0; x < dst_width; ++x)
+	{
+		float sx = std::max(0.0f, (x + 0.5f) * scale_x - 0.5f);
+		x0[x] = std::min((size_t)sx, src_width - 1);
+		x1[x] = std::min(x0[x] + 1, src_width - 1);
+		wx[x] = sx - x0[x];
+	}
+
+	const float scale_y = float(src_height) / float(dst_height);
+	for (size_t y = 0; y < dst_height; ++y)
+	{
+		float sy = std::max(0.0f, (y + 0.5f) * scale_y - 0.5f);
+		size_t y0 = std::min((size_t)sy, src_height - 1);
+		size_t y1 = std::min(y0 + 1, src_height - 1);
+		float wy = sy - y0;
+
+		const uint8_t* row0 = src + y0 * src_stride;
+		const uint8_t* row1 = src + y1 * src_stride;
+		uint8_t* out = dst + y * dst_width * channels;
+
+		for (size_t x = 0; x < dst_width; ++x)
+		{
+			const uint8_t* p00 = row0 + x0[x] * channels;
+			const uint8_t* p01 = row0 + x1[x] * channels;
+			const uint8_t* p10 = row1 + x0[x] * channels;
+			const uint8_t* p11 = row1 + x1[x] * channels;
+			for (int c = 0; c < channels; ++c)
+			{
+				float top = p00[c] + (p01[c] - p00[c]) * wx[x];
+				float bottom = p10[c] + (p11[c] - p10[c]) * wx[x];
+				*out++ = (uint8_t)(top + (bottom - top) * wy + 0.5f);
+			}
+		}
+	}
+}
+
+void rgb_to_gray(const uint8_t* src, size_t pixels, int src_channels, uint8_t* dst)
+{
+	// Fixed point ITU-R BT.601 weights, scaled by 2^16
+	const uint32_t r_weight = 19595;
+	const uint32_t g_weight = 38470;
+	const uint32_t b_weight = 7471;
+	for (size_t i = 0; i < pixels; ++i, src += src_channels)
+	{
+		dst[i] = (uint8_t)((r_weight * src[0] + g_weight * src[1] + b_weight * src[2] + 32768) >> 16);
+	}
+}
+
+void hwc_to_chw(const uint8_t* src, size_t height, size_t width, int channels, uint8_t* dst)
+{
+	size_t plane = height * width;
+	for (int c = 0; c < channels; ++c)
+	{
+		uint8_t* out = dst + c * plane;
+		const uint8_t* in = src + c;
+		for (size_t i = 0; i < plane; ++i, in += channels)
+		{
+			out[i] = *in;
+		}
+	}
+}
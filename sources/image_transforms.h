@@ -0,0 +1,57 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <random>
+#include <functional>
+
+
+// Allocates memory for an image of the given size, with tightly packed rows. Is used by decoders that do not require
+// GIL and therefore can't allocate output arrays themselves.
+typedef std::function<uint8_t*(size_t height, size_t width, int channels)> ImageAllocator;
+
+// Rectangular window of an image, in pixels
+struct CropWindow
+{
+	size_t top = 0;
+	size_t left = 0;
+	size_t height = 0;
+	size_t width = 0;
+};
+
+// Parameters of random resized crop, same as of torchvision.transforms.RandomResizedCrop
+struct RandomResizedCropSpec
+{
+	float scale_min = 0.08f;
+	float scale_max = 1.0f;
+	float ratio_min = 3.0f / 4.0f;
+	float ratio_max = 4.0f / 3.0f;
+};
+
+// Samples crop window for the image of the given size. Follows the algorithm of torchvision: tries 10 times to sample
+// window of random area and aspect ratio, if fails, falls back to central crop.
+CropWindow sample_random_resized_crop(size_t width, size_t height, const RandomResizedCropSpec& spec, std::mt19937_64& rnd);
+
+// Resizes image with bilinear interpolation. `src_stride` is a distance between rows of the source in bytes.
+// Output rows are tightly packed. Does not require GIL.
+void resize_bilinear(const uint8_t* src, size_t src_height, size_t src_width, size_t src_stride, int channels,
+                     uint8_t* dst, size_t dst_height, size_t dst_width);
+
+// Converts RGB or RGBA image to gray, with the same weights as libjpeg uses. Alpha is dropped. Does not require GIL.
+void rgb_to_gray(const uint8_t* src, size_t pixels, int src_channels, uint8_t* dst);
+
+// Converts image from [H, W, C] to [C, H, W] layout. Does not require GIL.
+void hwc_to_chw(const uint8_t* src, size_t height, size_t width, int channels, uint8_t* dst);
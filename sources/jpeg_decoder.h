@@ -12,7 +12,65 @@
 //   See the License for the specific language governing permissions and
 //   limitations under the License.
 
+#pragma once
 #include "common.h"
+#include "image_transforms.h"
+#include <algorithm>
 
-ndarray_uint8 decode_jpeg_vanila(void* data, size_t size);
-ndarray_uint8 decode_jpeg_turbo(void* data, size_t size);
+// Controls DCT-domain downscaling. Image is decoded at scale M/8, where M is in range [1, 8]. Downscaling is done
+// by IDCT, which is much cheaper than decoding at full resolution and resizing afterwards.
+struct JpegScaling
+{
+	// If any of these is not zero, M is the smallest value such that the output is at least `min_height` pixels high,
+	// `min_width` pixels wide and its shorter side is at least `min_side` pixels. If the image is smaller than
+	// requested, it is decoded at full resolution.
+	size_t min_height = 0;
+	size_t min_width = 0;
+	size_t min_side = 0;
+	// Explicit value of M, used if size is not constrained. Zero means full resolution.
+	int scale_num = 0;
+
+	// Returns M for the image of the given size
+	int pick_scale_num(size_t width, size_t height) const
+	{
+		if (min_height == 0 && min_width == 0 && min_side == 0)
+		{
+			return scale_num > 0 ? std::min(scale_num, 8) : 8;
+		}
+		for (int m = 1; m < 8; ++m)
+		{
+			// Same rounding as in jpeg_calc_output_dimensions
+			size_t h = (height * m + 7) / 8;
+			size_t w = (width * m + 7) / 8;
+			if (h >= min_height && w >= min_width && std::min(h, w) >= min_side)
+			{
+				return m;
+			}
+		}
+		return 8;
+	}
+};
+
+ndarray_uint8 decode_jpeg_vanila(void* data, size_t size, const JpegScaling& scaling = JpegScaling());
+ndarray_uint8 decode_jpeg_turbo(void* data, size_t size, const JpegScaling& scaling = JpegScaling());
+
+// Functions below do not require GIL and can be called concurrently from several threads
+
+// Reads dimensions of the image without decoding it
+void read_jpeg_size_turbo(const void* data, size_t size, size_t& width, size_t& height);
+
+// Decodes image to RGB, to a preallocated buffer of size height x width x 3. Grayscale images are converted to RGB.
+// Throws if size of the image does not match.
+void decode_jpeg_turbo_to(const void* data, size_t size, uint8_t* dst, size_t width, size_t height);
+
+// Decodes image with DCT-domain downscaling to memory requested from `alloc`. `channels` selects the output:
+// 1 - gray, 3 - RGB, 4 - RGBA, 0 - gray for grayscale images and RGB otherwise.
+void decode_jpeg_turbo_to(const void* data, size_t size, const JpegScaling& scaling, int channels,
+                          const ImageAllocator& alloc);
+
+// Decodes only the given window of the image and resizes it with bilinear interpolation to a preallocated buffer of
+// size out_height x out_width x 3. Window is downscaled in DCT domain if it is larger than the output, rows above
+// and below the window are skipped and only iMCU columns that intersect the window are decoded.
+// Coordinates of the window are in pixels of the full resolution image. Requires libjpeg-turbo.
+void decode_jpeg_turbo_crop_to(const void* data, size_t size, const CropWindow& window, uint8_t* dst,
+                               size_t out_height, size_t out_width);
@@ -3,6 +3,8 @@
 
 #include "jpeg_decoder.h"
 #include <setjmp.h>
+#include <vector>
+#include <algorithm>
 
 #define TURBO
 #include <../libjpeg-turbo/jpeglib.h>
@@ -15,76 +17,215 @@ struct my_error_mgr {
 };
 static void my_error_exit(j_common_ptr cinfo)
 {
-  my_error_mgr* myerr = (my_error_mgr *) cinfo->err;
-  jpeg_destroy_decompress((jpeg_decompress_struct*)cinfo);
+  // Aborting instead of destroying, so that decompressor can be reused by the next call on this thread
+  jpeg_abort(cinfo);
   throw runtime_error("Error reading file JPEG. JPEG code has signaled an error: %s", cinfo->err->jpeg_message_table[cinfo->err->msg_code]);
 }
 
+namespace
+{
+// Decompressor state. Each thread gets its own instance, that is created on first use and reused by all subsequent
+// calls from that thread. This allows to decode concurrently from several threads while GIL is released.
+struct DecompressContext
+{
+	DecompressContext()
+	{
+		cinfo.err = jpeg_std_error(&jerr.pub);
+		jerr.pub.error_exit = my_error_exit;
+		jpeg_create_decompress(&cinfo);
+	}
+
+	~DecompressContext()
+	{
+		jpeg_destroy_decompress(&cinfo);
+	}
+
+	DecompressContext(const DecompressContext&) = delete; // non construction-copyable
+	DecompressContext& operator=( const DecompressContext&) = delete; // non copyable
 
-ndarray_uint8 decode_jpeg_turbo(void* data, size_t size)
+	jpeg_decompress_struct cinfo;
+	my_error_mgr jerr;
+};
+}
+
+static DecompressContext& GetDecompressContext()
+{
+	static thread_local DecompressContext context;
+	return context;
+}
+
+
+/* Reads header and starts decompressor. After this call, dimensions of the output image are known.
+ * `channels` selects the output color space: 1 - gray, 3 - RGB, 4 - RGBA, 0 - gray for grayscale images, RGB
+ * otherwise. */
+static void start_decompress(jpeg_decompress_struct& cinfo, const void* data, size_t size, int channels,
+		const JpegScaling& scaling = JpegScaling())
 {
+	if (channels != 0 && channels != 1 && channels != 3 && channels != 4)
+	{
+		throw runtime_error("Error reading file JPEG. Number of channels must be 0, 1, 3 or 4, got %d", channels);
+	}
 	if (data == nullptr)
 	{
 		throw runtime_error("Error reading file JPEG. Got nullptr to decompress");
 	}
+	/* Previous call on this thread could have been interrupted, e.g. by an exception during ndarray allocation */
+	jpeg_abort_decompress(&cinfo);
+	/* Step 2: specify data source (eg, a file) */
+	jpeg_mem_src(&cinfo, (unsigned char*) data, size);
+	/* Step 3: read file parameters with jpeg_read_header() */
+	(void) jpeg_read_header(&cinfo, TRUE);
+	switch (channels)
+	{
+		case 0: cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB; break;
+		case 1: cinfo.out_color_space = JCS_GRAYSCALE; break;
+		case 3: cinfo.out_color_space = JCS_RGB; break;
+		case 4: cinfo.out_color_space = JCS_EXT_RGBA; break;
+	}
+	cinfo.scale_num = scaling.pick_scale_num(cinfo.image_width, cinfo.image_height);
+	cinfo.scale_denom = 8;
+	/* Step 5: Start decompressor */
+	(void) jpeg_start_decompress(&cinfo);
+}
+
+/* Reads all scanlines to the given buffer, rows are expected to be tightly packed */
+static void read_scanlines(jpeg_decompress_struct& cinfo, uint8_t* ptr)
+{
+	/* JSAMPLEs per row in output buffer */
+	size_t row_stride = cinfo.output_width * cinfo.output_components;
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		/* jpeg_read_scanlines expects an array of pointers to scanlines.
+		 * Here the array is only one element long, but you could ask for
+		 * more than one scanline at a time if that's more convenient.
+		 */
+		unsigned char* p = (ptr + row_stride * cinfo.output_scanline);
+		(void) jpeg_read_scanlines(&cinfo, &p, 1);
+	}
+	(void) jpeg_finish_decompress(&cinfo);
+}
 
-	static jpeg_decompress_struct cinfo;
-	static my_error_mgr jerr;
-	JSAMPARRAY buffer;		/* Output row buffer */
-	int row_stride;		/* physical row width in output buffer */
 
+ndarray_uint8 decode_jpeg_turbo(void* data, size_t size, const JpegScaling& scaling)
+{
+	jpeg_decompress_struct& cinfo = GetDecompressContext().cinfo;
 	{
 		py::gil_scoped_release release;
-
-		static bool initialized = false;
-		if (initialized == false)
-		{
-			cinfo.err = jpeg_std_error(&jerr.pub);
-            jerr.pub.error_exit = my_error_exit;
-
-			/* Now we can initialize the JPEG decompression object. */
-			jpeg_create_decompress(&cinfo);
-			initialized = true;
-		}
-		/* Step 2: specify data source (eg, a file) */
-		jpeg_mem_src(&cinfo, (unsigned char*) data, size);
-		/* Step 3: read file parameters with jpeg_read_header() */
-		(void) jpeg_read_header(&cinfo, TRUE);
-		/* Step 5: Start decompressor */
-		(void) jpeg_start_decompress(&cinfo);
-
-		/* We may need to do some setup of our own at this point before reading
-		 * the data.  After jpeg_start_decompress() we have the correct scaled
-		 * output image dimensions available, as well as the output colormap
-		 * if we asked for color quantization.
-		 * In this example, we need to make an output work buffer of the right size.
-		 */
-		/* JSAMPLEs per row in output buffer */
-		row_stride = cinfo.output_width * cinfo.output_components;
-		/* Make a one-row-high sample array that will go away when done with image */
+		start_decompress(cinfo, data, size, 0, scaling);
 	}
-	std::array<size_t, 3> shape = {cinfo.output_height, cinfo.output_width, 3};
+	/* We may need to do some setup of our own at this point before reading
+	 * the data.  After jpeg_start_decompress() we have the correct scaled
+	 * output image dimensions available, as well as the output colormap
+	 * if we asked for color quantization.
+	 */
+	std::array<size_t, 3> shape = {cinfo.output_height, cinfo.output_width, (size_t)cinfo.output_components};
 	ndarray_uint8 ar(shape);
 	unsigned char* ptr = (unsigned char*)ar.request().ptr;
-	//buffer = (*cinfo.mem->alloc_sarray)
-	//		((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
 	{
 		py::gil_scoped_release release;
-		int i = 0;
-		while (cinfo.output_scanline < cinfo.output_height)
-		{
-			/* jpeg_read_scanlines expects an array of pointers to scanlines.
-			 * Here the array is only one element long, but you could ask for
-			 * more than one scanline at a time if that's more convenient.
-			 */
-			unsigned char* p = (ptr + row_stride * i);
-			(void) jpeg_read_scanlines(&cinfo, &p, 1);
-			++i;
-			/* Assume put_scanline_someplace wants a pointer and sample count. */
-			//put_scanline_someplace(buffer[0], row_stride);
-		}
-		(void) jpeg_finish_decompress(&cinfo);
-		//jpeg_destroy_decompress(&cinfo);
+		read_scanlines(cinfo, ptr);
 	}
 	return ar;
 }
+
+void read_jpeg_size_turbo(const void* data, size_t size, size_t& width, size_t& height)
+{
+	jpeg_decompress_struct& cinfo = GetDecompressContext().cinfo;
+	jpeg_abort_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char*) data, size);
+	(void) jpeg_read_header(&cinfo, TRUE);
+	jpeg_calc_output_dimensions(&cinfo);
+	width = cinfo.output_width;
+	height = cinfo.output_height;
+	jpeg_abort_decompress(&cinfo);
+}
+
+void decode_jpeg_turbo_to(const void* data, size_t size, uint8_t* dst, size_t width, size_t height)
+{
+	jpeg_decompress_struct& cinfo = GetDecompressContext().cinfo;
+	start_decompress(cinfo, data, size, 3);
+	if (cinfo.output_width != width || cinfo.output_height != height)
+	{
+		size_t actual_width = cinfo.output_width;
+		size_t actual_height = cinfo.output_height;
+		jpeg_abort_decompress(&cinfo);
+		throw runtime_error("Error reading file JPEG. Expected image of size %zdx%zd, but got %zdx%zd",
+				width, height, actual_width, actual_height);
+	}
+	read_scanlines(cinfo, dst);
+}
+
+void decode_jpeg_turbo_to(const void* data, size_t size, const JpegScaling& scaling, int channels,
+                          const ImageAllocator& alloc)
+{
+	jpeg_decompress_struct& cinfo = GetDecompressContext().cinfo;
+	start_decompress(cinfo, data, size, channels, scaling);
+	uint8_t* dst = alloc(cinfo.output_height, cinfo.output_width, cinfo.output_components);
+	read_scanlines(cinfo, dst);
+}
+
+void decode_jpeg_turbo_crop_to(const void* data, size_t size, const CropWindow& window, uint8_t* dst,
+                               size_t out_height, size_t out_width)
+{
+	jpeg_decompress_struct& cinfo = GetDecompressContext().cinfo;
+	if (data == nullptr)
+	{
+		throw runtime_error("Error reading file JPEG. Got nullptr to decompress");
+	}
+	jpeg_abort_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char*) data, size);
+	(void) jpeg_read_header(&cinfo, TRUE);
+
+	if (window.height == 0 || window.width == 0
+	    || window.top + window.height > cinfo.image_height || window.left + window.width > cinfo.image_width)
+	{
+		size_t image_width = cinfo.image_width;
+		size_t image_height = cinfo.image_height;
+		jpeg_abort_decompress(&cinfo);
+		throw runtime_error("Crop window [top: %zd, left: %zd, height: %zd, width: %zd] is out of the image of size %zdx%zd",
+				window.top, window.left, window.height, window.width, image_width, image_height);
+	}
+
+	// Window is downscaled in DCT domain as much as possible, while still covering the output size
+	JpegScaling scaling;
+	scaling.min_height = out_height;
+	scaling.min_width = out_width;
+	int m = scaling.pick_scale_num(window.width, window.height);
+
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.scale_num = m;
+	cinfo.scale_denom = 8;
+	(void) jpeg_start_decompress(&cinfo);
+
+	// Window in coordinates of the scaled image
+	size_t top = window.top * m / 8;
+	size_t left = window.left * m / 8;
+	size_t bottom = std::min<size_t>((window.top + window.height) * m / 8, cinfo.output_height);
+	size_t right = std::min<size_t>((window.left + window.width) * m / 8, cinfo.output_width);
+	bottom = std::max(bottom, top + 1);
+	right = std::max(right, left + 1);
+
+	// Only iMCU columns that intersect the window are decoded. Decoder may widen the region to iMCU boundaries,
+	// after this call `output_width` is the width of the decoded region, which starts at `xoffset`
+	JDIMENSION xoffset = left;
+	JDIMENSION crop_width = right - left;
+	jpeg_crop_scanline(&cinfo, &xoffset, &crop_width);
+
+	size_t row_stride = cinfo.output_width * cinfo.output_components;
+	std::vector<uint8_t> rows((bottom - top) * row_stride);
+
+	// Rows above the window are skipped, rows below are never read
+	if (top > 0)
+	{
+		jpeg_skip_scanlines(&cinfo, top);
+	}
+	while (cinfo.output_scanline < bottom)
+	{
+		unsigned char* p = rows.data() + row_stride * (cinfo.output_scanline - top);
+		(void) jpeg_read_scanlines(&cinfo, &p, 1);
+	}
+	jpeg_abort_decompress(&cinfo);
+
+	resize_bilinear(rows.data() + (left - xoffset) * 3, bottom - top, right - left, row_stride, 3,
+			dst, out_height, out_width);
+}
@@ -15,40 +15,66 @@ struct my_error_mgr {
 };
 static void my_error_exit(j_common_ptr cinfo)
 {
-  my_error_mgr* myerr = (my_error_mgr *) cinfo->err;
-  jpeg_destroy_decompress((jpeg_decompress_struct*)cinfo);
+  // Aborting instead of destroying, so that decompressor can be reused by the next call on this thread
+  jpeg_abort(cinfo);
   throw runtime_error("Error reading file JPEG. JPEG code has signaled an error: %s", cinfo->err->jpeg_message_table[cinfo->err->msg_code]);
 }
 
-ndarray_uint8 decode_jpeg_vanila(void* data, size_t size)
+namespace
+{
+// Decompressor state. Each thread gets its own instance, that is created on first use and reused by all subsequent
+// calls from that thread. This allows to decode concurrently from several threads while GIL is released.
+struct DecompressContext
+{
+	DecompressContext()
+	{
+		cinfo.err = jpeg_std_error(&jerr.pub);
+		jerr.pub.error_exit = my_error_exit;
+		jpeg_create_decompress(&cinfo);
+	}
+
+	~DecompressContext()
+	{
+		jpeg_destroy_decompress(&cinfo);
+	}
+
+	DecompressContext(const DecompressContext&) = delete; // non construction-copyable
+	DecompressContext& operator=( const DecompressContext&) = delete; // non copyable
+
+	jpeg_decompress_struct cinfo;
+	my_error_mgr jerr;
+};
+}
+
+static DecompressContext& GetDecompressContext()
+{
+	static thread_local DecompressContext context;
+	return context;
+}
+
+ndarray_uint8 decode_jpeg_vanila(void* data, size_t size, const JpegScaling& scaling)
 {
 	if (data == nullptr)
 	{
 		throw runtime_error("Error reading file JPEG. Got nullptr to decompress");
 	}
 
-	static jpeg_decompress_struct cinfo;
-	static my_error_mgr jerr;
+	jpeg_decompress_struct& cinfo = GetDecompressContext().cinfo;
 	JSAMPARRAY buffer;		/* Output row buffer */
 	int row_stride;		/* physical row width in output buffer */
 
 	{
 		py::gil_scoped_release release;
 
-		static bool initialized = false;
-		if (!initialized)
-		{
-			cinfo.err = jpeg_std_error(&jerr.pub);
-            jerr.pub.error_exit = my_error_exit;
-
-			/* Now we can initialize the JPEG decompression object. */
-			jpeg_create_decompress(&cinfo);
-			initialized = true;
-		}
+		/* Previous call on this thread could have been interrupted, e.g. by an exception during ndarray allocation */
+		jpeg_abort_decompress(&cinfo);
 		/* Step 2: specify data source (eg, a file) */
 		jpeg_mem_src(&cinfo, (unsigned char*) data, size);
 		/* Step 3: read file parameters with jpeg_read_header() */
 		(void) jpeg_read_header(&cinfo, TRUE);
+		/* Step 4: set parameters for decompression */
+		cinfo.scale_num = scaling.pick_scale_num(cinfo.image_width, cinfo.image_height);
+		cinfo.scale_denom = 8;
 		/* Step 5: Start decompressor */
 		(void) jpeg_start_decompress(&cinfo);
 
@@ -62,7 +88,7 @@ ndarray_uint8 decode_jpeg_vanila(void* data, size_t size)
 		row_stride = cinfo.output_width * cinfo.output_components;
 		/* Make a one-row-high sample array that will go away when done with image */
 	}
-	std::array<size_t, 3> shape = {cinfo.output_height, cinfo.output_width, 3};
+	std::array<size_t, 3> shape = {cinfo.output_height, cinfo.output_width, (size_t)cinfo.output_components};
 	ndarray_uint8 ar(shape);
 	unsigned char* ptr = (unsigned char*)ar.request().ptr;
 	//buffer = (*cinfo.mem->alloc_sarray)
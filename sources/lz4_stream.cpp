@@ -0,0 +1,323 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+
+#include "lz4_stream.h"
+#include "thread_pool.h"
+#include "common.h"
+#include <lz4.h>
+#include <xxhash.h>
+#include <string.h>
+#include <algorithm>
+
+
+namespace
+{
+	const uint32_t kFrameMagic = 0x184D2204;
+	const uint32_t kSkippableFrameMagic = 0x184D2A50;
+	const uint32_t kSkippableFrameMask = 0xFFFFFFF0;
+	const uint32_t kUncompressedBlockFlag = 0x80000000;
+	const size_t kMaxDictSize = 64 * 1024;
+	// Bounds memory of a batch for frames with small blocks, and still gives several blocks to decompress in parallel
+	const size_t kMaxBatchBlocks = 16;
+
+	enum FrameFlags
+	{
+		kDictId = 0x01,
+		kContentChecksum = 0x04,
+		kContentSize = 0x08,
+		kBlockChecksum = 0x10,
+		kBlockIndependence = 0x20,
+	};
+}
+
+Lz4InputStream::Lz4InputStream(fsal::File* file, size_t batch_size):
+		m_file(file), m_batch_size(batch_size), m_position(0), m_file_status(true), m_in_frame(false),
+		m_independent_blocks(false), m_block_checksum(false), m_content_checksum(false), m_block_max_size(0),
+		m_content_hash(XXH32_createState()), m_current_block(0), m_current_offset(0)
+{
+}
+
+Lz4InputStream::~Lz4InputStream()
+{
+	XXH32_freeState(m_content_hash);
+}
+
+void Lz4InputStream::ReadExact(void* dst, size_t size)
+{
+	size_t read = 0;
+	fsal::Status status = m_file->Read((uint8_t*)dst, size, &read);
+	if (read != size)
+	{
+		if (!status.ok() && !status.is_eof())
+		{
+			throw runtime_error("Error reading compressed file: %s", m_file->GetPath().c_str());
+		}
+		throw runtime_error("Unexpected EOF. Truncated LZ4 frame. Record file: %s", m_file->GetPath().c_str());
+	}
+}
+
+bool Lz4InputStream::ReadFrameHeader()
+{
+	while (true)
+	{
+		uint32_t magic = 0;
+		size_t read = 0;
+		fsal::Status status = m_file->Read((uint8_t*)&magic, sizeof(magic), &read);
+		if (read == 0 && status.is_eof())
+		{
+			m_file_status = status;
+			return false;
+		}
+		if (!status.ok() && !status.is_eof())
+		{
+			throw runtime_error("Error reading compressed file: %s", m_file->GetPath().c_str());
+		}
+		if (read != sizeof(magic))
+		{
+			throw runtime_error("Unexpected EOF. Truncated LZ4 frame. Record file: %s", m_file->GetPath().c_str());
+		}
+
+		if ((magic & kSkippableFrameMask) == kSkippableFrameMagic)
+		{
+			uint32_t size = 0;
+			ReadExact(&size, sizeof(size));
+			m_file->Seek(size, fsal::File::CurrentPosition);
+			continue;
+		}
+		if (magic != kFrameMagic)
+		{
+			throw runtime_error("Not an LZ4 frame, magic number is %x. Record file: %s", magic, m_file->GetPath().c_str());
+		}
+
+		// Frame descriptor: FLG, BD, optional content size and dictionary id, followed by the header checksum
+		uint8_t descriptor[2 + 8 + 4];
+		ReadExact(descriptor, 2);
+		uint8_t flags = descriptor[0];
+		uint8_t block_descriptor = descriptor[1];
+		if ((flags >> 6) != 1)
+		{
+			throw runtime_error("Unsupported version of LZ4 frame format: %d. Record file: %s", flags >> 6, m_file->GetPath().c_str());
+		}
+		size_t descriptor_size = 2 + (flags & kContentSize ? 8 : 0) + (flags & kDictId ? 4 : 0);
+		ReadExact(descriptor + 2, descriptor_size - 2);
+		uint8_t header_checksum = 0;
+		ReadExact(&header_checksum, 1);
+		if (((XXH32(descriptor, descriptor_size, 0) >> 8) & 0xFF) != header_checksum)
+		{
+			throw runtime_error("Corrupted LZ4 frame header, checksum didn't match. Record file: %s", m_file->GetPath().c_str());
+		}
+		if (flags & kDictId)
+		{
+			throw runtime_error("LZ4 frames that require a dictionary are not supported. Record file: %s", m_file->GetPath().c_str());
+		}
+		int block_size_id = (block_descriptor >> 4) & 0x7;
+		if (block_size_id < 4)
+		{
+			throw runtime_error("Invalid LZ4 block size id: %d. Record file: %s", block_size_id, m_file->GetPath().c_str());
+		}
+
+		// Ids from 4 to 7 stand for 64KB, 256KB, 1MB and 4MB
+		m_block_max_size = size_t(1) << (8 + 2 * block_size_id);
+		m_independent_blocks = (flags & kBlockIndependence) != 0;
+		m_block_checksum = (flags & kBlockChecksum) != 0;
+		m_content_checksum = (flags & kContentChecksum) != 0;
+		XXH32_reset(m_content_hash, 0);
+		m_dict.clear();
+		m_in_frame = true;
+		return true;
+	}
+}
+
+const uint8_t* Lz4InputStream::BlockData(size_t i) const
+{
+	const Block& block = m_blocks[i];
+	if (block.compressed)
+	{
+		return m_decompressed.data() + i * m_block_max_size;
+	}
+	return m_compressed.data() + block.offset;
+}
+
+void Lz4InputStream::Decompress(size_t i, const uint8_t* dict, size_t dict_size)
+{
+	Block& block = m_blocks[i];
+	const uint8_t* src = m_compressed.data() + block.offset;
+	if (block.has_checksum && XXH32(src, block.size, 0) != block.checksum)
+	{
+		throw runtime_error("Corrupted LZ4 block, checksum didn't match. Record file: %s", m_file->GetPath().c_str());
+	}
+	if (!block.compressed)
+	{
+		block.decompressed_size = block.size;
+		return;
+	}
+	auto* dst = (char*)m_decompressed.data() + i * m_block_max_size;
+	int result;
+	if (dict_size > 0)
+	{
+		result = LZ4_decompress_safe_usingDict((const char*)src, dst, block.size, (int)m_block_max_size, (const char*)dict, (int)dict_size);
+	}
+	else
+	{
+		result = LZ4_decompress_safe((const char*)src, dst, block.size, (int)m_block_max_size);
+	}
+	if (result < 0)
+	{
+		throw runtime_error("Corrupted LZ4 block, can't decompress it. Record file: %s", m_file->GetPath().c_str());
+	}
+	block.decompressed_size = result;
+}
+
+bool Lz4InputStream::NextBatch()
+{
+	m_blocks.clear();
+	m_current_block = 0;
+	m_current_offset = 0;
+
+	if (!m_in_frame && !ReadFrameHeader())
+	{
+		return false;
+	}
+
+	// Batch does not cross frames, since each frame has its own block size and flags
+	size_t compressed_size = 0;
+	bool frame_end = false;
+	uint32_t content_checksum = 0;
+	while (m_blocks.empty() || (m_blocks.size() < kMaxBatchBlocks && m_blocks.size() * m_block_max_size < m_batch_size))
+	{
+		uint32_t block_size = 0;
+		ReadExact(&block_size, sizeof(block_size));
+		if (block_size == 0)
+		{
+			frame_end = true;
+			if (m_content_checksum)
+			{
+				ReadExact(&content_checksum, sizeof(content_checksum));
+			}
+			break;
+		}
+
+		Block block;
+		block.offset = compressed_size;
+		block.size = block_size & ~kUncompressedBlockFlag;
+		block.compressed = (block_size & kUncompressedBlockFlag) == 0;
+		block.has_checksum = m_block_checksum;
+		block.checksum = 0;
+		block.decompressed_size = 0;
+		if (block.size > m_block_max_size)
+		{
+			throw runtime_error("Corrupted LZ4 block, size %d exceeds maximum of the frame. Record file: %s", (int)block.size, m_file->GetPath().c_str());
+		}
+
+		compressed_size += block.size;
+		if (m_compressed.size() < compressed_size)
+		{
+			m_compressed.resize(compressed_size);
+		}
+		ReadExact(m_compressed.data() + block.offset, block.size);
+		if (m_block_checksum)
+		{
+			ReadExact(&block.checksum, sizeof(block.checksum));
+		}
+		m_blocks.push_back(block);
+	}
+
+	if (m_decompressed.size() < m_blocks.size() * m_block_max_size)
+	{
+		m_decompressed.resize(m_blocks.size() * m_block_max_size);
+	}
+
+	if (m_independent_blocks)
+	{
+		ThreadPool::Default().ParallelFor(m_blocks.size(), [this](size_t i)
+		{
+			Decompress(i, nullptr, 0);
+		});
+	}
+	else
+	{
+		for (size_t i = 0; i < m_blocks.size(); ++i)
+		{
+			Decompress(i, m_dict.data(), m_dict.size());
+
+			// Keep the last 64KB of the frame, blocks may be shorter than that if the compressor flushed
+			const uint8_t* data = BlockData(i);
+			size_t size = m_blocks[i].decompressed_size;
+			if (size >= kMaxDictSize)
+			{
+				m_dict.assign(data + size - kMaxDictSize, data + size);
+			}
+			else
+			{
+				m_dict.insert(m_dict.end(), data, data + size);
+				if (m_dict.size() > kMaxDictSize)
+				{
+					m_dict.erase(m_dict.begin(), m_dict.end() - kMaxDictSize);
+				}
+			}
+		}
+	}
+
+	if (m_content_checksum)
+	{
+		for (size_t i = 0; i < m_blocks.size(); ++i)
+		{
+			XXH32_update(m_content_hash, BlockData(i), m_blocks[i].decompressed_size);
+		}
+	}
+
+	if (frame_end)
+	{
+		m_in_frame = false;
+		if (m_content_checksum && XXH32_digest(m_content_hash) != content_checksum)
+		{
+			throw runtime_error("Corrupted LZ4 frame, content checksum didn't match. Record file: %s", m_file->GetPath().c_str());
+		}
+	}
+	return true;
+}
+
+fsal::Status Lz4InputStream::Read(uint8_t* dst, size_t size, size_t* read)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		if (m_current_block == m_blocks.size())
+		{
+			if (!NextBatch())
+			{
+				break;
+			}
+			continue;
+		}
+		const Block& block = m_blocks[m_current_block];
+		size_t n = std::min(size - done, block.decompressed_size - m_current_offset);
+		memcpy(dst + done, BlockData(m_current_block) + m_current_offset, n);
+		done += n;
+		m_current_offset += n;
+		if (m_current_offset == block.decompressed_size)
+		{
+			++m_current_block;
+			m_current_offset = 0;
+		}
+	}
+	m_position += done;
+	*read = done;
+	if (done == size)
+	{
+		return true;
+	}
+	return m_file_status;
+}
@@ -0,0 +1,90 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+
+#pragma once
+#include <inttypes.h>
+#include <vector>
+#include <fsal.h>
+#include "compressed_stream.h"
+
+
+struct XXH32_state_s;
+
+// Sequential stream that decompresses a file in LZ4 frame format. Blocks are read in batches, and if blocks of the
+// frame are independent, all blocks of a batch are decompressed in parallel on the default thread pool. Frames with
+// linked blocks are decompressed sequentially. Concatenated and skippable frames are supported, block and content
+// checksums are verified if present.
+class Lz4InputStream: public CompressedInputStream
+{
+public:
+	Lz4InputStream(const Lz4InputStream&) = delete; // non construction-copyable
+	Lz4InputStream& operator=( const Lz4InputStream&) = delete; // non copyable
+
+	// `file` is read from its current position and must outlive the stream. Batch is up to `batch_size` bytes
+	// of decompressed data, and at most 16 blocks, but always at least one block.
+	explicit Lz4InputStream(fsal::File* file, size_t batch_size = 16 * 1024 * 1024);
+
+	~Lz4InputStream() override;
+
+	fsal::Status Read(uint8_t* dst, size_t size, size_t* read) override;
+
+	uint64_t Tell() const override { return m_position; }
+
+private:
+	struct Block
+	{
+		size_t offset;
+		uint32_t size;
+		bool compressed;
+		bool has_checksum;
+		uint32_t checksum;
+		size_t decompressed_size;
+	};
+
+	// Reads and decompresses next batch of blocks. Returns false at the end of the file
+	bool NextBatch();
+
+	// Reads header of the next frame, skipping skippable frames. Returns false at the end of the file
+	bool ReadFrameHeader();
+
+	// Reads exactly `size` bytes, throws on unexpected end of file
+	void ReadExact(void* dst, size_t size);
+
+	// Checks and decompresses block `i` of the batch. Linked blocks need the preceding data as `dict`
+	void Decompress(size_t i, const uint8_t* dict, size_t dict_size);
+
+	const uint8_t* BlockData(size_t i) const;
+
+	fsal::File* m_file;
+	size_t m_batch_size;
+	uint64_t m_position;
+	fsal::Status m_file_status;
+
+	bool m_in_frame;
+	bool m_independent_blocks;
+	bool m_block_checksum;
+	bool m_content_checksum;
+	size_t m_block_max_size;
+	XXH32_state_s* m_content_hash;
+
+	std::vector<uint8_t> m_compressed;
+	std::vector<uint8_t> m_decompressed;
+	std::vector<Block> m_blocks;
+	// Last 64KB of decompressed data of the frame, which is the dictionary for linked blocks
+	std::vector<uint8_t> m_dict;
+
+	size_t m_current_block;
+	size_t m_current_offset;
+};
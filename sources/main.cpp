@@ -22,17 +22,27 @@
 #include <fsal.h>
 #include <StdFile.h>
 #include <cstdio>
+#include <cmath>
+#include <random>
 #include <sstream>
 #ifdef __linux
 #include <sys/stat.h>
 #endif
 
 #include "jpeg_decoder.h"
+#include "png_decoder.h"
+#include "webp_decoder.h"
+#include "image_decoder.h"
+#include "thread_pool.h"
 #include "protobuf/example.pb.h"
 
 #include "record_readers.h"
+#include "record_index.h"
+#include "record_writer.h"
 #include "record_yielder.h"
+#include "record_dataset.h"
 #include "example.h"
+#include "dlpack.h"
 
 
 int main()
@@ -142,7 +152,74 @@ static py::object read_as_numpy_ubyte(const fsal::File& fp, const py::object& _s
 	return data;
 }
 
-static py::object read_jpg_as_numpy(const fsal::File& fp, bool use_turbo)
+// Parses `target_size` argument: int is the size of the shorter side, tuple is (height, width). Values that are not
+// given are left unchanged.
+static void parse_target_size(const py::object& target_size, size_t& height, size_t& width, size_t& min_side)
+{
+	if (target_size.is(py::none()))
+	{
+		return;
+	}
+	if (py::isinstance<py::int_>(target_size))
+	{
+		min_side = py::cast<size_t>(target_size);
+	}
+	else
+	{
+		auto size = py::cast<std::vector<size_t> >(target_size);
+		if (size.size() != 2)
+		{
+			throw runtime_error("Argument `target_size` must be int or a tuple (height, width)");
+		}
+		height = size[0];
+		width = size[1];
+	}
+}
+
+// Converts `target_size` and `scale` arguments to JpegScaling
+static JpegScaling make_jpeg_scaling(const py::object& target_size, const py::object& scale)
+{
+	JpegScaling scaling;
+	parse_target_size(target_size, scaling.min_height, scaling.min_width, scaling.min_side);
+	if (!scale.is(py::none()))
+	{
+		float s = py::cast<float>(scale);
+		if (s <= 0.0f || s > 1.0f)
+		{
+			throw runtime_error("Argument `scale` must be in range (0, 1], got %f", s);
+		}
+		scaling.scale_num = (int)std::ceil(s * 8.0f);
+	}
+	return scaling;
+}
+
+// Converts `channels` and `target_size` arguments to WebPOptions
+static WebPOptions make_webp_options(int channels, const py::object& target_size)
+{
+	WebPOptions options;
+	options.channels = channels;
+	parse_target_size(target_size, options.height, options.width, options.min_side);
+	return options;
+}
+
+// Converts `channels`, `target_size` and `layout` arguments to ImageOptions
+static ImageOptions make_image_options(int channels, const py::object& target_size, const std::string& layout)
+{
+	ImageOptions options;
+	options.channels = channels;
+	parse_target_size(target_size, options.height, options.width, options.min_side);
+	if (layout == "CHW")
+	{
+		options.channels_first = true;
+	}
+	else if (layout != "HWC")
+	{
+		throw runtime_error("Argument `layout` must be either \"HWC\" or \"CHW\", got \"%s\"", layout.c_str());
+	}
+	return options;
+}
+
+static py::object read_jpg_as_numpy(const fsal::File& fp, bool use_turbo, const JpegScaling& scaling)
 {
 	size_t size = fp.GetSize();
 	size_t retSize = 0;
@@ -157,16 +234,255 @@ static py::object read_jpg_as_numpy(const fsal::File& fp, bool use_turbo)
 
 	if (use_turbo)
 	{
-		result = decode_jpeg_turbo(data, size);
+		result = decode_jpeg_turbo(data, size, scaling);
 	}
 	else
 	{
-		result = decode_jpeg_vanila(data, size);
+		result = decode_jpeg_vanila(data, size, scaling);
 	}
 	free(data);
 	return result;
 }
 
+// Returns read-only uint8 ndarray that points to `data` in the mapped file and keeps the mapping alive
+static py::object make_record_view(const std::shared_ptr<MappedFile>& mapping, const uint8_t* data, size_t size)
+{
+	auto* owner = new std::shared_ptr<MappedFile>(mapping);
+	py::capsule base(owner, [](void* p) { delete (std::shared_ptr<MappedFile>*)p; });
+	ndarray_uint8 view(std::array<size_t, 1>({size}), data, base);
+	view.attr("setflags")(py::arg("write") = false);
+	return view;
+}
+
+// Encoded image of a batch. Points either to the memory of a bytes object, or to `storage`, which holds content of a
+// file.
+struct EncodedImage
+{
+	std::string path;
+	const void* data = nullptr;
+	size_t size = 0;
+	std::shared_ptr<uint8_t> storage;
+
+	void* alloc(size_t s)
+	{
+		storage = std::shared_ptr<uint8_t>((uint8_t*)malloc(s), [](uint8_t*p) {free(p);});
+		data = storage.get();
+		size = s;
+		return storage.get();
+	}
+
+	// Reads the whole file `path` to `storage`. Does not require GIL.
+	void ReadFile()
+	{
+		fsal::StdFile tmp_std;
+		auto fp = openfile(path.c_str(), tmp_std);
+		size_t retSize = 0;
+		fp.Read((uint8_t*)alloc(fp.GetSize()), size, &retSize);
+		if (retSize != size)
+		{
+			throw runtime_error("Error reading file %s. Expected to read %zd bytes, but read only %zd", path.c_str(), size, retSize);
+		}
+	}
+};
+
+// Converts list of filenames or bytes objects. Only filenames are allowed if `allow_bytes` is false
+static std::vector<EncodedImage> make_encoded_images(const std::vector<py::object>& paths_or_bytes, bool allow_bytes)
+{
+	std::vector<EncodedImage> images(paths_or_bytes.size());
+	for (size_t i = 0; i < paths_or_bytes.size(); ++i)
+	{
+		const py::object& item = paths_or_bytes[i];
+		if (allow_bytes && py::isinstance<py::bytes>(item))
+		{
+			images[i].data = PyBytes_AS_STRING(item.ptr());
+			images[i].size = PyBytes_GET_SIZE(item.ptr());
+		}
+		else if (py::isinstance<py::str>(item))
+		{
+			images[i].path = py::cast<std::string>(item);
+		}
+		else
+		{
+			throw runtime_error("Item %zd has unsupported type. Expected %s", i, allow_bytes ? "str or bytes" : "str");
+		}
+	}
+	return images;
+}
+
+// Returns `out` if it is a suitable output for a batch of `n` images, or allocates a new [N, H, W, 3] array, in that
+// case size of the images is taken from the first one
+static ndarray_uint8 make_batch_output(const py::object& out, const std::vector<EncodedImage>& images)
+{
+	size_t n = images.size();
+	if (out.is(py::none()))
+	{
+		size_t width = 0;
+		size_t height = 0;
+		if (n > 0)
+		{
+			py::gil_scoped_release release;
+			read_jpeg_size_turbo(images[0].data, images[0].size, width, height);
+		}
+		return ndarray_uint8(std::array<size_t, 4>({n, height, width, 3}));
+	}
+	if (!ndarray_uint8::check_(out))
+	{
+		throw runtime_error("Argument `out` must be a C-contiguous ndarray of uint8 dtype");
+	}
+	auto result = py::reinterpret_borrow<ndarray_uint8>(out);
+	if (result.ndim() != 4 || (size_t)result.shape(0) != n || result.shape(3) != 3)
+	{
+		throw runtime_error("Argument `out` must have shape [%zd, H, W, 3]", n);
+	}
+	if (!result.writeable())
+	{
+		throw runtime_error("Argument `out` is not writeable");
+	}
+	return result;
+}
+
+static py::object read_jpgs_as_numpy(std::vector<EncodedImage>& images, const py::object& out, int threads)
+{
+	ndarray_uint8 result = make_batch_output(out, images);
+	size_t height = result.shape(1);
+	size_t width = result.shape(2);
+	uint8_t* ptr = result.mutable_data();
+	{
+		py::gil_scoped_release release;
+		ThreadPool::Default().ParallelFor(images.size(), [&](size_t i)
+		{
+			try
+			{
+				decode_jpeg_turbo_to(images[i].data, images[i].size, ptr + i * height * width * 3, width, height);
+			}
+			catch (const std::exception& e)
+			{
+				throw runtime_error("Error decoding image %zd: %s", i, e.what());
+			}
+		}, threads);
+	}
+	return result;
+}
+
+// Converts size argument, that is either int or a tuple (height, width)
+static void parse_image_size(const py::object& size, const char* name, size_t& height, size_t& width)
+{
+	if (py::isinstance<py::int_>(size))
+	{
+		height = width = py::cast<size_t>(size);
+		return;
+	}
+	auto s = py::cast<std::vector<size_t> >(size);
+	if (s.size() != 2)
+	{
+		throw runtime_error("Argument `%s` must be int or a tuple (height, width)", name);
+	}
+	height = s[0];
+	width = s[1];
+}
+
+static py::object read_jpg_crop_as_numpy(const EncodedImage& image, const py::object& size, const py::object& crop,
+		std::pair<float, float> scale, std::pair<float, float> ratio, const py::object& seed, const py::object& out)
+{
+	size_t out_height = 0;
+	size_t out_width = 0;
+	parse_image_size(size, "size", out_height, out_width);
+	if (out_height == 0 || out_width == 0)
+	{
+		throw runtime_error("Output size must be positive");
+	}
+
+	CropWindow window;
+	bool random_crop = crop.is(py::none());
+	if (!random_crop)
+	{
+		auto c = py::cast<std::vector<size_t> >(crop);
+		if (c.size() != 4)
+		{
+			throw runtime_error("Argument `crop` must be a tuple (top, left, height, width)");
+		}
+		window.top = c[0];
+		window.left = c[1];
+		window.height = c[2];
+		window.width = c[3];
+	}
+
+	RandomResizedCropSpec spec;
+	spec.scale_min = scale.first;
+	spec.scale_max = scale.second;
+	spec.ratio_min = ratio.first;
+	spec.ratio_max = ratio.second;
+	std::mt19937_64 rnd(seed.is(py::none()) ? std::random_device()() : py::cast<uint64_t>(seed));
+
+	ndarray_uint8 result;
+	if (out.is(py::none()))
+	{
+		result = ndarray_uint8(std::array<size_t, 3>({out_height, out_width, 3}));
+	}
+	else
+	{
+		if (!ndarray_uint8::check_(out))
+		{
+			throw runtime_error("Argument `out` must be a C-contiguous ndarray of uint8 dtype");
+		}
+		result = py::reinterpret_borrow<ndarray_uint8>(out);
+		if (result.ndim() != 3 || (size_t)result.shape(0) != out_height || (size_t)result.shape(1) != out_width
+		    || result.shape(2) != 3 || !result.writeable())
+		{
+			throw runtime_error("Argument `out` must be a writeable array of shape [%zd, %zd, 3]", out_height, out_width);
+		}
+	}
+	uint8_t* ptr = result.mutable_data();
+	{
+		py::gil_scoped_release release;
+		if (random_crop)
+		{
+			size_t width = 0;
+			size_t height = 0;
+			read_jpeg_size_turbo(image.data, image.size, width, height);
+			window = sample_random_resized_crop(width, height, spec, rnd);
+		}
+		decode_jpeg_turbo_crop_to(image.data, image.size, window, ptr, out_height, out_width);
+	}
+	return result;
+}
+
+static Records::DataType to_data_type(const py::object& dtype)
+{
+	return dtype.is(py::none()) ? Records::DataType::DT_INVALID : py::cast<Records::DataType>(dtype);
+}
+
+// Wraps arrays of outputs, that may be nested in lists and tuples, into DLPackArray. `dtypes` is None, logical dtype
+// of the array, or a list or tuple with an entry per item of `obj`
+static py::object to_dlpack(const py::object& obj, const py::object& dtypes)
+{
+	if (py::isinstance<py::array>(obj))
+	{
+		return py::cast(DLPackArray(py::reinterpret_borrow<py::array>(obj), to_data_type(dtypes)));
+	}
+	if (!py::isinstance<py::list>(obj) && !py::isinstance<py::tuple>(obj))
+	{
+		throw runtime_error("Can not export object of type %s through DLPack", Py_TYPE(obj.ptr())->tp_name);
+	}
+	auto items = py::reinterpret_borrow<py::sequence>(obj);
+	bool has_dtypes = !dtypes.is(py::none());
+	auto item_dtypes = py::reinterpret_borrow<py::sequence>(dtypes);
+	if (has_dtypes && ((!py::isinstance<py::list>(dtypes) && !py::isinstance<py::tuple>(dtypes)) || item_dtypes.size() != items.size()))
+	{
+		throw runtime_error("Argument `dtypes` must be a list or tuple with an entry for each of %zd items", items.size());
+	}
+	py::list result;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		result.append(to_dlpack(items[i], has_dtypes ? py::object(item_dtypes[i]) : py::none()));
+	}
+	if (py::isinstance<py::tuple>(obj))
+	{
+		return py::tuple(result);
+	}
+	return std::move(result);
+}
+
 PYBIND11_MODULE(_dareblopy, m)
 {
 	m.doc() = "_dareblopy - DareBlopy";
@@ -181,6 +497,8 @@ PYBIND11_MODULE(_dareblopy, m)
 	        and a given shape. This eliminates any additional copying/casting.
 			To use it, shape of the encoded numpy array most be known
 
+	        float16, bfloat16 and int32 can only be output dtypes of :class:`.FixedLenFeature`, see its `out_dtype`.
+
 	    Example:
 
 	        ::
@@ -195,15 +513,38 @@ PYBIND11_MODULE(_dareblopy, m)
 			.value("float32", Records::DataType::DT_FLOAT)
 			.value("int64", Records::DataType::DT_INT64)
 			.value("uint8", Records::DataType::DT_UINT8)
+			.value("int32", Records::DataType::DT_INT32)
+			.value("float16", Records::DataType::DT_HALF)
+			.value("bfloat16", Records::DataType::DT_BFLOAT16)
 			.export_values();
 
+	py::enum_<RecordReader::Compression>(m, "Compression", R"(
+	    Compression of tfrecord files. `auto` detects compression from the beginning of the file.
+	)")
+			.value("auto", RecordReader::Compression::AUTO)
+			.value("none", RecordReader::Compression::NONE)
+			.value("zlib", RecordReader::Compression::ZLIB)
+			.value("gzip", RecordReader::Compression::GZIP)
+			.value("lz4", RecordReader::Compression::LZ4);
+
 	py::class_<RecordReader>(m, "RecordReader", R"(
 	    An iterator that reads tfrecord file and returns raw records (protobuffer messages).
-	    Does not support compressed tfrecords. Performs crc32 check of read data.
+	    Performs crc32 check of read data.
+
+	    Files compressed with GZIP or ZLIB (same as `TFRecordCompressionType` of TensorFlow) are supported. By default,
+	    compression is detected automatically. Compressed files are inflated on the fly, while the next chunk of the
+	    file is being read in background. They can only be read sequentially, and have no metadata or index.
+
+	    Files in LZ4 frame format are supported as well. LZ4 blocks are decompressed in parallel on the shared thread
+	    pool, if blocks of the frame are independent, which is the case for files written by :class:`RecordWriter`.
 
 	    Args:
 	    	    file (File): a :ref:`.File` fileobject.
 	    	    filename (str): a filename of the file.
+	    	    compression (Compression, optional): compression of the file. Defaults to `Compression.auto`.
+	    	    buffer_size (int, optional): if not zero, uncompressed file is read ahead in aligned blocks of this
+	    	        size and records are taken from the block, instead of two reads per record. Records larger than the
+	    	        block are read directly. Useful for files with many small records. Defaults to 0, no buffering.
 
 	    Note:
 	    	    Contructor is overloaded and excepts either `file` (File) either `filename` (str)
@@ -216,9 +557,20 @@ PYBIND11_MODULE(_dareblopy, m)
 	            file_size, data_size, entries = rr.get_metadata()
 	            records = list(rr)
 
+	    Note:
+	    	    If `filename` is given and there is an index file next to it (see :func:`build_record_indices`),
+	    	    the index is loaded, unless `load_index` is False.
+
+	    	    If `mmap` is True, file is memory mapped and iteration yields read-only uint8 ndarrays that point
+	    	    directly to the mapped file, instead of bytes. CRC is checked over the mapped memory. Views keep the
+	    	    mapping alive and can be passed to :meth:`RecordParser.parse_example` without copying.
+
 	)")
-			.def(py::init<fsal::File>(), py::arg("file"))
-			.def(py::init<const std::string&>(), py::arg("filename"))
+			.def(py::init<fsal::File, RecordReader::Compression, size_t>(), py::arg("file"),
+			     py::arg("compression") = RecordReader::Compression::AUTO, py::arg("buffer_size") = 0)
+			.def(py::init<const std::string&, bool, bool, RecordReader::Compression, size_t>(), py::arg("filename"),
+			     py::arg("load_index") = true, py::arg("mmap") = false,
+			     py::arg("compression") = RecordReader::Compression::AUTO, py::arg("buffer_size") = 0)
 			.def("read_record", [](RecordReader& self, uint64_t& offset)->py::object
 			{
 				PyBytesObject* bytesObject = nullptr;
@@ -238,12 +590,71 @@ PYBIND11_MODULE(_dareblopy, m)
 			    Reads a record at specific offset. In majority of cases, you won't need this method, instead use
 			   `RecordReader` as iterator.
 			)")
+			.def("read_record_at", [](RecordReader& self, size_t i)->py::object
+			{
+				const auto& index = self.index();
+				if (!index)
+				{
+					throw runtime_error("Random access requires index, see build_record_indices");
+				}
+				if (i >= index->size())
+				{
+					throw runtime_error("Record number %zd is out of range, file has %zd records", i, index->size());
+				}
+				// Length is known from the index, so bytes object is allocated while GIL is held, and only the read
+				// is done without it. ReadRecordAt checks that the record has that length before writing to `buffer`
+				PyBytesObject* bytesObject = nullptr;
+				void* buffer = GetBytesAllocator(bytesObject)((*index)[i].length);
+				auto record = py::reinterpret_steal<py::object>((PyObject*)bytesObject);
+				{
+					py::gil_scoped_release release;
+
+					fsal::Status result = self.ReadRecordAt(i, [buffer](size_t) { return buffer; });
+					if (!result.ok() || result.is_eof())
+					{
+						throw runtime_error("Error reading record %zd", i);
+					}
+				}
+
+				return record;
+			}, py::arg("i"), R"(
+			    Reads a record by its number. Requires index, see :func:`build_record_indices`.
+			)")
+			.def("build_index", [](RecordReader& self)
+			{
+				py::gil_scoped_release release;
+				self.SetIndex(self.BuildIndex());
+			}, R"(
+			    Scans the file and keeps index in memory, without saving it. Useful if file can't have an index file
+			    next to it, e.g. if it is in an archive.
+			)")
+			.def_property_readonly("has_index", [](RecordReader& self)
+			{
+				return (bool)self.index();
+			})
 			.def("__iter__", [](py::object& self)->py::object
 			{
 				return self;
 			})
 			.def("__next__", [](RecordReader& self)->py::object
 			{
+				if (self.mapping())
+				{
+					const uint8_t* data = nullptr;
+					size_t size = 0;
+					{
+						py::gil_scoped_release release;
+						if (!self.GetNextView(data, size))
+						{
+							data = nullptr;
+						}
+					}
+					if (data == nullptr)
+					{
+						throw py::stop_iteration();
+					}
+					return make_record_view(self.mapping(), data, size);
+				}
 				PyBytesObject* bytesObject = nullptr;
 				auto status = self.GetNext(GetBytesAllocator(bytesObject));
 				if (!status.ok() || status.is_eof())
@@ -267,7 +678,8 @@ PYBIND11_MODULE(_dareblopy, m)
 			    Returns metadata of the tfrecord and checks all crc32 checksums.
 
 			    Note:
-			        It has to scan the whole file to
+			        It has to scan the whole file, unless the reader has index. In that case metadata is taken
+			        from the index.
 
 			    Returns:
 			        Tuple[int, int, int] - file_size, data_size, entries. Where `file_size` - size of the file,
@@ -275,50 +687,341 @@ PYBIND11_MODULE(_dareblopy, m)
 
 			)");
 
-	py::class_<Records::RecordParser::FixedLenFeature>(m, "FixedLenFeature")
+	py::class_<RecordWriter>(m, "RecordWriter", R"(
+	    Writes records to a tfrecord file. Can be used as a context manager, file is closed on exit.
+
+	    Args:
+	    	    filename (str): a filename of the file.
+	    	    compression (Compression, optional): `Compression.none` or `Compression.lz4`. LZ4 compressed file is a
+	    	        single LZ4 frame with independent 1MB blocks, which :class:`RecordReader` decompresses in parallel.
+	    	        Defaults to `Compression.none`.
+
+	    Example:
+
+	        ::
+
+	            with db.RecordWriter('data.tfrecords.lz4', compression=db.Compression.lz4) as writer:
+	                for record in db.RecordReader('data.tfrecords'):
+	                    writer.write(record)
+
+	)")
+			.def(py::init<const std::string&, RecordReader::Compression>(), py::arg("filename"),
+			     py::arg("compression") = RecordReader::Compression::NONE)
+			.def("write", [](RecordWriter& self, py::buffer record)
+			{
+				py::buffer_info info = record.request();
+				py::gil_scoped_release release;
+				self.Write(info.ptr, info.size * info.itemsize);
+			}, py::arg("record"), R"(
+			    Writes a record. Accepts bytes or any contiguous buffer.
+			)")
+			.def("close", [](RecordWriter& self)
+			{
+				py::gil_scoped_release release;
+				self.Close();
+			})
+			.def_property_readonly("closed", &RecordWriter::closed)
+			.def("__enter__", [](py::object& self)->py::object
+			{
+				return self;
+			})
+			.def("__exit__", [](RecordWriter& self, py::object, py::object, py::object)
+			{
+				py::gil_scoped_release release;
+				self.Close();
+			});
+
+	m.def("build_record_indices", [](const std::vector<std::string>& filenames, bool overwrite, int threads)
+	{
+		py::gil_scoped_release release;
+		build_record_indices(filenames, overwrite, threads);
+	}, py::arg("filenames"), py::arg("overwrite") = false, py::arg("threads") = 0, R"(
+	    Builds index files for the given tfrecord files. Index of `data.tfrecord` is saved to `data.tfrecord.idx` and
+	    holds offsets and lengths of all records. :class:`RecordReader` loads it automatically, which makes
+	    :meth:`RecordReader.get_metadata` and :meth:`RecordReader.read_record_at` O(1).
+
+	    Index is invalidated if size of the tfrecord file changes. Files are indexed in parallel.
+
+	    Args:
+	    	    filenames (List[str]): tfrecord files.
+	    	    overwrite (bool, optional): if False, files that already have an up to date index are skipped.
+	    	        Defaults to False.
+	    	    threads (int, optional): maximum number of threads to use. Defaults to 0, which uses all threads of the
+	    	        shared pool.
+	)");
+
+	py::class_<Records::RecordParser::FixedLenFeature>(m, "FixedLenFeature", R"(
+	    Feature with a fixed shape, same as `tf.io.FixedLenFeature`.
+
+	    Args:
+	    	    shape (List[int]): shape of the feature.
+	    	    dtype (DataType): type of stored values: `string`, `float32`, `int64` or `uint8`.
+	    	    default_value (optional): not implemented yet.
+	    	    out_dtype (DataType, optional): dtype of the output, values are converted to it while they are decoded,
+	    	        without an extra pass over the batch. Supported conversions are `float32` to `float16` or
+	    	        `bfloat16` (rounded to nearest even), `int64` to `int32` (wraps around, same as ``astype``) and
+	    	        `uint8` to `float32`. numpy has no bfloat16, such outputs are uint16 arrays of bfloat16 bits, that
+	    	        can be viewed as ``torch.bfloat16`` or ``ml_dtypes.bfloat16``. Defaults to None, same as `dtype`.
+	    	    scale (float, optional): multiplier of `uint8` values that are converted to `float32`, e.g. 1 / 255.
+	    	        Defaults to 1.
+
+	    Example:
+
+	        ::
+
+	            features = {
+	                'image': db.FixedLenFeature([3, 32, 32], db.uint8, out_dtype=db.float32, scale=1 / 255.),
+	                'label': db.FixedLenFeature([], db.int64, out_dtype=db.int32)
+	            }
+
+	)")
 			.def(py::init())
 			.def(py::init<std::vector<size_t>, Records::DataType>())
 			.def(py::init<std::vector<size_t>, Records::DataType, py::object>())
+			.def(py::init([](const std::vector<size_t>& shape, Records::DataType dtype, const py::object& default_value,
+			                 const py::object& out_dtype, float scale)
+			{
+				// None default value is the same as no default value
+				Records::RecordParser::FixedLenFeature feature(shape, dtype,
+						default_value.is(py::none()) ? py::object() : default_value);
+				if (!out_dtype.is(py::none()))
+				{
+					feature.out_dtype = py::cast<Records::DataType>(out_dtype);
+				}
+				feature.scale = scale;
+				return feature;
+			}), py::arg("shape"), py::arg("dtype"), py::arg("default_value") = py::none(),
+			    py::arg("out_dtype") = py::none(), py::arg("scale") = 1.0f)
 			.def_readwrite("shape", &Records::RecordParser::FixedLenFeature::shape)
 			.def_readwrite("dtype", &Records::RecordParser::FixedLenFeature::dtype)
-			.def_readwrite("default_value", &Records::RecordParser::FixedLenFeature::default_value);
+			.def_readwrite("default_value", &Records::RecordParser::FixedLenFeature::default_value)
+			.def_property("out_dtype", &Records::RecordParser::FixedLenFeature::OutputType,
+			              [](Records::RecordParser::FixedLenFeature& self, Records::DataType out_dtype)
+			              {
+				              self.out_dtype = out_dtype;
+			              })
+			.def_readwrite("scale", &Records::RecordParser::FixedLenFeature::scale);
+
+	py::class_<Records::RecordParser::VarLenFeature>(m, "VarLenFeature", R"(
+	    Feature with a variable number of values, same as `tf.io.VarLenFeature`.
+
+	    :meth:`RecordParser.parse_example` returns it as a tuple of two arrays: `values` of all examples concatenated
+	    and int64 `row_splits` of size `batch_size + 1`, so that values of the i-th example are
+	    ``values[row_splits[i]:row_splits[i + 1]]``, same as `tf.RaggedTensor.from_row_splits`.
+	    :meth:`RecordParser.parse_single_example` returns only `values`. Examples that do not have the feature get
+	    an empty row. For `uint8` dtype, bytes values of an example are concatenated.
+
+	    Example:
+
+	        ::
+
+	            parser = db.RecordParser({'tokens': db.VarLenFeature(db.int64)})
+	            values, row_splits = parser.parse_example(records)[0]
+
+	)")
+			.def(py::init<Records::DataType>(), py::arg("dtype"))
+			.def_readwrite("dtype", &Records::RecordParser::VarLenFeature::dtype);
+
+	py::class_<Records::RecordParser>(m, "RecordParser", R"(
+	    Parses serialized `tf.train.Example` records.
 
-	py::class_<Records::RecordParser>(m, "RecordParser")
-			.def(py::init<py::dict>())
-			.def(py::init<py::dict, bool>())
-			.def(py::init<py::dict, bool, int>())
+	    Args:
+	    	    features (Dict[str, FixedLenFeature or VarLenFeature]): features to parse. Outputs are returned in the
+	    	        same order.
+	    	    run_parallel (bool, optional): if True, examples of a batch are parsed on the thread pool that is shared
+	    	        with reading and decoding. Defaults to True.
+	    	    worker_count (int, optional): maximum number of threads that parse a batch, including the calling one.
+	    	        Values less than 1 use all threads of the pool. Defaults to 12.
+	    	    native_strings (bool, optional): if True, `string` features are returned as a tuple of a uint8 array
+	    	        `data`, that holds all values one after another, and an int64 array `offsets`, so that the i-th value is
+	    	        ``data[offsets[i]:offsets[i + 1]]``. Values are numbered in row-major order of the batch, for a
+	    	        :class:`VarLenFeature` the tuple also has `row_splits`, that index the values. Such outputs are filled
+	    	        in parallel, without the GIL. Otherwise, strings are returned as arrays of `bytes` objects, which
+	    	        are created one by one while holding the GIL. Defaults to False.
+	    	    batch_buffers (int, optional): if positive, outputs of :meth:`parse_example` for each
+	    	        :class:`FixedLenFeature` (but of `string` type) are allocated from a ring of that many buffers. Buffer is
+	    	        returned to the ring once the array is released, so memory of previous batches is reused instead of
+	    	        being allocated and paged in again. If all buffers are still held, a new array is allocated.
+	    	        Defaults to 0, no ring.
+
+	    Method :meth:`parse_example` also takes argument `out`, a list with an entry for each feature, that is either
+	    None or a C-contiguous, writeable array of the dtype and shape of the output, to which the feature is written.
+	    Entries for :class:`VarLenFeature` and for `string` features with `native_strings` must be None.
+
+	)")
+			.def(py::init<py::dict, bool, int, bool, int>(), py::arg("features"), py::arg("run_parallel") = true,
+			     py::arg("worker_count") = 12, py::arg("native_strings") = false, py::arg("batch_buffers") = 0)
 			.def("parse_single_example_inplace", &Records::RecordParser::ParseSingleExampleInplace)
+			.def("parse_single_example", &Records::RecordParser::ParseSingleExampleBuffer)
 			.def("parse_single_example", &Records::RecordParser::ParseSingleExample)
-			.def("parse_example", &Records::RecordParser::ParseExample);
+			.def("parse_example", &Records::RecordParser::ParseExampleBuffers, py::arg("serialized"),
+			     py::arg("out") = py::none())
+			.def("parse_example", &Records::RecordParser::ParseExample, py::arg("serialized"),
+			     py::arg("out") = py::none())
+			.def_property_readonly("output_dtypes", &Records::RecordParser::OutputDTypes, R"(
+			    Output dtype of each feature, in order of outputs, or None for :class:`VarLenFeature` and `string`
+			    features. Can be passed to :func:`to_dlpack`, so that `bfloat16` outputs, which are uint16 arrays for
+			    numpy, are exported as bfloat16.
+			)");
+
+	py::class_<RecordYielderBasic>(m, "RecordYielderBasic", R"(
+	    Yields records from the given tfrecord files, in the given order.
+
+	    Args:
+	    	    filenames (List[str]): list of tfrecord files.
+	    	    shard_index (int, optional): index of the shard to read, for example rank of the process.
+	    	        Defaults to 0.
+	    	    num_shards (int, optional): number of shards, for example world size. If there are at least as many
+	    	        files as shards, each shard reads a contiguous block of files, blocks are balanced by size of the
+	    	        files. Otherwise, records are split into equal contiguous ranges, which requires index files (see
+	    	        :func:`build_record_indices`) and does not work for compressed files. Defaults to 1, all records
+	    	        are read.
+	    	    cycle_length (int, optional): number of files that are read at once, each on its own thread, same as in
+	    	        `tf.data.Dataset.interleave`. State of reading is not available when files are interleaved.
+	    	        Defaults to 1, files are read one after another.
+	    	    block_length (int, optional): number of consecutive records that are taken from each of the files that
+	    	        are read at once. Defaults to 1.
+	    	    deterministic (bool, optional): if False, records are taken from whichever file has them ready, so a
+	    	        slow file does not stall the others, but the order is not reproducible. Defaults to True.
 
-	py::class_<RecordYielderBasic>(m, "RecordYielderBasic")
-			.def(py::init<std::vector<std::string>&>(), py::arg("filenames"))
+	)")
+			.def(py::init<std::vector<std::string>&, int, int, int, int, bool>(), py::arg("filenames"),
+			     py::arg("shard_index") = 0, py::arg("num_shards") = 1,
+			     py::arg("cycle_length") = 1, py::arg("block_length") = 1, py::arg("deterministic") = true)
 			.def("__iter__", [](py::object& self)->py::object
 			{
 				return self;
 			})
 			.def("__next__", &RecordYielderBasic::GetNext, py::return_value_policy::take_ownership)
-	        .def("next_n", &RecordYielderBasic::GetNextN, py::return_value_policy::take_ownership);
+	        .def("next_n", &RecordYielderBasic::GetNextN, py::return_value_policy::take_ownership)
+			.def("get_state", &RecordYielderBasic::GetState, R"(
+			    Returns position of reading as a dict, which can be pickled. Reading can be resumed from it with
+			    :meth:`set_state`.
+			)")
+			.def("set_state", &RecordYielderBasic::SetState, py::arg("state"), R"(
+			    Resumes reading from the position returned by :meth:`get_state`.
+			)");
+
+	py::class_<RecordYielderRandomized>(m, "RecordYielderRandomized", R"(
+	    Yields records from the given tfrecord files in randomized order.
+
+	    Order of files is shuffled and records are passed through a shuffle buffer of size `buffer_size`.
 
-	py::class_<RecordYielderRandomized>(m, "RecordYielderRandomized")
-			.def(py::init<std::vector<std::string>&, int, uint64_t, int>(),
-			        py::arg("filenames"),  py::arg("buffer_size"),  py::arg("seed"),  py::arg("epoch"))
+	    Args:
+	    	    filenames (List[str]): list of tfrecord files.
+	    	    buffer_size (int): size of the shuffle buffer.
+	    	    seed (int): seed for the random generator.
+	    	    epoch (int): epoch number, mixed into the seed.
+	    	    prefetch (int): if greater than zero, records are read and shuffled on a background thread, and up to
+	    	        `prefetch` records are kept ready. Order of records is the same as without prefetching.
+	    	        Defaults to 0, prefetching is disabled.
+	    	    shard_index (int, optional): index of the shard to read, for example rank of the process.
+	    	        Defaults to 0.
+	    	    num_shards (int, optional): number of shards, for example world size. Shuffled list of files is split
+	    	        the same way as by :class:`RecordYielderBasic`. Shards are disjoint and cover all records, if all
+	    	        of them use the same `seed` and `epoch`. Defaults to 1, all records are read.
+	    	    cycle_length (int, optional): number of files that are read at once, each on its own thread, same as in
+	    	        `tf.data.Dataset.interleave`. State of reading is not available when files are interleaved.
+	    	        Defaults to 1, files are read one after another.
+	    	    block_length (int, optional): number of consecutive records that are taken from each of the files that
+	    	        are read at once. Defaults to 1.
+	    	    deterministic (bool, optional): if False, records are taken from whichever file has them ready, so a
+	    	        slow file does not stall the others, but the order is not reproducible. Defaults to True.
+
+	)")
+			.def(py::init<std::vector<std::string>&, int, uint64_t, int, int, int, int, int, int, bool>(),
+			        py::arg("filenames"),  py::arg("buffer_size"),  py::arg("seed"),  py::arg("epoch"), py::arg("prefetch") = 0,
+			        py::arg("shard_index") = 0, py::arg("num_shards") = 1,
+			        py::arg("cycle_length") = 1, py::arg("block_length") = 1, py::arg("deterministic") = true)
 			.def("__iter__", [](py::object& self)->py::object
 			{
 				return self;
 			})
 			.def("__next__", &RecordYielderRandomized::GetNext, py::return_value_policy::take_ownership)
-			.def("next_n", &RecordYielderRandomized::GetNextN, py::return_value_policy::take_ownership);
+			.def("next_n", &RecordYielderRandomized::GetNextN, py::return_value_policy::take_ownership)
+			.def("get_state", &RecordYielderRandomized::GetState, py::arg("include_buffer") = true, R"(
+			    Returns position of reading as a dict, which can be pickled: remaining parts of the shuffled files,
+			    state of the random generator and records that are held in the shuffle buffer and the prefetch queue.
+
+			    Args:
+			    	    include_buffer (bool, optional): if False, records of the shuffle buffer and the prefetch queue
+			    	        are not included, which makes the state small, but these records are skipped after resuming.
+			    	        Defaults to True.
+			)")
+			.def("set_state", &RecordYielderRandomized::SetState, py::arg("state"), R"(
+			    Resumes reading from the position returned by :meth:`get_state`, without reading the records that were
+			    already yielded. Yielder must be created with the same `buffer_size`.
+			)");
 
 	py::class_<ParsedRecordYielderRandomized>(m, "ParsedRecordYielderRandomized")
-			.def(py::init<py::object, std::vector<std::string>&, int, uint64_t, int>(),
-			        py::arg("parser"), py::arg("filenames"),  py::arg("buffer_size"),  py::arg("seed"),  py::arg("epoch"))
+			.def(py::init<py::object, std::vector<std::string>&, int, uint64_t, int, int, int, int, int, int, bool>(),
+			        py::arg("parser"), py::arg("filenames"),  py::arg("buffer_size"),  py::arg("seed"),  py::arg("epoch"), py::arg("prefetch") = 0,
+			        py::arg("shard_index") = 0, py::arg("num_shards") = 1,
+			        py::arg("cycle_length") = 1, py::arg("block_length") = 1, py::arg("deterministic") = true)
 			.def("__iter__", [](py::object& self)->py::object
 			{
 				return self;
 			})
 			.def("__next__", &ParsedRecordYielderRandomized::GetNext, py::return_value_policy::take_ownership)
-			.def("next_n", &ParsedRecordYielderRandomized::GetNextN, py::return_value_policy::take_ownership);
+			.def("next_n", &ParsedRecordYielderRandomized::GetNextN, py::return_value_policy::take_ownership)
+			.def("get_state", &ParsedRecordYielderRandomized::GetState, py::arg("include_buffer") = true, R"(
+			    Returns position of reading as a dict, which can be pickled: remaining parts of the shuffled files,
+			    state of the random generator and records that are held in the shuffle buffer and the prefetch queue.
+
+			    Args:
+			    	    include_buffer (bool, optional): if False, records of the shuffle buffer and the prefetch queue
+			    	        are not included, which makes the state small, but these records are skipped after resuming.
+			    	        Defaults to True.
+			)")
+			.def("set_state", &ParsedRecordYielderRandomized::SetState, py::arg("state"), R"(
+			    Resumes reading from the position returned by :meth:`get_state`, without reading the records that were
+			    already yielded. Yielder must be created with the same `buffer_size`.
+			)");
+
+	py::class_<RecordDataset>(m, "RecordDataset", R"(
+	    Map-style dataset of raw records of the given tfrecord files. Records are addressed by their number, files
+	    are concatenated in the given order.
+
+	    Random access is done using index files (see :func:`build_record_indices`). Files that don't have an index
+	    are scanned on construction and indexed in memory.
+
+	    Unlike :class:`RecordYielderRandomized`, which approximates shuffling with a buffer, this allows exact global
+	    shuffling, see :meth:`permutation`.
+
+	    Args:
+	    	    filenames (List[str]): tfrecord files.
+	    	    use_io_uring (bool, optional): read batches with io_uring if the kernel allows it, otherwise with
+	    	        positional reads on the shared thread pool. Defaults to True.
+
+	    Example:
+
+	        ::
+
+	            dataset = db.RecordDataset(filenames)
+	            order = dataset.permutation(seed=0, epoch=epoch)
+	            for i in range(0, len(dataset), batch_size):
+	                records = dataset.get_batch(order[i:i + batch_size])
+
+	)")
+			.def(py::init<const std::vector<std::string>&, bool>(), py::arg("filenames"), py::arg("use_io_uring") = true)
+			.def("__len__", &RecordDataset::size)
+			.def_property_readonly("uses_io_uring", &RecordDataset::uses_io_uring)
+			.def("__getitem__", &RecordDataset::GetItem, py::arg("i"))
+			.def("get_batch", &RecordDataset::GetBatch, py::arg("indices"), py::arg("threads") = 0, R"(
+			    Reads records with the given numbers. Records are read in parallel, with GIL released.
+
+			    Args:
+			    	    indices (List[int]): numbers of records.
+			    	    threads (int, optional): maximum number of threads to use. Defaults to 0, which uses all
+			    	        threads of the shared pool.
+
+			    Returns:
+			    	    List[bytes] - records in the order of `indices`.
+			)")
+			.def("permutation", &RecordDataset::Permutation, py::arg("seed"), py::arg("epoch") = 0, R"(
+			    Returns a random permutation of numbers of all records, as int64 ndarray. Same `seed` and `epoch`
+			    always give the same permutation.
+			)");
 
 	m.def("open_as_bytes", [](const char* filename)
 	{
@@ -339,16 +1042,293 @@ PYBIND11_MODULE(_dareblopy, m)
 		return read_as_numpy_ubyte(fp, shape);
 	},  py::arg("filename"),  py::arg("shape").none(true) = py::none());
 
-	m.def("read_jpg_as_numpy", [](const char* filename, bool use_turbo)
+	m.def("read_jpg_as_numpy", [](const char* filename, bool use_turbo, py::object target_size, py::object scale)
+	{
+		auto scaling = make_jpeg_scaling(target_size, scale);
+		fsal::StdFile tmp_std;
+		fsal::File fp;
+		{
+			py::gil_scoped_release release;
+			fp = openfile(filename, tmp_std);
+		}
+		return read_jpg_as_numpy(fp, use_turbo, scaling);
+	},  py::arg("filename"),  py::arg("use_turbo") = false,
+	    py::arg("target_size").none(true) = py::none(), py::arg("scale").none(true) = py::none(), R"(
+	    Reads JPEG image to ndarray of shape [H, W, C] and uint8 dtype, where C is 1 for grayscale images and 3
+	    otherwise. Both backends give the same shape.
+
+	    Image can be downscaled while decoding by factor M/8, where M is in range [1, 8]. Downscaling is done in DCT
+	    domain, which is much faster than decoding at full resolution and resizing afterwards.
+
+	    Args:
+	    	    filename (str): a filename of the image.
+	    	    use_turbo (bool, optional): use libjpeg-turbo instead of libjpeg. Defaults to False.
+	    	    target_size (Union[int, Tuple[int, int]], optional): smallest acceptable size of the output. If int, it is
+	    	        the size of the shorter side, if tuple, it is (height, width). The smallest scale that still covers
+	    	        the requested size is picked. Images smaller than that are decoded at full resolution.
+	    	    scale (float, optional): scale in range (0, 1], rounded up to the nearest multiple of 1/8. Ignored if
+	    	        `target_size` is given.
+	)");
+
+	m.def("read_jpgs_as_numpy", [](const std::vector<py::object>& paths_or_bytes, py::object out, int threads)
+	{
+		auto images = make_encoded_images(paths_or_bytes, true);
+		{
+			py::gil_scoped_release release;
+			ThreadPool::Default().ParallelFor(images.size(), [&images](size_t i)
+			{
+				EncodedImage& image = images[i];
+				if (image.data != nullptr)
+				{
+					return;
+				}
+				image.ReadFile();
+			}, threads);
+		}
+		return read_jpgs_as_numpy(images, out, threads);
+	},  py::arg("paths_or_bytes"),  py::arg("out").none(true) = py::none(), py::arg("threads") = 0, R"(
+	    Decodes a batch of JPEG images to a single ndarray of shape [N, H, W, 3] and uint8 dtype using libjpeg-turbo.
+
+	    Files are read and decoded in parallel on a native thread pool, while GIL is released. All images must
+	    have the same size. Grayscale images are converted to RGB.
+
+	    Args:
+	    	    paths_or_bytes (List[Union[str, bytes]]): filenames or encoded images.
+	    	    out (ndarray, optional): preallocated C-contiguous uint8 array of shape [N, H, W, 3] to decode to. If
+	    	        None, a new array is allocated and size of the images is taken from the first one.
+	    	    threads (int, optional): maximum number of threads to use. Defaults to 0, all threads of the pool.
+
+	    Returns:
+	    	    ndarray - `out` if it was given, otherwise a newly allocated array.
+	)");
+
+	m.def("read_jpg_crop_as_numpy", [](const char* filename, py::object size, py::object crop,
+			std::pair<float, float> scale, std::pair<float, float> ratio, py::object seed, py::object out)
+	{
+		EncodedImage image;
+		image.path = filename;
+		{
+			py::gil_scoped_release release;
+			image.ReadFile();
+		}
+		return read_jpg_crop_as_numpy(image, size, crop, scale, ratio, seed, out);
+	},  py::arg("filename"),  py::arg("size"), py::arg("crop").none(true) = py::none(),
+	    py::arg("scale") = std::make_pair(0.08f, 1.0f), py::arg("ratio") = std::make_pair(3.0f / 4.0f, 4.0f / 3.0f),
+	    py::arg("seed").none(true) = py::none(), py::arg("out").none(true) = py::none(), R"(
+	    Decodes a crop of JPEG image, resized to the given size, using libjpeg-turbo.
+
+	    Only the part of the image that is covered by the crop window is decoded: rows above the window are skipped,
+	    rows below are never read, and only iMCU columns intersecting the window are decompressed. If the window is
+	    larger than the output, it is also downscaled in DCT domain. The rest is resized with bilinear interpolation
+	    directly to the output array. All of it happens while GIL is released.
+
+	    Args:
+	    	    filename (str): a filename of the image.
+	    	    size (Union[int, Tuple[int, int]]): size of the output, (height, width).
+	    	    crop (Tuple[int, int, int, int], optional): crop window (top, left, height, width) in pixels of the
+	    	        image. If None, window is sampled randomly, same as torchvision.transforms.RandomResizedCrop does.
+	    	    scale (Tuple[float, float], optional): range of the area of the random window relative to the area of
+	    	        the image. Defaults to (0.08, 1.0).
+	    	    ratio (Tuple[float, float], optional): range of the aspect ratio of the random window.
+	    	        Defaults to (3/4, 4/3).
+	    	    seed (int, optional): seed for sampling of the random window. If None, a random seed is used.
+	    	    out (ndarray, optional): preallocated C-contiguous uint8 array of shape [height, width, 3] to decode to.
+
+	    Returns:
+	    	    ndarray - array of shape [height, width, 3] and uint8 dtype.
+	)");
+
+	m.def("read_png_as_numpy", [](const char* filename, int channels, bool keep_16bit)
+	{
+		EncodedImage image;
+		image.path = filename;
+		{
+			py::gil_scoped_release release;
+			image.ReadFile();
+		}
+		PngOptions options;
+		options.channels = channels;
+		options.keep_16bit = keep_16bit;
+		return decode_png(image.data, image.size, options);
+	},  py::arg("filename"), py::arg("channels") = 0, py::arg("keep_16bit") = true, R"(
+	    Reads PNG image to ndarray of shape [H, W, C] using libpng. Image is decoded directly to the output array
+	    while GIL is released.
+
+	    Palette images are expanded to RGB, transparency chunk is expanded to alpha channel.
+
+	    Args:
+	    	    filename (str): a filename of the image.
+	    	    channels (int, optional): number of channels of the output: 1 - gray, 2 - gray with alpha, 3 - RGB,
+	    	        4 - RGBA. Defaults to 0, channels are kept as stored.
+	    	    keep_16bit (bool, optional): if True, 16-bit images are returned as uint16 arrays, otherwise they are
+	    	        scaled down to uint8. Defaults to True.
+	)");
+
+	m.def("read_webp_as_numpy", [](const char* filename, int channels, const py::object& target_size)
 	{
+		auto options = make_webp_options(channels, target_size);
 		fsal::StdFile tmp_std;
 		fsal::File fp;
 		{
 			py::gil_scoped_release release;
 			fp = openfile(filename, tmp_std);
 		}
-		return read_jpg_as_numpy(fp, use_turbo);
-	},  py::arg("filename"),  py::arg("use_turbo") = false);
+		return decode_webp_incremental([&fp](uint8_t* dst, size_t size)
+		{
+			size_t retSize = 0;
+			fp.Read(dst, size, &retSize);
+			return retSize;
+		}, options);
+	},  py::arg("filename"), py::arg("channels") = 0, py::arg("target_size").none(true) = py::none(), R"(
+	    Reads WebP image to ndarray of shape [H, W, C] using libwebp. Image is decoded directly to the output array
+	    while GIL is released. File is read and decoded chunk by chunk, so it is never buffered as a whole.
+
+	    Args:
+	    	    filename (str): a filename of the image.
+	    	    channels (int, optional): number of channels of the output: 3 - RGB, 4 - RGBA. Defaults to 0, which
+	    	        gives RGBA for images with alpha and RGB otherwise.
+	    	    target_size (int or tuple, optional): if int, image is scaled preserving aspect ratio, so that its
+	    	        shorter side equals `target_size`. If tuple (height, width), image is scaled to exactly that size.
+	    	        Scaling is done by the decoder, so no full-size image is produced. Defaults to None, no scaling.
+	)");
+
+	m.def("read_image_as_numpy", [](const py::object& source, int channels, const py::object& target_size, const std::string& layout)
+	{
+		auto options = make_image_options(channels, target_size, layout);
+		EncodedImage image;
+		if (py::isinstance<py::bytes>(source))
+		{
+			image.data = PyBytes_AS_STRING(source.ptr());
+			image.size = PyBytes_GET_SIZE(source.ptr());
+		}
+		else if (py::isinstance<py::str>(source))
+		{
+			image.path = py::cast<std::string>(source);
+		}
+		else
+		{
+			throw runtime_error("Argument `source` must be str or bytes");
+		}
+
+		DecodedImage decoded;
+		{
+			py::gil_scoped_release release;
+			if (image.data == nullptr)
+			{
+				image.ReadFile();
+			}
+			decode_image(image.data, image.size, options, decoded);
+		}
+		return decoded.ToNumpy();
+	},  py::arg("source"), py::arg("channels") = 0, py::arg("target_size").none(true) = py::none(),
+	    py::arg("layout") = "HWC", R"(
+	    Reads JPEG, PNG or WebP image to uint8 ndarray. Format is detected by the magic bytes of the file, so the
+	    extension does not matter. Reading and decoding are done while GIL is released.
+
+	    JPEGs are decoded with libjpeg-turbo, PNGs with libpng and WebPs with libwebp. 16-bit PNGs are scaled down
+	    to 8 bit.
+
+	    Args:
+	    	    source (str or bytes): a filename of the image, or encoded image itself.
+	    	    channels (int, optional): number of channels of the output: 1 - gray, 3 - RGB, 4 - RGBA. Defaults to 0,
+	    	        channels are kept as stored.
+	    	    target_size (int or tuple, optional): if int, image is scaled preserving aspect ratio, so that its
+	    	        shorter side equals `target_size`. If tuple (height, width), image is scaled to that size.
+	    	        Shape of the output does not depend on the format. Defaults to None, no scaling.
+	    	    layout (str, optional): "HWC" or "CHW". Defaults to "HWC".
+
+	    Returns:
+	    	    ndarray - array of shape [H, W, C] or [C, H, W] and uint8 dtype.
+	)");
+
+	m.def("read_images_as_numpy", [](const std::vector<py::object>& paths_or_bytes, int channels,
+			const py::object& target_size, const std::string& layout, int threads)
+	{
+		auto options = make_image_options(channels, target_size, layout);
+		auto images = make_encoded_images(paths_or_bytes, true);
+		std::vector<DecodedImage> decoded(images.size());
+		{
+			py::gil_scoped_release release;
+			ThreadPool::Default().ParallelFor(images.size(), [&](size_t i)
+			{
+				if (images[i].data == nullptr)
+				{
+					images[i].ReadFile();
+				}
+				try
+				{
+					decode_image(images[i].data, images[i].size, options, decoded[i]);
+				}
+				catch (const std::exception& e)
+				{
+					throw runtime_error("Error decoding image %zd: %s", i, e.what());
+				}
+			}, threads);
+		}
+		py::list result;
+		for (auto& image: decoded)
+		{
+			result.append(image.ToNumpy());
+		}
+		return result;
+	},  py::arg("paths_or_bytes"), py::arg("channels") = 0, py::arg("target_size").none(true) = py::none(),
+	    py::arg("layout") = "HWC", py::arg("threads") = 0, R"(
+	    Same as :func:`read_image_as_numpy`, but for a batch of images, that may have different formats and sizes.
+	    All files are read and decoded in parallel on a native thread pool, with GIL released once for the whole batch.
+
+	    Args:
+	    	    paths_or_bytes (List[Union[str, bytes]]): filenames or encoded images.
+	    	    channels (int, optional): same as for :func:`read_image_as_numpy`.
+	    	    target_size (int or tuple, optional): same as for :func:`read_image_as_numpy`.
+	    	    layout (str, optional): same as for :func:`read_image_as_numpy`.
+	    	    threads (int, optional): maximum number of threads to use. Defaults to 0, all threads of the pool.
+
+	    Returns:
+	    	    List[ndarray] - decoded images, in the same order.
+	)");
+
+	py::class_<DLPackArray>(m, "DLPackArray", R"(
+	    Array that supports the DLPack protocol, so that its memory can be taken without a copy by
+	    `torch.from_dlpack`, `jax.dlpack.from_dlpack` or `numpy.from_dlpack`. The consumer holds a reference to the
+	    array, so memory stays valid (and buffers of a :class:`RecordParser` ring are not reused) until the consumer's
+	    tensor is deleted. Arrays of objects (`string` features) and read-only arrays can not be exported.
+
+	    Args:
+	    	    array (ndarray): array to export.
+	    	    dtype (DataType, optional): dtype of the elements. May differ from dtype of the array only for
+	    	        `bfloat16`, which is held as uint16 by numpy. Defaults to None, dtype of the array is used.
+	)")
+			.def(py::init([](py::array array, const py::object& dtype)
+			{
+				return DLPackArray(std::move(array), to_data_type(dtype));
+			}), py::arg("array"), py::arg("dtype") = py::none())
+			.def("__dlpack__", &DLPackArray::Export, py::arg("stream") = py::none())
+			.def("__dlpack_device__", &DLPackArray::Device)
+			.def_property_readonly("array", &DLPackArray::array);
+
+	m.def("to_dlpack", &to_dlpack, py::arg("obj"), py::arg("dtypes") = py::none(), R"(
+	    Wraps arrays into :class:`DLPackArray`. Arrays may be nested in lists and tuples, so outputs of
+	    :meth:`RecordParser.parse_example`, :meth:`RecordParser.parse_single_example`, :func:`read_jpg_as_numpy`,
+	    :meth:`Archive.read_jpg_as_numpy`, etc. can be passed as is.
+
+	    Args:
+	    	    obj (ndarray, list or tuple): array or a (nested) list or tuple of arrays.
+	    	    dtypes (DataType, list or tuple, optional): dtype of the elements of `obj`, see :class:`DLPackArray`,
+	    	        or a list or tuple with an entry per item of `obj`, e.g. :attr:`RecordParser.output_dtypes`.
+	    	        Defaults to None, dtypes of the arrays are used.
+
+	    Returns:
+	    	    Same structure, with arrays replaced by :class:`DLPackArray`.
+
+	    Example:
+
+	        ::
+
+	            parser = db.RecordParser(features, batch_buffers=4)
+	            batch = db.to_dlpack(parser.parse_example(records), parser.output_dtypes)
+	            images, labels = [torch.from_dlpack(x) for x in batch]
+
+	)");
 
 	py::enum_<fsal::Mode>(m, "Mode", py::arithmetic())
 		.value("read", fsal::Mode::kRead)
@@ -448,8 +1428,10 @@ PYBIND11_MODULE(_dareblopy, m)
 			}
 			return data;
 		})
-		.def("read_jpg_as_numpy", [](fsal::Archive& self, const std::string& filepath, bool use_turbo)
+		.def("read_jpg_as_numpy", [](fsal::Archive& self, const std::string& filepath, bool use_turbo,
+				py::object target_size, py::object scale)
 		{
+			auto scaling = make_jpeg_scaling(target_size, scale);
 			size_t size = 0;
 			std::shared_ptr<uint8_t> data;
 			{
@@ -468,13 +1450,108 @@ PYBIND11_MODULE(_dareblopy, m)
 			}
 			if (use_turbo)
 			{
-				return decode_jpeg_turbo(data.get(), size);
+				return decode_jpeg_turbo(data.get(), size, scaling);
 			}
 			else
 			{
-				return decode_jpeg_vanila(data.get(), size);
+				return decode_jpeg_vanila(data.get(), size, scaling);
+			}
+		},  py::arg("filename"),  py::arg("use_turbo") = false,
+		    py::arg("target_size").none(true) = py::none(), py::arg("scale").none(true) = py::none(), R"(
+		    Same as :func:`read_jpg_as_numpy`, but reads file from the archive.
+		)")
+		.def("read_jpgs_as_numpy", [](fsal::Archive& self, const std::vector<py::object>& filenames, py::object out, int threads)
+		{
+			auto images = make_encoded_images(filenames, false);
+			{
+				py::gil_scoped_release release;
+				for (auto& image: images)
+				{
+					void* f = self.OpenFile(image.path, [&image](size_t s) { return image.alloc(s); });
+					if (!f)
+					{
+						throw runtime_error("Can't open file: %s", image.path.c_str());
+					}
+				}
+			}
+			return read_jpgs_as_numpy(images, out, threads);
+		},  py::arg("filenames"),  py::arg("out").none(true) = py::none(), py::arg("threads") = 0, R"(
+		    Same as :func:`read_jpgs_as_numpy`, but reads files from the archive. Files are read sequentially, decoding
+		    is done in parallel.
+		)")
+		.def("read_jpg_crop_as_numpy", [](fsal::Archive& self, const std::string& filepath, py::object size,
+				py::object crop, std::pair<float, float> scale, std::pair<float, float> ratio, py::object seed,
+				py::object out)
+		{
+			EncodedImage image;
+			{
+				py::gil_scoped_release release;
+				void* f = self.OpenFile(filepath, [&image](size_t s) { return image.alloc(s); });
+				if (!f)
+				{
+					throw runtime_error("Can't open file: %s", filepath.c_str());
+				}
+			}
+			return read_jpg_crop_as_numpy(image, size, crop, scale, ratio, seed, out);
+		},  py::arg("filename"),  py::arg("size"), py::arg("crop").none(true) = py::none(),
+		    py::arg("scale") = std::make_pair(0.08f, 1.0f), py::arg("ratio") = std::make_pair(3.0f / 4.0f, 4.0f / 3.0f),
+		    py::arg("seed").none(true) = py::none(), py::arg("out").none(true) = py::none(), R"(
+		    Same as :func:`read_jpg_crop_as_numpy`, but reads file from the archive.
+		)")
+		.def("read_png_as_numpy", [](fsal::Archive& self, const std::string& filepath, int channels, bool keep_16bit)
+		{
+			EncodedImage image;
+			{
+				py::gil_scoped_release release;
+				void* f = self.OpenFile(filepath, [&image](size_t s) { return image.alloc(s); });
+				if (!f)
+				{
+					throw runtime_error("Can't open file: %s", filepath.c_str());
+				}
+			}
+			PngOptions options;
+			options.channels = channels;
+			options.keep_16bit = keep_16bit;
+			return decode_png(image.data, image.size, options);
+		},  py::arg("filename"), py::arg("channels") = 0, py::arg("keep_16bit") = true, R"(
+		    Same as :func:`read_png_as_numpy`, but reads file from the archive.
+		)")
+		.def("read_webp_as_numpy", [](fsal::Archive& self, const std::string& filepath, int channels, const py::object& target_size)
+		{
+			auto options = make_webp_options(channels, target_size);
+			EncodedImage image;
+			{
+				py::gil_scoped_release release;
+				void* f = self.OpenFile(filepath, [&image](size_t s) { return image.alloc(s); });
+				if (!f)
+				{
+					throw runtime_error("Can't open file: %s", filepath.c_str());
+				}
+			}
+			return decode_webp(image.data, image.size, options);
+		},  py::arg("filename"), py::arg("channels") = 0, py::arg("target_size").none(true) = py::none(), R"(
+		    Same as :func:`read_webp_as_numpy`, but reads file from the archive.
+		)")
+		.def("read_image_as_numpy", [](fsal::Archive& self, const std::string& filepath, int channels,
+				const py::object& target_size, const std::string& layout)
+		{
+			auto options = make_image_options(channels, target_size, layout);
+			EncodedImage image;
+			DecodedImage decoded;
+			{
+				py::gil_scoped_release release;
+				void* f = self.OpenFile(filepath, [&image](size_t s) { return image.alloc(s); });
+				if (!f)
+				{
+					throw runtime_error("Can't open file: %s", filepath.c_str());
+				}
+				decode_image(image.data, image.size, options, decoded);
 			}
-		},  py::arg("filename"),  py::arg("use_turbo") = false)
+			return decoded.ToNumpy();
+		},  py::arg("filename"), py::arg("channels") = 0, py::arg("target_size").none(true) = py::none(),
+		    py::arg("layout") = "HWC", R"(
+		    Same as :func:`read_image_as_numpy`, but reads file from the archive.
+		)")
 		.def("exists", [](fsal::Archive& self, const std::string& filepath){
 			return self.Exists(filepath);
 		}, "Exists")
@@ -0,0 +1,246 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "png_decoder.h"
+#include <png.h>
+#include <string.h>
+#include <vector>
+
+
+namespace
+{
+// Reads PNG from memory. Decoding is split in two steps, reading of the header and reading of the image, so that
+// the output can be allocated in between, while GIL is held.
+// libpng signals errors with longjmp, they are caught in each step and converted to exceptions.
+class PngDecoder
+{
+public:
+	PngDecoder(const PngDecoder&) = delete; // non construction-copyable
+	PngDecoder& operator=( const PngDecoder&) = delete; // non copyable
+
+	PngDecoder(const void* data, size_t size): m_data((const uint8_t*)data), m_size(size), m_offset(0),
+			m_png(nullptr), m_info(nullptr), m_width(0), m_height(0), m_channels(0), m_bit_depth(0)
+	{
+	}
+
+	~PngDecoder()
+	{
+		png_destroy_read_struct(&m_png, &m_info, nullptr);
+	}
+
+	void ReadHeader(const PngOptions& options)
+	{
+		if (m_data == nullptr)
+		{
+			throw runtime_error("Error reading file PNG. Got nullptr to decompress");
+		}
+		if (options.channels < 0 || options.channels > 4)
+		{
+			throw runtime_error("Error reading file PNG. Number of channels must be in range [0, 4], got %d", options.channels);
+		}
+		if (m_size < 8 || png_sig_cmp(m_data, 0, 8) != 0)
+		{
+			throw runtime_error("Error reading file PNG. Not a PNG file");
+		}
+		m_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, this, error_fn, warning_fn);
+		if (m_png == nullptr)
+		{
+			throw runtime_error("Error reading file PNG. Can't create read struct");
+		}
+		m_info = png_create_info_struct(m_png);
+		if (m_info == nullptr)
+		{
+			throw runtime_error("Error reading file PNG. Can't create info struct");
+		}
+
+		if (setjmp(png_jmpbuf(m_png)))
+		{
+			throw runtime_error("Error reading file PNG. libpng has signaled an error: %s", m_error.c_str());
+		}
+
+		png_set_read_fn(m_png, this, read_fn);
+		png_read_info(m_png, m_info);
+
+		int color_type = png_get_color_type(m_png, m_info);
+		int bit_depth = png_get_bit_depth(m_png, m_info);
+		bool has_color = (color_type & PNG_COLOR_MASK_COLOR) != 0;
+		bool has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) != 0;
+
+		if (color_type == PNG_COLOR_TYPE_PALETTE)
+		{
+			png_set_palette_to_rgb(m_png);
+		}
+		if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+		{
+			png_set_expand_gray_1_2_4_to_8(m_png);
+		}
+		if (png_get_valid(m_png, m_info, PNG_INFO_tRNS))
+		{
+			png_set_tRNS_to_alpha(m_png);
+			has_alpha = true;
+		}
+		if (bit_depth == 16)
+		{
+			if (!options.keep_16bit)
+			{
+				png_set_scale_16(m_png);
+			}
+			else if (is_little_endian())
+			{
+				// PNG stores 16-bit samples as big-endian
+				png_set_swap(m_png);
+			}
+		}
+
+		if (options.channels != 0)
+		{
+			bool want_color = options.channels >= 3;
+			bool want_alpha = options.channels == 2 || options.channels == 4;
+			if (has_color && !want_color)
+			{
+				png_set_rgb_to_gray_fixed(m_png, 1, -1, -1);
+			}
+			if (!has_color && want_color)
+			{
+				png_set_gray_to_rgb(m_png);
+			}
+			if (has_alpha && !want_alpha)
+			{
+				png_set_strip_alpha(m_png);
+			}
+			if (!has_alpha && want_alpha)
+			{
+				png_set_add_alpha(m_png, 0xffff, PNG_FILLER_AFTER);
+			}
+		}
+
+		png_set_interlace_handling(m_png);
+		png_read_update_info(m_png, m_info);
+
+		m_width = png_get_image_width(m_png, m_info);
+		m_height = png_get_image_height(m_png, m_info);
+		m_channels = png_get_channels(m_png, m_info);
+		m_bit_depth = png_get_bit_depth(m_png, m_info);
+
+		if (png_get_rowbytes(m_png, m_info) != m_width * m_channels * (m_bit_depth / 8))
+		{
+			throw runtime_error("Error reading file PNG. Unexpected row size");
+		}
+	}
+
+	// Reads image to the buffer of size height x width x channels
+	void Decode(uint8_t* dst)
+	{
+		size_t row_stride = m_width * m_channels * (m_bit_depth / 8);
+		std::vector<png_bytep> rows(m_height);
+		for (size_t i = 0; i < m_height; ++i)
+		{
+			rows[i] = dst + i * row_stride;
+		}
+
+		if (setjmp(png_jmpbuf(m_png)))
+		{
+			throw runtime_error("Error reading file PNG. libpng has signaled an error: %s", m_error.c_str());
+		}
+		png_read_image(m_png, rows.data());
+		png_read_end(m_png, nullptr);
+	}
+
+	size_t width() const { return m_width; }
+	size_t height() const { return m_height; }
+	size_t channels() const { return m_channels; }
+	int bit_depth() const { return m_bit_depth; }
+
+private:
+	static bool is_little_endian()
+	{
+		uint16_t x = 1;
+		return *(uint8_t*)&x == 1;
+	}
+
+	static void read_fn(png_structp png, png_bytep out, png_size_t length)
+	{
+		auto* self = (PngDecoder*)png_get_io_ptr(png);
+		if (self->m_offset + length > self->m_size)
+		{
+			png_error(png, "Unexpected end of data");
+		}
+		memcpy(out, self->m_data + self->m_offset, length);
+		self->m_offset += length;
+	}
+
+	static void error_fn(png_structp png, png_const_charp message)
+	{
+		auto* self = (PngDecoder*)png_get_error_ptr(png);
+		self->m_error = message;
+		png_longjmp(png, 1);
+	}
+
+	static void warning_fn(png_structp, png_const_charp)
+	{
+	}
+
+	const uint8_t* m_data;
+	size_t m_size;
+	size_t m_offset;
+	png_structp m_png;
+	png_infop m_info;
+	std::string m_error;
+	size_t m_width;
+	size_t m_height;
+	size_t m_channels;
+	int m_bit_depth;
+};
+}
+
+
+py::object decode_png(const void* data, size_t size, const PngOptions& options)
+{
+	PngDecoder decoder(data, size);
+	{
+		py::gil_scoped_release release;
+		decoder.ReadHeader(options);
+	}
+
+	std::array<size_t, 3> shape = {decoder.height(), decoder.width(), decoder.channels()};
+	py::object result;
+	void* ptr = nullptr;
+	if (decoder.bit_depth() == 16)
+	{
+		ndarray_uint16 ar(shape);
+		ptr = ar.request().ptr;
+		result = ar;
+	}
+	else
+	{
+		ndarray_uint8 ar(shape);
+		ptr = ar.request().ptr;
+		result = ar;
+	}
+
+	{
+		py::gil_scoped_release release;
+		decoder.Decode((uint8_t*)ptr);
+	}
+	return result;
+}
+
+void decode_png_to(const void* data, size_t size, const PngOptions& options, const ImageAllocator& alloc)
+{
+	PngOptions options_8bit = options;
+	options_8bit.keep_16bit = false;
+	PngDecoder decoder(data, size);
+	decoder.ReadHeader(options_8bit);
+	decoder.Decode(alloc(decoder.height(), decoder.width(), (int)decoder.channels()));
+}
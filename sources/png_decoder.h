@@ -0,0 +1,34 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include "common.h"
+#include "image_transforms.h"
+
+struct PngOptions
+{
+	// Number of channels of the output: 1 - gray, 2 - gray + alpha, 3 - RGB, 4 - RGBA.
+	// Zero keeps channels as stored. In any case, palette is expanded to RGB and transparency chunk to alpha channel.
+	int channels = 0;
+	// If false, 16-bit images are scaled down to 8 bit
+	bool keep_16bit = true;
+};
+
+// Decodes PNG image directly to ndarray of shape [H, W, C]. Dtype is uint8, or uint16 for 16-bit images if
+// `keep_16bit` is set. GIL is released during decoding.
+py::object decode_png(const void* data, size_t size, const PngOptions& options = PngOptions());
+
+// Decodes PNG image to 8 bits per sample, 16-bit images are scaled down regardless of `keep_16bit`. Output memory is
+// requested from `alloc`. Does not require GIL.
+void decode_png_to(const void* data, size_t size, const PngOptions& options, const ImageAllocator& alloc);
@@ -0,0 +1,201 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include "record_readers.h"
+#include "record_index.h"
+#include "async_reader.h"
+#include "thread_pool.h"
+#include "common.h"
+#include <crc32c/crc32c.h>
+#include <vector>
+#include <string>
+#include <random>
+#include <string.h>
+#include <numeric>
+#include <algorithm>
+
+
+// Map-style dataset over several tfrecord files. Records are addressed by their global number, files are
+// concatenated in the given order. Uses index files, files that do not have one are indexed in memory on
+// construction. Records of a batch are read with many reads in flight, see AsyncReader.
+class HIDDEN RecordDataset
+{
+public:
+	RecordDataset(const RecordDataset&) = delete; // non construction-copyable
+	RecordDataset& operator=( const RecordDataset&) = delete; // non copyable
+
+	// If `use_io_uring` is false, records are read with positional reads even if io_uring is available
+	explicit RecordDataset(const std::vector<std::string>& filenames, bool use_io_uring = true):
+			m_reader(64, use_io_uring)
+	{
+		py::gil_scoped_release release;
+		for (const auto& filename: filenames)
+		{
+			m_shards.emplace_back(new Shard(filename));
+		}
+		ThreadPool::Default().ParallelFor(m_shards.size(), [this](size_t i)
+		{
+			Shard& shard = *m_shards[i];
+			RecordReader reader(shard.filename);
+			if (!reader.index())
+			{
+				reader.SetIndex(reader.BuildIndex());
+			}
+			shard.index = reader.index();
+			shard.fd = AsyncReader::Open(shard.filename);
+			if (shard.fd < 0)
+			{
+				throw runtime_error("Can't open file: %s", shard.filename.c_str());
+			}
+		});
+
+		m_starts.push_back(0);
+		for (const auto& shard: m_shards)
+		{
+			m_starts.push_back(m_starts.back() + shard->index->size());
+		}
+	}
+
+	size_t size() const { return m_starts.back(); }
+
+	bool uses_io_uring() const { return m_reader.uses_io_uring(); }
+
+	py::object GetItem(int64_t i)
+	{
+		py::list batch = GetBatch({i});
+		return batch[0];
+	}
+
+	// Reads records with the given numbers. Header and data of all records are read at once, with many reads in
+	// flight, then checksums are checked in parallel, by at most `threads` threads. Negative numbers count from the end.
+	py::list GetBatch(const std::vector<int64_t>& indices, int threads = 0)
+	{
+		// Sizes of all records are known from the index, so output bytes objects are allocated upfront, while GIL
+		// is held, and records are read directly into them
+		std::vector<Location> locations(indices.size());
+		std::vector<char*> buffers(indices.size());
+		py::list batch(indices.size());
+		for (size_t k = 0; k < indices.size(); ++k)
+		{
+			locations[k] = Locate(indices[k]);
+			PyBytesObject* bytesObject = nullptr;
+			buffers[k] = (char*)GetBytesAllocator(bytesObject)(locations[k].length);
+			batch[k] = py::reinterpret_steal<py::object>((PyObject*) bytesObject);
+		}
+
+		py::gil_scoped_release release;
+		std::vector<RecordHeader> headers(indices.size());
+		std::vector<AsyncReader::Request> requests(2 * indices.size());
+		for (size_t k = 0; k < indices.size(); ++k)
+		{
+			const Location& location = locations[k];
+			int fd = m_shards[location.shard]->fd;
+			// Data is read together with crc32, buffer has sizeof(uint32) padding
+			requests[2 * k] = {fd, location.offset, sizeof(RecordHeader), (uint8_t*)&headers[k], 0};
+			requests[2 * k + 1] = {fd, location.offset + sizeof(RecordHeader), location.length + sizeof(uint32_t), (uint8_t*)buffers[k], 0};
+		}
+		m_reader.Read(requests);
+
+		ThreadPool::Default().ParallelFor(indices.size(), [this, &locations, &buffers, &headers, &requests](size_t k)
+		{
+			const Location& location = locations[k];
+			const std::string& filename = m_shards[location.shard]->filename;
+			if (requests[2 * k].read != requests[2 * k].size || requests[2 * k + 1].read != requests[2 * k + 1].size)
+			{
+				throw runtime_error("Unexpected EOF. Corrupted record at offset %zd. Record file: %s", location.offset, filename.c_str());
+			}
+			const RecordHeader& header = headers[k];
+			if (Unmask(header.crc_of_length) != crc32c_value((const uint8_t*)&header.length, sizeof(header.length))
+			    || header.length != location.length)
+			{
+				throw runtime_error("Corrupted record, header does not match the index. Error reading record at offset %zd. Record file: %s", location.offset, filename.c_str());
+			}
+			auto* data = (uint8_t*)buffers[k];
+			uint32_t masked_crc;
+			memcpy(&masked_crc, data + location.length, sizeof(uint32_t));
+			memset(data + location.length, 0, sizeof(uint32_t));
+			if (Unmask(masked_crc) != crc32c_value(data, location.length))
+			{
+				throw runtime_error("Corrupted record, CRC32 didn't match. Error reading record at offset %zd. Record file: %s", location.offset, filename.c_str());
+			}
+		}, threads);
+		return batch;
+	}
+
+	// Returns a random permutation of all record numbers. Same `seed` and `epoch` always give the same permutation.
+	ndarray_int64 Permutation(uint64_t seed, int epoch) const
+	{
+		ndarray_int64 result(std::array<size_t, 1>({size()}));
+		int64_t* ptr = result.mutable_data();
+		{
+			py::gil_scoped_release release;
+			uint64_t hash = ((uint64_t)std::hash<size_t>{}(seed)) ^ ((uint64_t)std::hash<int>{}(epoch) << 1);
+			std::mt19937_64 rnd(hash);
+			std::iota(ptr, ptr + size(), 0);
+			std::shuffle(ptr, ptr + size(), rnd);
+		}
+		return result;
+	}
+
+private:
+	struct Shard
+	{
+		explicit Shard(std::string filename): filename(std::move(filename)), fd(-1)
+		{
+		}
+
+		~Shard()
+		{
+			if (fd >= 0)
+			{
+				AsyncReader::Close(fd);
+			}
+		}
+
+		std::string filename;
+		std::shared_ptr<RecordIndex> index;
+		int fd;
+	};
+
+	struct Location
+	{
+		size_t shard;
+		size_t record;
+		uint64_t offset;
+		size_t length;
+	};
+
+	Location Locate(int64_t i) const
+	{
+		int64_t n = size();
+		if (i < -n || i >= n)
+		{
+			throw py::index_error("Record number is out of range");
+		}
+		size_t global = i < 0 ? i + n : i;
+		size_t shard = std::upper_bound(m_starts.begin(), m_starts.end(), global) - m_starts.begin() - 1;
+		Location location;
+		location.shard = shard;
+		location.record = global - m_starts[shard];
+		const RecordIndex::Entry& entry = (*m_shards[shard]->index)[location.record];
+		location.offset = entry.offset;
+		location.length = entry.length;
+		return location;
+	}
+
+	std::vector<std::unique_ptr<Shard> > m_shards;
+	std::vector<size_t> m_starts;
+	AsyncReader m_reader;
+};
@@ -0,0 +1,195 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "record_index.h"
+#include "record_readers.h"
+#include "thread_pool.h"
+#include "common.h"
+#include <cstdio>
+#include <string.h>
+#include <atomic>
+#include <random>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+
+#pragma pack(push,1)
+struct RecordIndexHeader
+{
+	char magic[8];
+	uint64_t file_size;
+	uint64_t entries;
+};
+#pragma pack(pop)
+
+static const char kIndexMagic[8] = {'D', 'B', 'R', 'I', 'D', 'X', '0', '1'};
+
+// Size of record header (length and its crc) and of the crc of the payload
+static const uint64_t kRecordHeaderSize = sizeof(uint64_t) + sizeof(uint32_t);
+static const uint64_t kRecordFooterSize = sizeof(uint32_t);
+
+// Converts between native and little-endian byte order, which is the same conversion in both directions
+static uint64_t LittleEndian64(uint64_t x)
+{
+	uint8_t bytes[sizeof(uint64_t)];
+	memcpy(bytes, &x, sizeof(uint64_t));
+	uint64_t value = 0;
+	for (int i = sizeof(uint64_t) - 1; i >= 0; --i)
+	{
+		value = (value << 8) | bytes[i];
+	}
+	return value;
+}
+
+// Several processes may build index of the same file at once, e.g. all ranks of a job on a shared file system, so
+// each writer has its own temporary file
+static std::string TemporaryPath(const std::string& path)
+{
+	static std::atomic<uint32_t> counter(0);
+	std::random_device random;
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".tmp.%d.%u.%08x", (int)getpid(), (unsigned)counter++, (unsigned)random());
+	return path + suffix;
+}
+
+
+RecordIndex::RecordIndex(uint64_t file_size, std::vector<Entry> entries):
+		m_file_size(file_size), m_data_size(0), m_entries(std::move(entries))
+{
+	for (const auto& entry: m_entries)
+	{
+		m_data_size += entry.length;
+	}
+}
+
+std::shared_ptr<RecordIndex> RecordIndex::Load(const std::string& path, uint64_t file_size)
+{
+	FILE* f = std::fopen(path.c_str(), "rb");
+	if (!f)
+	{
+		return nullptr;
+	}
+	std::unique_ptr<FILE, int(*)(FILE*)> guard(f, std::fclose);
+
+	std::fseek(f, 0, SEEK_END);
+	long index_size = std::ftell(f);
+	std::fseek(f, 0, SEEK_SET);
+
+	RecordIndexHeader header;
+	if (std::fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0)
+	{
+		throw runtime_error("Corrupted index file: %s", path.c_str());
+	}
+	header.file_size = LittleEndian64(header.file_size);
+	header.entries = LittleEndian64(header.entries);
+	if (header.file_size != file_size)
+	{
+		return nullptr;
+	}
+
+	// Count is checked against the size of the index file before anything is allocated
+	if (index_size < 0 || header.entries != ((uint64_t)index_size - sizeof(header)) / sizeof(Entry))
+	{
+		throw runtime_error("Corrupted index file, %zd entries do not match the size of the file: %s", (size_t)header.entries, path.c_str());
+	}
+	std::vector<Entry> entries(header.entries);
+	if (std::fread(entries.data(), sizeof(Entry), entries.size(), f) != entries.size())
+	{
+		throw runtime_error("Corrupted index file, expected %zd entries: %s", (size_t)header.entries, path.c_str());
+	}
+
+	// Records must follow one another and fit in the tfrecord file, so that reading them never goes out of bounds
+	uint64_t end = 0;
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		Entry& entry = entries[i];
+		entry.offset = LittleEndian64(entry.offset);
+		entry.length = LittleEndian64(entry.length);
+		bool valid = entry.offset >= end && entry.offset <= file_size &&
+				entry.length <= file_size - entry.offset &&
+				kRecordHeaderSize + entry.length + kRecordFooterSize <= file_size - entry.offset;
+		if (!valid)
+		{
+			throw runtime_error("Corrupted index file, entry %zd (offset %zd, length %zd) is out of bounds of the record file of size %zd: %s",
+			                    i, (size_t)entry.offset, (size_t)entry.length, (size_t)file_size, path.c_str());
+		}
+		end = entry.offset + kRecordHeaderSize + entry.length + kRecordFooterSize;
+	}
+	return std::make_shared<RecordIndex>(file_size, std::move(entries));
+}
+
+void RecordIndex::Save(const std::string& path) const
+{
+	std::string tmp_path = TemporaryPath(path);
+	FILE* f = std::fopen(tmp_path.c_str(), "wb");
+	if (!f)
+	{
+		throw runtime_error("Can't open file for writing: %s", tmp_path.c_str());
+	}
+
+	RecordIndexHeader header;
+	memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+	header.file_size = LittleEndian64(m_file_size);
+	header.entries = LittleEndian64(m_entries.size());
+
+	std::vector<Entry> entries(m_entries);
+	for (auto& entry: entries)
+	{
+		entry.offset = LittleEndian64(entry.offset);
+		entry.length = LittleEndian64(entry.length);
+	}
+
+	bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && std::fwrite(entries.data(), sizeof(Entry), entries.size(), f) == entries.size();
+	ok = (std::fclose(f) == 0) && ok;
+	if (ok && std::rename(tmp_path.c_str(), path.c_str()) == 0)
+	{
+		return;
+	}
+	std::remove(tmp_path.c_str());
+	if (ok)
+	{
+		// Rename may fail if another writer has just put its index in place (e.g. on Windows), which is as good
+		try
+		{
+			auto index = Load(path, m_file_size);
+			if (index && index->size() == size())
+			{
+				return;
+			}
+		}
+		catch (const std::exception&)
+		{
+		}
+	}
+	throw runtime_error("Error writing index file: %s", path.c_str());
+}
+
+void build_record_indices(const std::vector<std::string>& filenames, bool overwrite, int threads)
+{
+	ThreadPool::Default().ParallelFor(filenames.size(), [&filenames, overwrite](size_t i)
+	{
+		const std::string& filename = filenames[i];
+		RecordReader reader(filename, !overwrite);
+		if (reader.index())
+		{
+			return;
+		}
+		reader.BuildIndex()->Save(RecordIndex::PathFor(filename));
+	}, threads);
+}
@@ -0,0 +1,66 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <inttypes.h>
+#include <memory>
+#include <vector>
+#include <string>
+#include "common.h"
+
+
+// Offsets and lengths of all records of a tfrecord file. Is stored next to the tfrecord file, in a sidecar file with
+// `.idx` suffix, e.g. `data.tfrecord.idx`. Index file starts with a header (magic, size of the tfrecord file, number of
+// entries), followed by entries. All values are little-endian uint64.
+class HIDDEN RecordIndex
+{
+public:
+	struct Entry
+	{
+		// Offset of the record header
+		uint64_t offset;
+		// Length of the record payload
+		uint64_t length;
+	};
+
+	RecordIndex(uint64_t file_size, std::vector<Entry> entries);
+
+	static std::string PathFor(const std::string& record_file) { return record_file + ".idx"; }
+
+	// Loads index from `path`. Returns nullptr if there is no such file, or if it was built for a file of size other
+	// than `file_size`, which means that the tfrecord was rewritten. Throws if the index file is corrupted.
+	static std::shared_ptr<RecordIndex> Load(const std::string& path, uint64_t file_size);
+
+	// Writes index to a temporary file and renames it to `path`, so that readers never see a partially written index.
+	// Concurrent writers of the same index do not interfere, each uses its own temporary file.
+	void Save(const std::string& path) const;
+
+	size_t size() const { return m_entries.size(); }
+
+	const Entry& operator[](size_t i) const { return m_entries[i]; }
+
+	uint64_t file_size() const { return m_file_size; }
+
+	uint64_t data_size() const { return m_data_size; }
+
+private:
+	uint64_t m_file_size;
+	uint64_t m_data_size;
+	std::vector<Entry> m_entries;
+};
+
+// Builds and saves index files for the given tfrecord files. Files are processed in parallel, by at most `threads`
+// threads (all threads of the default pool if `threads` < 1). Files that already have an up to date index are
+// skipped, unless `overwrite` is set. Does not require GIL.
+void build_record_indices(const std::vector<std::string>& filenames, bool overwrite, int threads);
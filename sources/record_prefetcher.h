@@ -0,0 +1,717 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include "record_readers.h"
+#include "record_index.h"
+#include "thread_pool.h"
+#include "common.h"
+#include <vector>
+#include <deque>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <condition_variable>
+
+
+// Part of a tfrecord file, `count` records starting at `offset`. By default, the whole file.
+struct RecordRange
+{
+	std::string filename;
+	uint64_t offset = 0;
+	size_t count = SIZE_MAX;
+};
+
+
+inline std::vector<RecordRange> whole_record_files(const std::vector<std::string>& filenames)
+{
+	std::vector<RecordRange> ranges(filenames.size());
+	for (size_t i = 0; i < filenames.size(); ++i)
+	{
+		ranges[i].filename = filenames[i];
+	}
+	return ranges;
+}
+
+
+// Splits files between `num_shards` shards and returns the part of shard `shard_index`. If there are at least as
+// many files as shards, each shard gets a contiguous block of files, blocks are balanced by size of the files and have
+// at least one file. Only sizes of the files are needed, so this works for compressed files as well. Otherwise, records
+// are split into equal contiguous ranges, which requires index files, see build_record_indices, and uncompressed
+// files. Result depends only on the order of `filenames`, so shards are disjoint as long as all of them get the same
+// order.
+HIDDEN inline std::vector<RecordRange> shard_record_files(const std::vector<std::string>& filenames, int shard_index, int num_shards)
+{
+	if (num_shards < 1 || shard_index < 0 || shard_index >= num_shards)
+	{
+		throw runtime_error("Invalid shard %d of %d shards", shard_index, num_shards);
+	}
+	if (num_shards == 1)
+	{
+		return whole_record_files(filenames);
+	}
+
+	std::vector<RecordRange> ranges;
+	if (filenames.size() >= (size_t)num_shards)
+	{
+		std::vector<uint64_t> sizes(filenames.size());
+		ThreadPool::Default().ParallelFor(filenames.size(), [&filenames, &sizes](size_t i)
+		{
+			fsal::FileSystem fs;
+			fsal::File file = fs.Open(filenames[i]);
+			if (!file)
+			{
+				throw runtime_error("Can't find file: %s", filenames[i].c_str());
+			}
+			sizes[i] = file.GetSize();
+		});
+		std::vector<uint64_t> prefix(filenames.size() + 1, 0);
+		for (size_t i = 0; i < filenames.size(); ++i)
+		{
+			prefix[i + 1] = prefix[i] + sizes[i];
+		}
+
+		// Block k ends at the file boundary that is closest to k / num_shards of the total size, while leaving at
+		// least one file for each block
+		auto boundary = [&prefix, num_shards](size_t k, size_t previous)
+		{
+			size_t files = prefix.size() - 1;
+			if (k == (size_t)num_shards)
+			{
+				return files;
+			}
+			double target = (double)prefix.back() * k / num_shards;
+			size_t j = std::lower_bound(prefix.begin(), prefix.end(), target) - prefix.begin();
+			if (j > 0 && target - prefix[j - 1] < prefix[j] - target)
+			{
+				--j;
+			}
+			j = std::max(j, previous + 1);
+			return std::min(j, files - (num_shards - k));
+		};
+		size_t begin = 0;
+		for (int k = 1; k <= shard_index; ++k)
+		{
+			begin = boundary(k, begin);
+		}
+		size_t end = boundary(shard_index + 1, begin);
+		for (size_t i = begin; i < end; ++i)
+		{
+			ranges.emplace_back();
+			ranges.back().filename = filenames[i];
+		}
+		return ranges;
+	}
+
+	std::vector<std::shared_ptr<RecordIndex> > indices(filenames.size());
+	ThreadPool::Default().ParallelFor(filenames.size(), [&filenames, &indices, num_shards](size_t i)
+	{
+		RecordReader reader(filenames[i]);
+		if (reader.compression() != RecordReader::Compression::NONE)
+		{
+			throw runtime_error("There are fewer files than shards (%d), so records of the files are split between shards, "
+			                    "which is not possible for compressed files. Record file: %s", num_shards, filenames[i].c_str());
+		}
+		if (!reader.index())
+		{
+			throw runtime_error("There are fewer files than shards (%d), so records of the files are split between shards, "
+			                    "which requires index files. Create them with build_record_indices. Record file: %s",
+			                    num_shards, filenames[i].c_str());
+		}
+		indices[i] = reader.index();
+	});
+
+	size_t total = 0;
+	for (const auto& index: indices)
+	{
+		total += index->size();
+	}
+	const size_t begin = total * shard_index / num_shards;
+	const size_t end = total * (shard_index + 1) / num_shards;
+
+	size_t file_begin = 0;
+	for (size_t i = 0; i < filenames.size(); ++i)
+	{
+		const RecordIndex& index = *indices[i];
+		size_t file_end = file_begin + index.size();
+		size_t first = std::max(begin, file_begin);
+		size_t last = std::min(end, file_end);
+		if (first < last)
+		{
+			RecordRange range;
+			range.filename = filenames[i];
+			range.offset = index[first - file_begin].offset;
+			range.count = last - first;
+			ranges.push_back(std::move(range));
+		}
+		file_begin = file_end;
+	}
+	return ranges;
+}
+
+
+// Interleaving of files, same as `tf.data.Dataset.interleave` does
+struct InterleaveOptions
+{
+	explicit InterleaveOptions(int cycle_length = 1, int block_length = 1, bool deterministic = true):
+			cycle_length(cycle_length), block_length(block_length), deterministic(deterministic)
+	{
+	}
+
+	// Number of files that are read at once, each on its own thread. Values less than 2 disable interleaving
+	int cycle_length;
+	// Number of consecutive records that are taken from a file, before switching to the next one
+	int block_length;
+	// If false, records are taken from any file that has them ready, instead of strict round-robin order
+	bool deterministic;
+};
+
+
+class InterleavedRecordIterator;
+
+
+// Iterates over records of several tfrecord files one after another, or interleaves several files at once.
+// Does not touch python objects, so can be used without GIL being held.
+class HIDDEN RecordFileIterator
+{
+public:
+	RecordFileIterator(const RecordFileIterator&) = delete; // non construction-copyable
+	RecordFileIterator& operator=( const RecordFileIterator&) = delete; // non copyable
+
+	explicit RecordFileIterator(std::vector<RecordRange> ranges, InterleaveOptions interleave = InterleaveOptions()):
+			m_interleave(interleave), m_current_file(0), m_remaining(0)
+	{
+		Reset(std::move(ranges));
+	}
+
+	explicit RecordFileIterator(const std::vector<std::string>& filenames): RecordFileIterator(whole_record_files(filenames))
+	{
+	}
+
+	~RecordFileIterator();
+
+	// Starts over with the given ranges
+	void Reset(std::vector<RecordRange> ranges);
+
+	// Returns ranges that were not read yet. Iterator over them continues from the current position.
+	// Is not supported when files are interleaved.
+	std::vector<RecordRange> Remaining() const
+	{
+		if (m_interleaved)
+		{
+			throw runtime_error("State of reading is not available when files are interleaved");
+		}
+		std::vector<RecordRange> ranges(m_ranges.begin() + std::min(m_current_file, m_ranges.size()), m_ranges.end());
+		if (m_rr && !ranges.empty())
+		{
+			ranges[0].offset = m_rr->offset();
+			ranges[0].count = m_remaining;
+		}
+		return ranges;
+	}
+
+	// Reads next record into memory returned by `alloc_func`. Returns false when all files were read.
+	bool Next(const std::function<void*(size_t size)>& alloc_func);
+
+private:
+	InterleaveOptions m_interleave;
+	std::unique_ptr<InterleavedRecordIterator> m_interleaved;
+	std::vector<RecordRange> m_ranges;
+	std::unique_ptr<RecordReader> m_rr;
+	size_t m_current_file;
+	size_t m_remaining;
+};
+
+
+// Reads `cycle_length` files at once, each on its own thread, which read records ahead into their queues.
+// In deterministic mode, `block_length` consecutive records are taken from each file in turn. Files that end are
+// replaced by the next ones, so the order does not depend on timing. Otherwise, records are taken from any file that
+// has them ready, so a slow file does not stall the others.
+class HIDDEN InterleavedRecordIterator
+{
+public:
+	InterleavedRecordIterator(const InterleavedRecordIterator&) = delete; // non construction-copyable
+	InterleavedRecordIterator& operator=( const InterleavedRecordIterator&) = delete; // non copyable
+
+	InterleavedRecordIterator(std::vector<RecordRange> ranges, const InterleaveOptions& options):
+			m_ranges(std::move(ranges)), m_next_range(0), m_current(0), m_block_length(std::max(options.block_length, 1)),
+			m_deterministic(options.deterministic), m_stop(false)
+	{
+		if (options.cycle_length < 1)
+		{
+			throw runtime_error("Cycle length must be positive, got %d", options.cycle_length);
+		}
+		// Records are read ahead by two blocks
+		m_depth = std::max(2 * m_block_length, 16);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (int i = 0; i < options.cycle_length; ++i)
+		{
+			m_slots.emplace_back(new Slot());
+			Open(*m_slots.back());
+		}
+	}
+
+	~InterleavedRecordIterator()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_not_full.notify_all();
+		for (auto& slot: m_slots)
+		{
+			if (slot->thread.joinable())
+			{
+				slot->thread.join();
+			}
+		}
+	}
+
+	bool Next(const std::function<void*(size_t size)>& alloc_func)
+	{
+		std::string record;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (!Take(lock, record))
+			{
+				return false;
+			}
+		}
+		m_not_full.notify_all();
+		auto* data = (char*)alloc_func(record.size());
+		memcpy(data, record.data(), record.size());
+		return true;
+	}
+
+private:
+	struct Slot
+	{
+		std::thread thread;
+		std::deque<std::string> queue;
+		// File is open in this slot
+		bool active = false;
+		// All records of the file were put to the queue
+		bool done = false;
+		int taken = 0;
+	};
+
+	// Starts reading of the next file in the slot, or marks it inactive if there are no more files. Thread of the
+	// slot is done at this point, so it can be joined while the lock is held.
+	void Open(Slot& slot)
+	{
+		if (slot.thread.joinable())
+		{
+			slot.thread.join();
+		}
+		slot.queue.clear();
+		slot.done = false;
+		slot.taken = 0;
+		slot.active = m_next_range < m_ranges.size();
+		if (slot.active)
+		{
+			slot.thread = std::thread(&InterleavedRecordIterator::Run, this, &slot, m_ranges[m_next_range++]);
+		}
+	}
+
+	// Takes a record from the queue of the slot, the cycle moves on after `block_length` records
+	void Pop(size_t index, std::string& record)
+	{
+		Slot& slot = *m_slots[index];
+		record = std::move(slot.queue.front());
+		slot.queue.pop_front();
+		m_current = index;
+		if (++slot.taken == m_block_length)
+		{
+			slot.taken = 0;
+			m_current = (index + 1) % m_slots.size();
+		}
+	}
+
+	bool Take(std::unique_lock<std::mutex>& lock, std::string& record)
+	{
+		while (true)
+		{
+			if (m_error)
+			{
+				std::rethrow_exception(m_error);
+			}
+			if (std::none_of(m_slots.begin(), m_slots.end(), [](const std::unique_ptr<Slot>& slot) { return slot->active; }))
+			{
+				return false;
+			}
+
+			if (m_deterministic)
+			{
+				Slot& slot = *m_slots[m_current];
+				if (!slot.active)
+				{
+					m_current = (m_current + 1) % m_slots.size();
+				}
+				else if (!slot.queue.empty())
+				{
+					Pop(m_current, record);
+					return true;
+				}
+				else if (slot.done)
+				{
+					// File ended, next file takes its place and the cycle moves on
+					Open(slot);
+					m_current = (m_current + 1) % m_slots.size();
+				}
+				else
+				{
+					m_not_empty.wait(lock);
+				}
+				continue;
+			}
+
+			// Otherwise, first slot that has a record ready is taken, starting from the current one
+			bool reopened = false;
+			for (size_t k = 0; k < m_slots.size(); ++k)
+			{
+				size_t index = (m_current + k) % m_slots.size();
+				Slot& slot = *m_slots[index];
+				if (slot.active && !slot.queue.empty())
+				{
+					Pop(index, record);
+					return true;
+				}
+				if (slot.active && slot.done)
+				{
+					Open(slot);
+					reopened = true;
+				}
+			}
+			if (!reopened)
+			{
+				m_not_empty.wait(lock);
+			}
+		}
+	}
+
+	void Run(Slot* slot, RecordRange range)
+	{
+		try
+		{
+			RecordFileIterator files(std::vector<RecordRange>({std::move(range)}));
+			while (true)
+			{
+				std::string str;
+				auto alloc = [&str](size_t size)
+				{
+					str.resize(size + sizeof(uint32_t));
+					return &str[0];
+				};
+				if (!files.Next(alloc))
+				{
+					break;
+				}
+				str.resize(str.size() - sizeof(uint32_t));
+
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_not_full.wait(lock, [this, slot]{ return slot->queue.size() < m_depth || m_stop; });
+				if (m_stop)
+				{
+					return;
+				}
+				slot->queue.push_back(std::move(str));
+				lock.unlock();
+				m_not_empty.notify_all();
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!m_error)
+			{
+				m_error = std::current_exception();
+			}
+		}
+		// Must be the last access to the slot and the lock, see Open
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			slot->done = true;
+		}
+		m_not_empty.notify_all();
+	}
+
+	std::vector<RecordRange> m_ranges;
+	size_t m_next_range;
+	std::vector<std::unique_ptr<Slot> > m_slots;
+	size_t m_current;
+	int m_block_length;
+	bool m_deterministic;
+	size_t m_depth;
+
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty;
+	std::condition_variable m_not_full;
+	bool m_stop;
+	std::exception_ptr m_error;
+};
+
+
+inline RecordFileIterator::~RecordFileIterator() = default;
+
+inline void RecordFileIterator::Reset(std::vector<RecordRange> ranges)
+{
+	m_rr.reset();
+	m_interleaved.reset();
+	m_current_file = 0;
+	m_remaining = 0;
+	if (m_interleave.cycle_length > 1)
+	{
+		m_interleaved.reset(new InterleavedRecordIterator(std::move(ranges), m_interleave));
+		m_ranges.clear();
+	}
+	else
+	{
+		m_ranges = std::move(ranges);
+	}
+}
+
+inline bool RecordFileIterator::Next(const std::function<void*(size_t size)>& alloc_func)
+{
+	if (m_interleaved)
+	{
+		return m_interleaved->Next(alloc_func);
+	}
+	while (m_current_file < m_ranges.size())
+	{
+		const RecordRange& range = m_ranges[m_current_file];
+		if (!m_rr)
+		{
+			// Reading is sequential from the start of the range, index is not needed
+			m_rr.reset(new RecordReader(range.filename, false, false, RecordReader::Compression::AUTO,
+			                             RecordReader::kDefaultBufferSize));
+			m_rr->SetOffset(range.offset);
+			m_remaining = range.count;
+		}
+
+		if (m_remaining > 0)
+		{
+			auto status = m_rr->GetNext(alloc_func);
+			if (status.ok() && !status.is_eof())
+			{
+				--m_remaining;
+				return true;
+			}
+			if (!status.is_eof())
+			{
+				throw runtime_error("Error while iterating RecordReader at offset: %zd", m_rr->offset());
+			}
+		}
+		m_rr.reset();
+		++m_current_file;
+	}
+	return false;
+}
+
+
+// Buffer that approximates shuffling of a stream. Each new value is swapped with a random element of the buffer,
+// values are taken from the back.
+template<typename T>
+class HIDDEN ShuffleBuffer
+{
+public:
+	ShuffleBuffer(size_t capacity, std::mt19937_64 rnd, std::vector<T> items = std::vector<T>()):
+			m_capacity(capacity), m_rnd(rnd), m_buffer(std::move(items))
+	{
+	}
+
+	const std::mt19937_64& rnd() const { return m_rnd; }
+
+	const std::vector<T>& items() const { return m_buffer; }
+
+	bool full() const { return m_buffer.size() >= m_capacity; }
+
+	bool empty() const { return m_buffer.empty(); }
+
+	void Push(T&& value)
+	{
+		auto index = m_rnd() % (m_buffer.size() + 1);
+		if (index == m_buffer.size())
+		{
+			m_buffer.push_back(std::move(value));
+		}
+		else
+		{
+			m_buffer.push_back(std::move(m_buffer[index]));
+			m_buffer[index] = std::move(value);
+		}
+	}
+
+	T Pop()
+	{
+		T value = std::move(m_buffer.back());
+		m_buffer.pop_back();
+		return value;
+	}
+
+private:
+	size_t m_capacity;
+	std::mt19937_64 m_rnd;
+	std::vector<T> m_buffer;
+};
+
+
+// Reads and shuffles records on a background thread. Output is the same sequence that a shuffle buffer filled
+// on the caller's thread would produce, but disk reads and crc checks happen ahead of time, in native memory.
+// At most `depth` shuffled records are kept ready in the queue. Reading can be resumed from a state returned by
+// GetState.
+class HIDDEN RecordPrefetcher
+{
+public:
+	RecordPrefetcher(const RecordPrefetcher&) = delete; // non construction-copyable
+	RecordPrefetcher& operator=( const RecordPrefetcher&) = delete; // non copyable
+
+	// `buffer` is initial content of the shuffle buffer, `ready` are records that are returned first
+	RecordPrefetcher(std::vector<RecordRange> ranges, int buffsize, std::mt19937_64 rnd, int depth,
+	                 InterleaveOptions interleave = InterleaveOptions(),
+	                 std::vector<std::string> buffer = std::vector<std::string>(),
+	                 std::deque<std::string> ready = std::deque<std::string>()):
+			m_files(std::move(ranges), interleave), m_buffer(buffsize, rnd, std::move(buffer)), m_depth(depth),
+			m_queue(std::move(ready)), m_done(false), m_stop(false)
+	{
+		if (depth < 1)
+		{
+			throw runtime_error("Prefetch depth must be positive, got %d", depth);
+		}
+		m_thread = std::thread(&RecordPrefetcher::Run, this);
+	}
+
+	~RecordPrefetcher()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_not_full.notify_all();
+		m_thread.join();
+	}
+
+	// Blocks until a record is available. Returns false when all records were consumed.
+	// Exceptions thrown on the producer thread are rethrown here. Must be called without GIL being held.
+	bool Pop(std::string& record)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_not_empty.wait(lock, [this]{ return !m_queue.empty() || m_done; });
+		if (m_queue.empty())
+		{
+			if (m_error)
+			{
+				std::rethrow_exception(m_error);
+			}
+			return false;
+		}
+		record = std::move(m_queue.front());
+		m_queue.pop_front();
+		lock.unlock();
+		m_not_full.notify_one();
+		return true;
+	}
+
+	// Returns position of reading: remaining parts of files, state of the shuffle buffer and records that are ready,
+	// but were not popped yet. Must be called without GIL being held.
+	void GetState(std::vector<RecordRange>& ranges, std::mt19937_64& rnd, std::vector<std::string>& buffer,
+	              std::deque<std::string>& ready)
+	{
+		std::lock_guard<std::mutex> state_lock(m_state_mutex);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		ranges = m_files.Remaining();
+		rnd = m_buffer.rnd();
+		buffer = m_buffer.items();
+		ready = m_queue;
+	}
+
+private:
+	void Run()
+	{
+		try
+		{
+			while (true)
+			{
+				while (true)
+				{
+					// Reading of a record and pushing it to the buffer is atomic for GetState
+					std::lock_guard<std::mutex> state_lock(m_state_mutex);
+					if (m_buffer.full())
+					{
+						break;
+					}
+					std::string str;
+					auto alloc = [&str](size_t size)
+					{
+						str.resize(size + sizeof(uint32_t));
+						return &str[0];
+					};
+					if (!m_files.Next(alloc))
+					{
+						break;
+					}
+					str.resize(str.size() - sizeof(uint32_t));
+					m_buffer.Push(std::move(str));
+				}
+				if (m_buffer.empty())
+				{
+					break;
+				}
+
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_not_full.wait(lock, [this]{ return m_queue.size() < m_depth || m_stop; });
+				if (m_stop)
+				{
+					return;
+				}
+				lock.unlock();
+				{
+					// Only this thread adds to the queue, so there is still space
+					std::lock_guard<std::mutex> state_lock(m_state_mutex);
+					lock.lock();
+					m_queue.push_back(m_buffer.Pop());
+					lock.unlock();
+				}
+				m_not_empty.notify_one();
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_error = std::current_exception();
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done = true;
+		}
+		m_not_empty.notify_all();
+	}
+
+	RecordFileIterator m_files;
+	ShuffleBuffer<std::string> m_buffer;
+	size_t m_depth;
+
+	std::deque<std::string> m_queue;
+	// Guards state of m_files and m_buffer for GetState, is always locked before m_mutex
+	std::mutex m_state_mutex;
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty;
+	std::condition_variable m_not_full;
+	bool m_done;
+	bool m_stop;
+	std::exception_ptr m_error;
+	std::thread m_thread;
+};
@@ -15,37 +15,230 @@
 #include "record_readers.h"
 #include <crc32c/crc32c.h>
 #include <limits.h>
+#include <string.h>
 #include <cassert>
+#include <algorithm>
 #include "common.h"
+#include "zlib_stream.h"
+#include "lz4_stream.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
-static const uint32_t kMaskDelta = 0xa282ead8ul;
+// Read-ahead blocks start at offsets that are multiple of this
+static const size_t kBufferAlignment = 4096;
 
-inline uint32_t Mask(uint32_t crc)
+MappedFile::MappedFile(const std::string& path): m_data(nullptr), m_size(0)
 {
-	return ((crc >> 15) | (crc << 17)) + kMaskDelta;
+#ifndef _WIN32
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		throw runtime_error("Can't map file, can't open it: %s", path.c_str());
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw runtime_error("Can't map file, can't get its size: %s", path.c_str());
+	}
+	m_size = st.st_size;
+	if (m_size > 0)
+	{
+		void* ptr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr == MAP_FAILED)
+		{
+			close(fd);
+			throw runtime_error("Can't map file: %s", path.c_str());
+		}
+		// Records are mostly read front to back, this makes kernel read ahead more aggressively
+		madvise(ptr, m_size, MADV_SEQUENTIAL);
+		m_data = (const uint8_t*)ptr;
+	}
+	// Mapping stays valid after the descriptor is closed
+	close(fd);
+#else
+	throw runtime_error("Memory mapping of files is not supported on this platform");
+#endif
 }
 
-inline uint32_t Unmask(uint32_t masked_crc)
+MappedFile::~MappedFile()
 {
-	uint32_t rot = masked_crc - kMaskDelta;
-	return ((rot >> 17) | (rot << 15));
+#ifndef _WIN32
+	if (m_data != nullptr)
+	{
+		munmap((void*)m_data, m_size);
+	}
+#endif
 }
 
-RecordReader::RecordReader(fsal::File file): m_offset(0), m_file(std::move(file))
+RecordReader::RecordReader(fsal::File file, Compression compression, size_t buffer_size):
+		m_offset(0), m_file(std::move(file)), m_buffer_offset(0), m_buffer_filled(0), m_buffer_status(true)
 {
-	// Does not handle compression yet
 	if (!m_file)
 		throw runtime_error("Can't create RecordReader. Given file is None");
+	InitCompression(compression);
+	InitBuffer(buffer_size);
 }
 
-RecordReader::RecordReader(const std::string& file): m_offset(0)
+RecordReader::RecordReader(const std::string& file, bool load_index, bool use_mmap, Compression compression, size_t buffer_size):
+		m_offset(0), m_buffer_offset(0), m_buffer_filled(0), m_buffer_status(true)
 {
 	fsal::FileSystem fs;
 	m_file = fs.Open(file);
 	if (!m_file)
 		throw runtime_error("Can't create RecordReader. Can't find file: %s", file.c_str());
-	// Does not handle compression yet
+	InitCompression(compression);
+	if (m_stream)
+	{
+		if (use_mmap)
+		{
+			throw runtime_error("Memory mapping is not supported for compressed files. Record file: %s", file.c_str());
+		}
+		return;
+	}
+	InitBuffer(buffer_size);
+	if (load_index)
+	{
+		m_index = RecordIndex::Load(RecordIndex::PathFor(file), m_file.GetSize());
+	}
+	if (use_mmap)
+	{
+		m_mapping = std::make_shared<MappedFile>(file);
+	}
+}
+
+void RecordReader::InitCompression(Compression compression)
+{
+	if (compression == Compression::AUTO)
+	{
+		// Uncompressed files start with a record header, that has valid crc. Otherwise, gzip, zlib and LZ4 frame
+		// headers are recognized by their magic bytes
+		compression = Compression::NONE;
+		uint8_t head[sizeof(RecordHeader)] = { 0 };
+		size_t result = 0;
+		m_file.Read(head, sizeof(head), &result);
+		m_file.Seek(0);
+		if (result == sizeof(RecordHeader))
+		{
+			RecordHeader header;
+			memcpy(&header, head, sizeof(RecordHeader));
+			bool valid_header = Unmask(header.crc_of_length) == crc32c_value((const uint8_t*)&header.length, sizeof(header.length));
+			if (!valid_header && head[0] == 0x1f && head[1] == 0x8b)
+			{
+				compression = Compression::GZIP;
+			}
+			else if (!valid_header && (head[0] & 0x0f) == Z_DEFLATED && ((head[0] << 8) | head[1]) % 31 == 0)
+			{
+				compression = Compression::ZLIB;
+			}
+			else if (!valid_header && head[0] == 0x04 && head[1] == 0x22 && head[2] == 0x4d && head[3] == 0x18)
+			{
+				compression = Compression::LZ4;
+			}
+		}
+	}
+	m_compression = compression;
+
+	switch (compression)
+	{
+		case Compression::ZLIB:
+			m_stream.reset(new ZlibInputStream(&m_file, ZlibInputStream::Format::ZLIB));
+			break;
+		case Compression::GZIP:
+			m_stream.reset(new ZlibInputStream(&m_file, ZlibInputStream::Format::GZIP));
+			break;
+		case Compression::LZ4:
+			m_stream.reset(new Lz4InputStream(&m_file));
+			break;
+		default:
+			break;
+	}
+}
+
+void RecordReader::InitBuffer(size_t buffer_size)
+{
+	// Compressed streams do their own buffering
+	if (buffer_size == 0 || m_stream)
+	{
+		return;
+	}
+	if (buffer_size < 2 * kBufferAlignment)
+	{
+		throw runtime_error("Read buffer size must be at least %zd bytes, got %zd. Record file: %s", 2 * kBufferAlignment, buffer_size, m_file.GetPath().c_str());
+	}
+	m_buffer.resize(buffer_size);
+}
+
+void RecordReader::Seek(uint64_t offset)
+{
+	if (m_stream)
+	{
+		if (offset < m_stream->Tell())
+		{
+			throw runtime_error("Compressed files can only be read sequentially, can't read record at offset %zd. Record file: %s", offset, m_file.GetPath().c_str());
+		}
+		// Skipping forward is done by decompressing, it is used to resume reading from a saved offset
+		std::vector<uint8_t> scratch;
+		while (offset > m_stream->Tell())
+		{
+			scratch.resize(std::min<uint64_t>(offset - m_stream->Tell(), 64 * 1024));
+			size_t read = 0;
+			m_stream->Read(scratch.data(), scratch.size(), &read);
+			if (read != scratch.size())
+			{
+				throw runtime_error("Unexpected EOF, can't skip to offset %zd. Record file: %s", offset, m_file.GetPath().c_str());
+			}
+		}
+		return;
+	}
+	if (!m_buffer.empty())
+	{
+		// Buffered reads are positioned by offset
+		return;
+	}
+	m_file.Seek(offset);
+}
+
+fsal::Status RecordReader::ReadBuffered(uint64_t offset, uint8_t* dst, size_t size, size_t* read)
+{
+	// Block starts at aligned offset, so the data may begin up to kBufferAlignment bytes into the block
+	if (size > m_buffer.size() - kBufferAlignment)
+	{
+		m_file.Seek(offset);
+		return m_file.Read(dst, size, read);
+	}
+
+	if (offset < m_buffer_offset || offset + size > m_buffer_offset + m_buffer_filled)
+	{
+		uint64_t start = offset - offset % kBufferAlignment;
+		m_file.Seek(start);
+		size_t filled = 0;
+		fsal::Status status = m_file.Read(m_buffer.data(), m_buffer.size(), &filled);
+		if (!status.ok() && !status.is_eof())
+		{
+			m_buffer_filled = 0;
+			return status;
+		}
+		m_buffer_offset = start;
+		m_buffer_filled = filled;
+		m_buffer_status = status;
+	}
+
+	const uint64_t buffer_end = m_buffer_offset + m_buffer_filled;
+	size_t available = offset < buffer_end ? (size_t)std::min<uint64_t>(size, buffer_end - offset) : 0;
+	memcpy(dst, m_buffer.data() + (offset - m_buffer_offset), available);
+	*read = available;
+	if (available == size)
+	{
+		return true;
+	}
+	// Block was read up to the end of the file
+	return m_buffer_status;
 }
 
 fsal::Status RecordReader::ReadChecksummed(uint64_t offset, size_t size, uint8_t* dst)
@@ -58,7 +251,19 @@ fsal::Status RecordReader::ReadChecksummed(uint64_t offset, size_t size, uint8_t
 	const size_t expected = size + sizeof(uint32_t);    // reading data together with crc32.
 	                                                    // Preallocated buffer has sizeof(uint32) padding
 	size_t result = 0;
-	auto read_result = m_file.Read(dst, expected, &result);
+	fsal::Status read_result = true;
+	if (m_stream)
+	{
+		read_result = m_stream->Read(dst, expected, &result);
+	}
+	else if (!m_buffer.empty())
+	{
+		read_result = ReadBuffered(offset, dst, expected, &result);
+	}
+	else
+	{
+		read_result = m_file.Read(dst, expected, &result);
+	}
 
 	if (!read_result.ok() || read_result.is_eof())
 	{
@@ -82,7 +287,7 @@ fsal::Status RecordReader::ReadChecksummed(uint64_t offset, size_t size, uint8_t
 
 fsal::Status RecordReader::ReadRecord(uint64_t& offset, fsal::MemRefFile* mem_file)
 {
-	m_file.Seek(offset);
+	Seek(offset);
 
 	RecordHeader header = { 0 };
 	fsal::Status r = ReadChecksummed(offset, sizeof(RecordHeader::length), (uint8_t*)&header);
@@ -95,13 +300,13 @@ fsal::Status RecordReader::ReadRecord(uint64_t& offset, fsal::MemRefFile* mem_fi
 	ReadChecksummed(offset + sizeof(RecordHeader), header.length, mem_file->GetDataPointer());
 
 	offset += sizeof(RecordHeader) + header.length + sizeof(uint32_t);
-	assert(offset == m_file.Tell());
+	assert(m_stream || !m_buffer.empty() || offset == m_file.Tell());
 	return true;
 }
 
 fsal::Status RecordReader::ReadRecord(uint64_t& offset, std::function<void*(size_t size)> alloc_func)
 {
-	m_file.Seek(offset);
+	Seek(offset);
 
 	RecordHeader header = { 0 };
 	fsal::Status r = ReadChecksummed(offset, sizeof(RecordHeader::length), (uint8_t*)&header);
@@ -114,7 +319,7 @@ fsal::Status RecordReader::ReadRecord(uint64_t& offset, std::function<void*(size
 	ReadChecksummed(offset + sizeof(RecordHeader), header.length, data);
 
 	offset += sizeof(RecordHeader) + header.length + sizeof(uint32_t);
-	assert(offset == m_file.Tell());
+	assert(m_stream || !m_buffer.empty() || offset == m_file.Tell());
 	return true;
 }
 
@@ -130,28 +335,122 @@ fsal::Status RecordReader::GetNext(std::function<void*(size_t size)> alloc_func)
 	return s;
 }
 
+fsal::Status RecordReader::ReadRecordAt(size_t i, std::function<void*(size_t size)> alloc_func)
+{
+	if (!m_index)
+	{
+		throw runtime_error("Random access requires index. Record file: %s", m_file.GetPath().c_str());
+	}
+	if (i >= m_index->size())
+	{
+		throw runtime_error("Record number %zd is out of range, file has %zd records. Record file: %s", i, m_index->size(), m_file.GetPath().c_str());
+	}
+	uint64_t offset = (*m_index)[i].offset;
+	uint64_t length = (*m_index)[i].length;
+	// Length of the record comes from its header, it must match the one that index stores
+	return ReadRecord(offset, [this, offset, length, &alloc_func](size_t size)
+	{
+		if (size != length)
+		{
+			throw runtime_error("Corrupted record, header does not match the index. Error reading record at offset %zd. Record file: %s", offset, m_file.GetPath().c_str());
+		}
+		return alloc_func(size);
+	});
+}
+
+void RecordReader::ScanHeaders(const std::function<void(uint64_t offset, uint64_t length)>& func)
+{
+	if (m_stream)
+	{
+		throw runtime_error("Metadata and index are not available for compressed files. Record file: %s", m_file.GetPath().c_str());
+	}
+	uint64_t file_size = m_file.GetSize();
+
+	uint64_t offset = 0;
+	while (offset < file_size)
+	{
+		RecordHeader header = { 0 };
+		Seek(offset);
+		ReadChecksummed(offset, sizeof(RecordHeader::length), (uint8_t*)&header);
+
+		func(offset, header.length);
+		offset += sizeof(RecordHeader) + header.length + sizeof(uint32_t);
+	}
+}
+
+bool RecordReader::GetNextView(const uint8_t*& data, size_t& size)
+{
+	if (!m_mapping)
+	{
+		throw runtime_error("RecordReader was created without memory mapping. Record file: %s", m_file.GetPath().c_str());
+	}
+	const uint8_t* begin = m_mapping->data();
+	const uint64_t file_size = m_mapping->size();
+	if (m_offset == file_size)
+	{
+		return false;
+	}
+	if (m_offset + sizeof(RecordHeader) > file_size)
+	{
+		throw runtime_error("Unexpected EOF. Corrupted record at offset %zd. Record file: %s", m_offset, m_file.GetPath().c_str());
+	}
+
+	RecordHeader header;
+	memcpy(&header, begin + m_offset, sizeof(RecordHeader));
+	if (Unmask(header.crc_of_length) != crc32c_value((const uint8_t*)&header.length, sizeof(header.length)))
+	{
+		throw runtime_error("Corrupted record, CRC32 didn't match. Error reading record at offset %zd. Record file: %s", m_offset, m_file.GetPath().c_str());
+	}
+
+	const uint64_t data_offset = m_offset + sizeof(RecordHeader);
+	if (header.length > file_size - data_offset || file_size - data_offset - header.length < sizeof(uint32_t))
+	{
+		throw runtime_error("Unexpected EOF. Corrupted record at offset %zd. Record file: %s", m_offset, m_file.GetPath().c_str());
+	}
+
+	uint32_t masked_crc;
+	memcpy(&masked_crc, begin + data_offset + header.length, sizeof(uint32_t));
+	if (Unmask(masked_crc) != crc32c_value(begin + data_offset, header.length))
+	{
+		throw runtime_error("Corrupted record, CRC32 didn't match. Error reading record at offset %zd. Record file: %s", m_offset, m_file.GetPath().c_str());
+	}
+
+	data = begin + data_offset;
+	size = header.length;
+	m_offset = data_offset + header.length + sizeof(uint32_t);
+	return true;
+}
+
 RecordReader::Metadata RecordReader::GetMetadata()
 {
 	if (m_metadata.file_size == -1)
 	{
-		m_file.Seek(0);
 		m_metadata.data_size = 0;
 		m_metadata.entries = 0;
-		m_metadata.file_size = m_file.GetSize();
-
-		uint64_t offset = 0;
-		while (offset < m_metadata.file_size)
+		if (m_index)
 		{
-			RecordHeader header = { 0 };
-			ReadChecksummed(offset, sizeof(RecordHeader::length), (uint8_t*)&header);
-
-			m_file.Seek(header.length + sizeof(uint32_t), fsal::File::CurrentPosition);
-			offset += sizeof(RecordHeader) + header.length + sizeof(uint32_t);
-
-			m_metadata.data_size += header.length;
-			++m_metadata.entries;
+			m_metadata.data_size = m_index->data_size();
+			m_metadata.entries = m_index->size();
+		}
+		else
+		{
+			ScanHeaders([this](uint64_t, uint64_t length)
+			{
+				m_metadata.data_size += length;
+				++m_metadata.entries;
+			});
 		}
 		m_metadata.file_size = m_metadata.data_size + (sizeof(RecordHeader) + sizeof(uint32_t)) * m_metadata.entries;
 	}
 	return m_metadata;
 }
+
+std::shared_ptr<RecordIndex> RecordReader::BuildIndex()
+{
+	std::vector<RecordIndex::Entry> entries;
+	ScanHeaders([&entries](uint64_t offset, uint64_t length)
+	{
+		entries.push_back({offset, length});
+	});
+	return std::make_shared<RecordIndex>(m_file.GetSize(), std::move(entries));
+}
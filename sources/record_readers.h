@@ -15,9 +15,12 @@
 #pragma once
 #include <inttypes.h>
 #include <memory>
+#include <vector>
 #include <fsal.h>
 #include <MemRefFile.h>
 #include <bfio.h>
+#include "record_index.h"
+#include "compressed_stream.h"
 
 
 #pragma pack(push,1)
@@ -29,7 +32,42 @@ struct RecordHeader
 #pragma pack(pop)
 
 
-class RecordReader
+static const uint32_t kMaskDelta = 0xa282ead8ul;
+
+inline uint32_t Mask(uint32_t crc)
+{
+	return ((crc >> 15) | (crc << 17)) + kMaskDelta;
+}
+
+inline uint32_t Unmask(uint32_t masked_crc)
+{
+	uint32_t rot = masked_crc - kMaskDelta;
+	return ((rot >> 17) | (rot << 15));
+}
+
+
+// Read-only memory mapping of a whole file
+class HIDDEN MappedFile
+{
+public:
+	MappedFile(const MappedFile&) = delete; // non construction-copyable
+	MappedFile& operator=( const MappedFile&) = delete; // non copyable
+
+	explicit MappedFile(const std::string& path);
+
+	~MappedFile();
+
+	const uint8_t* data() const { return m_data; }
+
+	size_t size() const { return m_size; }
+
+private:
+	const uint8_t* m_data;
+	size_t m_size;
+};
+
+
+class HIDDEN RecordReader
 {
 public:
 	RecordReader(const RecordReader&) = delete; // non construction-copyable
@@ -42,9 +80,28 @@ public:
 		int64_t entries = -1;
 	};
 
-	explicit RecordReader(fsal::File file);
+	enum class Compression
+	{
+		// Detected from the beginning of the file
+		AUTO,
+		NONE,
+		ZLIB,
+		GZIP,
+		LZ4
+	};
 
-	explicit RecordReader(const std::string& file);
+	// Size of the read-ahead buffer that is used for sequential reading of files
+	static const size_t kDefaultBufferSize = 4 * 1024 * 1024;
+
+	// Compressed files can only be read forward, they have no metadata, index or memory mapping.
+	// If `buffer_size` is not zero, uncompressed files are read in aligned blocks of that size, and records are taken
+	// from the block. Records that do not fit into the block are read directly.
+	explicit RecordReader(fsal::File file, Compression compression = Compression::AUTO, size_t buffer_size = 0);
+
+	// Loads index from the sidecar file if it exists and `load_index` is set. If `use_mmap` is set, file is also
+	// memory mapped, which enables GetNextView
+	explicit RecordReader(const std::string& file, bool load_index = true, bool use_mmap = false,
+	                      Compression compression = Compression::AUTO, size_t buffer_size = 0);
 
 	virtual ~RecordReader() = default;
 
@@ -52,20 +109,57 @@ public:
 
 	fsal::Status ReadRecord(uint64_t& offset, std::function<void*(size_t size)> alloc_func);
 
+	// Reads record with the given number. Requires index
+	fsal::Status ReadRecordAt(size_t i, std::function<void*(size_t size)> alloc_func);
+
+	// If index is present, returns metadata without reading the file. Otherwise, scans the whole file
 	Metadata GetMetadata();
 
+	// Scans the whole file, checking crc of record headers. Returned index is not attached to the reader
+	std::shared_ptr<RecordIndex> BuildIndex();
+
+	const std::shared_ptr<RecordIndex>& index() const { return m_index; }
+
+	void SetIndex(std::shared_ptr<RecordIndex> index) { m_index = std::move(index); }
+
 	fsal::Status GetNext();
 
 	fsal::Status GetNext(std::function<void*(size_t size)> alloc_func);
 
+	// Returns next record without copying, `data` points to the mapped file. CRC is checked over the mapped memory.
+	// Returns false at the end of file, throws on errors. Requires the reader to be created with `use_mmap`.
+	bool GetNextView(const uint8_t*& data, size_t& size);
+
+	const std::shared_ptr<MappedFile>& mapping() const { return m_mapping; }
+
+	Compression compression() const { return m_compression; }
+
 	const fsal::MemRefFile& record() const { return m_mem_file; }
 
 	uint64_t offset() const { return m_offset; }
 
+	// Sets offset of the record that GetNext reads next. Compressed files can only be moved forward
+	void SetOffset(uint64_t offset) { m_offset = offset; }
+
 private:
+	void InitCompression(Compression compression);
+	void InitBuffer(size_t buffer_size);
+	void Seek(uint64_t offset);
+	fsal::Status ReadBuffered(uint64_t offset, uint8_t* dst, size_t size, size_t* read);
 	fsal::Status ReadChecksummed(uint64_t offset, size_t size, uint8_t* data);
+	void ScanHeaders(const std::function<void(uint64_t offset, uint64_t length)>& func);
 	fsal::MemRefFile m_mem_file;
 	uint64_t m_offset;
 	fsal::File m_file;
 	Metadata m_metadata;
+	std::shared_ptr<RecordIndex> m_index;
+	std::shared_ptr<MappedFile> m_mapping;
+	Compression m_compression;
+	// Read-ahead block, holds `m_buffer_filled` bytes of the file starting at `m_buffer_offset`
+	std::vector<uint8_t> m_buffer;
+	uint64_t m_buffer_offset;
+	size_t m_buffer_filled;
+	fsal::Status m_buffer_status;
+	// Must be destroyed before m_file
+	std::unique_ptr<CompressedInputStream> m_stream;
 };
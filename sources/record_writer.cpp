@@ -0,0 +1,146 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+
+#include "record_writer.h"
+#include "common.h"
+#include <crc32c/crc32c.h>
+#include <lz4frame.h>
+#include <string.h>
+#include <algorithm>
+
+
+namespace
+{
+	// Input is passed to LZ4 in chunks of this size, so that the output buffer has a fixed size
+	const size_t kLz4ChunkSize = 1024 * 1024;
+}
+
+RecordWriter::RecordWriter(const std::string& filename, RecordReader::Compression compression):
+		m_filename(filename), m_file(nullptr), m_lz4(nullptr)
+{
+	if (compression != RecordReader::Compression::NONE && compression != RecordReader::Compression::LZ4)
+	{
+		throw runtime_error("Only uncompressed and LZ4 compressed record files can be written. Record file: %s", filename.c_str());
+	}
+	m_file = fopen(filename.c_str(), "wb");
+	if (m_file == nullptr)
+	{
+		throw runtime_error("Can't open file for writing: %s", filename.c_str());
+	}
+	if (compression == RecordReader::Compression::LZ4)
+	{
+		LZ4F_preferences_t preferences;
+		memset(&preferences, 0, sizeof(preferences));
+		preferences.frameInfo.blockSizeID = LZ4F_max1MB;
+		preferences.frameInfo.blockMode = LZ4F_blockIndependent;
+		preferences.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+		size_t result = LZ4F_createCompressionContext(&m_lz4, LZ4F_VERSION);
+		if (LZ4F_isError(result))
+		{
+			fclose(m_file);
+			throw runtime_error("Can't initialize LZ4 compression: %s", LZ4F_getErrorName(result));
+		}
+		m_buffer.resize(LZ4F_compressBound(kLz4ChunkSize, &preferences));
+		result = LZ4F_compressBegin(m_lz4, m_buffer.data(), m_buffer.size(), &preferences);
+		if (LZ4F_isError(result))
+		{
+			LZ4F_freeCompressionContext(m_lz4);
+			fclose(m_file);
+			throw runtime_error("Can't initialize LZ4 compression: %s", LZ4F_getErrorName(result));
+		}
+		WriteFile(m_buffer.data(), result);
+	}
+}
+
+RecordWriter::~RecordWriter()
+{
+	try
+	{
+		Close();
+	}
+	catch (...)
+	{
+	}
+}
+
+void RecordWriter::Write(const void* data, size_t size)
+{
+	if (closed())
+	{
+		throw runtime_error("Can't write record, file is closed: %s", m_filename.c_str());
+	}
+	RecordHeader header;
+	header.length = size;
+	header.crc_of_length = Mask(crc32c_value((const uint8_t*)&header.length, sizeof(header.length)));
+	uint32_t crc = Mask(crc32c_value((const uint8_t*)data, size));
+
+	WriteCompressed(&header, sizeof(header));
+	WriteCompressed(data, size);
+	WriteCompressed(&crc, sizeof(crc));
+}
+
+void RecordWriter::Close()
+{
+	if (closed())
+	{
+		return;
+	}
+	FILE* file = m_file;
+	bool ok = true;
+	if (m_lz4 != nullptr)
+	{
+		size_t result = LZ4F_compressEnd(m_lz4, m_buffer.data(), m_buffer.size(), nullptr);
+		ok = !LZ4F_isError(result) && fwrite(m_buffer.data(), 1, result, file) == result;
+		LZ4F_freeCompressionContext(m_lz4);
+		m_lz4 = nullptr;
+	}
+	m_file = nullptr;
+	ok = (fclose(file) == 0) && ok;
+	if (!ok)
+	{
+		throw runtime_error("Error writing file: %s", m_filename.c_str());
+	}
+}
+
+void RecordWriter::WriteCompressed(const void* data, size_t size)
+{
+	if (m_lz4 == nullptr)
+	{
+		WriteFile(data, size);
+		return;
+	}
+	auto* src = (const uint8_t*)data;
+	while (size > 0)
+	{
+		size_t chunk = std::min(size, kLz4ChunkSize);
+		size_t result = LZ4F_compressUpdate(m_lz4, m_buffer.data(), m_buffer.size(), src, chunk, nullptr);
+		if (LZ4F_isError(result))
+		{
+			throw runtime_error("Error compressing file %s: %s", m_filename.c_str(), LZ4F_getErrorName(result));
+		}
+		WriteFile(m_buffer.data(), result);
+		src += chunk;
+		size -= chunk;
+	}
+}
+
+void RecordWriter::WriteFile(const void* data, size_t size)
+{
+	if (size > 0 && fwrite(data, 1, size, m_file) != size)
+	{
+		throw runtime_error("Error writing file: %s", m_filename.c_str());
+	}
+}
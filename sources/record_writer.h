@@ -0,0 +1,55 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+
+#pragma once
+#include <inttypes.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include "record_readers.h"
+
+
+struct LZ4F_cctx_s;
+
+// Writes records to a tfrecord file. With LZ4 compression, the file is a single LZ4 frame with independent blocks,
+// so it can be decompressed block-parallel by RecordReader.
+class RecordWriter
+{
+public:
+	RecordWriter(const RecordWriter&) = delete; // non construction-copyable
+	RecordWriter& operator=( const RecordWriter&) = delete; // non copyable
+
+	// Only NONE and LZ4 compressions are supported
+	explicit RecordWriter(const std::string& filename, RecordReader::Compression compression = RecordReader::Compression::NONE);
+
+	~RecordWriter();
+
+	void Write(const void* data, size_t size);
+
+	// Finishes LZ4 frame and closes the file. Called by destructor, if was not called explicitly
+	void Close();
+
+	bool closed() const { return m_file == nullptr; }
+
+private:
+	void WriteCompressed(const void* data, size_t size);
+
+	void WriteFile(const void* data, size_t size);
+
+	std::string m_filename;
+	FILE* m_file;
+	LZ4F_cctx_s* m_lz4;
+	std::vector<uint8_t> m_buffer;
+};
@@ -14,10 +14,12 @@
 
 #pragma once
 #include "record_readers.h"
+#include "record_prefetcher.h"
 #include "example.h"
 #include <vector>
 #include <string>
 #include <random>
+#include <sstream>
 #include <atomic>
 #include <mutex>
 #include <assert.h>
@@ -25,52 +27,83 @@
 #include <condition_variable>
 
 
+// Returns part of the files for the given shard, see shard_record_files. Files are opened without GIL
+inline std::vector<RecordRange> shard_record_files_nogil(const std::vector<std::string>& filenames, int shard_index, int num_shards)
+{
+	py::gil_scoped_release release;
+	return shard_record_files(filenames, shard_index, num_shards);
+}
+
+
+// Yielder state is a dict. Remaining parts of files are stored as a list of (filename, offset, count) tuples,
+// random generator in its text form.
+inline py::list ranges_to_list(const std::vector<RecordRange>& ranges)
+{
+	py::list result;
+	for (const auto& range: ranges)
+	{
+		result.append(py::make_tuple(range.filename, range.offset, range.count));
+	}
+	return result;
+}
+
+inline std::vector<RecordRange> ranges_from_list(const py::list& list)
+{
+	std::vector<RecordRange> ranges;
+	for (auto item: list)
+	{
+		auto tuple = py::cast<py::tuple>(item);
+		RecordRange range;
+		range.filename = py::cast<std::string>(tuple[0]);
+		range.offset = py::cast<uint64_t>(tuple[1]);
+		range.count = py::cast<size_t>(tuple[2]);
+		ranges.push_back(std::move(range));
+	}
+	return ranges;
+}
+
+inline std::string rng_to_string(const std::mt19937_64& rnd)
+{
+	std::ostringstream stream;
+	stream << rnd;
+	return stream.str();
+}
+
+inline std::mt19937_64 rng_from_string(const std::string& str)
+{
+	std::mt19937_64 rnd;
+	std::istringstream stream(str);
+	stream >> rnd;
+	if (stream.fail())
+	{
+		throw runtime_error("Invalid state of random generator");
+	}
+	return rnd;
+}
+
+
 class HIDDEN RecordYielderBasic
 {
 public:
 	RecordYielderBasic(const RecordYielderBasic&) = delete; // non construction-copyable
 	RecordYielderBasic& operator=( const RecordYielderBasic&) = delete; // non copyable
 
-	explicit RecordYielderBasic(std::vector<std::string>& filenames)
+	explicit RecordYielderBasic(std::vector<std::string>& filenames, int shard_index = 0, int num_shards = 1,
+	                            int cycle_length = 1, int block_length = 1, bool deterministic = true):
+			m_files(shard_record_files_nogil(filenames, shard_index, num_shards),
+			        InterleaveOptions(cycle_length, block_length, deterministic))
 	{
-		m_filenames = filenames;
-		m_current_file = 0;
-		m_rr = nullptr;
 	}
 
-	virtual ~RecordYielderBasic()
-	{
-		delete m_rr;
-	}
+	virtual ~RecordYielderBasic() = default;
 
 	py::object GetNext()
 	{
 		PyBytesObject* bytesObject = nullptr;
 
-		if (m_rr == nullptr)
-		{
-			if (m_current_file >= m_filenames.size())
-			{
-				throw py::stop_iteration();
-			}
-
-			m_rr = new RecordReader(m_filenames[m_current_file]);
-		}
-
-		auto status = m_rr->GetNext(GetBytesAllocator(bytesObject));
-		if (!status.ok() || status.is_eof())
+		if (!m_files.Next(GetBytesAllocator(bytesObject)))
 		{
-			if (status.is_eof())
-			{
-				delete m_rr;
-				m_rr = nullptr;
-				++m_current_file;
-				return GetNext();
-			}
-			else
-			{
-				throw runtime_error("Error while iterating RecordReader at offset: %zd", m_rr->offset());
-			}
+			throw py::stop_iteration();
 		}
 		return py::reinterpret_steal<py::object>((PyObject*) bytesObject);
 	}
@@ -80,54 +113,39 @@ public:
 		py::list batch;
 		for (int i = 0; i < n; ++i)
 		{
-			while (true)
-			{
-				PyBytesObject* bytesObject = nullptr;
+			PyBytesObject* bytesObject = nullptr;
 
-				if (m_rr == nullptr)
+			if (!m_files.Next(GetBytesAllocator(bytesObject)))
+			{
+				if(batch.size() > 0)
 				{
-					if (m_current_file >= m_filenames.size())
-					{
-						if(batch.size() > 0)
-						{
-							return batch;
-						}
-						else
-						{
-							throw py::stop_iteration();
-						}
-					}
-
-					m_rr = new RecordReader(m_filenames[m_current_file]);
+					return batch;
 				}
-
-				auto status = m_rr->GetNext(GetBytesAllocator(bytesObject));
-				if (!status.ok() || status.is_eof())
+				else
 				{
-					if (status.is_eof())
-					{
-						delete m_rr;
-						m_rr = nullptr;
-						++m_current_file;
-						continue;
-					}
-					else
-					{
-						throw runtime_error("Error while iterating RecordReader at offset: %zd", m_rr->offset());
-					}
+					throw py::stop_iteration();
 				}
-				py::object value = py::reinterpret_steal<py::object>((PyObject*) bytesObject);
-				batch.append(std::move(value));
-				break;
 			}
+			py::object value = py::reinterpret_steal<py::object>((PyObject*) bytesObject);
+			batch.append(std::move(value));
 		}
 		return std::move(batch);
 	}
 
+	py::dict GetState() const
+	{
+		py::dict state;
+		state["ranges"] = ranges_to_list(m_files.Remaining());
+		return state;
+	}
+
+	void SetState(const py::dict& state)
+	{
+		m_files.Reset(ranges_from_list(state["ranges"]));
+	}
+
 private:
-	std::vector<std::string> m_filenames;
-	RecordReader* m_rr;
-	int m_current_file;
+	RecordFileIterator m_files;
 };
 
 
@@ -137,77 +155,74 @@ public:
 	RecordYielderRandomized(const RecordYielderRandomized&) = delete; // non construction-copyable
 	RecordYielderRandomized& operator=( const RecordYielderRandomized&) = delete; // non copyable
 
-	explicit RecordYielderRandomized(std::vector<std::string>& filenames, int buffsize, uint64_t seed, int epoch)
+	explicit RecordYielderRandomized(std::vector<std::string>& filenames, int buffsize, uint64_t seed, int epoch, int prefetch=0,
+	                                 int shard_index=0, int num_shards=1, int cycle_length=1, int block_length=1,
+	                                 bool deterministic=true):
+			m_buffsize(buffsize), m_prefetch(prefetch), m_interleave(cycle_length, block_length, deterministic)
 	{
-		m_filenames = filenames;
-		m_buffsize = buffsize;
+		std::vector<std::string> shuffled_filenames = filenames;
 		uint64_t hash = ((uint64_t)std::hash<size_t>{}(seed)) ^ ((uint64_t)std::hash<int>{}(epoch) << 1);
 		std::mt19937_64 shuffle_rnd(hash);
-		std::shuffle(m_filenames.begin(), m_filenames.end(), shuffle_rnd);
+		std::shuffle(shuffled_filenames.begin(), shuffled_filenames.end(), shuffle_rnd);
 
-		m_current_file = 0;
-		m_rr = nullptr;
-		m_rnd = std::mt19937_64(std::hash<int>{}(hash) ^ ((uint64_t)std::hash<int>{}(seed) << 1));
+		std::mt19937_64 rnd(std::hash<int>{}(hash) ^ ((uint64_t)std::hash<int>{}(seed) << 1));
+
+		// Shuffled order is the same for all shards, so they are split consistently for each epoch
+		std::vector<RecordRange> ranges = shard_record_files_nogil(shuffled_filenames, shard_index, num_shards);
+
+		if (prefetch > 0)
+		{
+			m_prefetcher.reset(new RecordPrefetcher(std::move(ranges), buffsize, rnd, prefetch, m_interleave));
+		}
+		else
+		{
+			m_files.reset(new RecordFileIterator(std::move(ranges), m_interleave));
+			m_buffer.reset(new ShuffleBuffer<py::object>(buffsize, rnd));
+		}
 	}
 
 	virtual ~RecordYielderRandomized()
 	{
-		delete m_rr;
+		py::gil_scoped_release release;
+		m_prefetcher.reset();
 	}
 
 	void FillBuffer()
 	{
-		while (m_buffer.size() < m_buffsize)
+		while (!m_buffer->full())
 		{
-			if (m_current_file >= m_filenames.size())
-			{
-				return;
-			}
-
-			if (m_rr == nullptr)
-			{
-				m_rr = new RecordReader(m_filenames[m_current_file]);
-			}
-
 			PyBytesObject* bytesObject = nullptr;
 
-			auto status = m_rr->GetNext(GetBytesAllocator(bytesObject));
-			if (!status.ok() || status.is_eof())
+			if (!m_files->Next(GetBytesAllocator(bytesObject)))
 			{
-				if (status.is_eof())
-				{
-					delete m_rr;
-					m_rr = nullptr;
-					++m_current_file;
-					continue;
-				}
-				else
-				{
-					throw runtime_error("Error while iterating RecordReader at offset: %zd", m_rr->offset());
-				}
+				return;
 			}
-			auto index = m_rnd() % (m_buffer.size() + 1);
-			if (index == m_buffer.size())
+			m_buffer->Push(py::reinterpret_steal<py::object>((PyObject*) bytesObject));
+		}
+	}
+
+	py::object GetNext()
+	{
+		if (m_prefetcher)
+		{
+			std::string record;
+			bool ok = false;
 			{
-				m_buffer.push_back(py::reinterpret_steal<py::object>((PyObject*) bytesObject));
+				py::gil_scoped_release release;
+				ok = m_prefetcher->Pop(record);
 			}
-			else
+			if (!ok)
 			{
-				m_buffer.push_back(std::move(m_buffer[index]));
-				m_buffer[index] = std::move(py::reinterpret_steal<py::object>((PyObject*) bytesObject));
+				throw py::stop_iteration();
 			}
+			return py::bytes(record);
 		}
-	}
 
-	py::object GetNext()
-	{
 		FillBuffer();
 
-		if (!m_buffer.empty())
+		if (!m_buffer->empty())
 		{
-			py::object value = std::move(m_buffer.back());
-			m_buffer.pop_back();
-			return std::move(value);
+			return m_buffer->Pop();
 		}
 		else
 		{
@@ -218,15 +233,36 @@ public:
 	py::list GetNextN(int n)
 	{
 		py::list  batch;
+
+		if (m_prefetcher)
+		{
+			std::vector<std::string> records;
+			{
+				py::gil_scoped_release release;
+				std::string record;
+				while (records.size() < (size_t)n && m_prefetcher->Pop(record))
+				{
+					records.push_back(std::move(record));
+				}
+			}
+			if (records.empty())
+			{
+				throw py::stop_iteration();
+			}
+			for (const auto& record: records)
+			{
+				batch.append(py::bytes(record));
+			}
+			return batch;
+		}
+
 		for (int i = 0; i < n; ++i)
 		{
 			FillBuffer();
 
-			if (!m_buffer.empty())
+			if (!m_buffer->empty())
 			{
-				py::object value = std::move(m_buffer.back());
-				m_buffer.pop_back();
-				batch.append(std::move(value));
+				batch.append(m_buffer->Pop());
 			}
 			else if(batch.size() > 0)
 			{
@@ -240,13 +276,93 @@ public:
 		return std::move(batch);
 	}
 
+	// If `include_buffer` is false, records that were read into the shuffle buffer, are not part of the state and
+	// will be skipped after restoring it
+	py::dict GetState(bool include_buffer)
+	{
+		py::dict state;
+		py::list buffer;
+		py::list ready;
+		if (m_prefetcher)
+		{
+			std::vector<RecordRange> ranges;
+			std::mt19937_64 rnd;
+			std::vector<std::string> buffer_items;
+			std::deque<std::string> ready_items;
+			{
+				py::gil_scoped_release release;
+				m_prefetcher->GetState(ranges, rnd, buffer_items, ready_items);
+			}
+			state["ranges"] = ranges_to_list(ranges);
+			state["rng"] = rng_to_string(rnd);
+			for (const auto& record: buffer_items)
+			{
+				buffer.append(py::bytes(record));
+			}
+			for (const auto& record: ready_items)
+			{
+				ready.append(py::bytes(record));
+			}
+		}
+		else
+		{
+			state["ranges"] = ranges_to_list(m_files->Remaining());
+			state["rng"] = rng_to_string(m_buffer->rnd());
+			for (const auto& record: m_buffer->items())
+			{
+				buffer.append(record);
+			}
+		}
+		state["buffer"] = include_buffer ? buffer : py::list();
+		state["ready"] = include_buffer ? ready : py::list();
+		return state;
+	}
+
+	void SetState(const py::dict& state)
+	{
+		std::vector<RecordRange> ranges = ranges_from_list(state["ranges"]);
+		std::mt19937_64 rnd = rng_from_string(py::cast<std::string>(state["rng"]));
+		auto buffer = py::cast<py::list>(state["buffer"]);
+		auto ready = py::cast<py::list>(state["ready"]);
+		if (m_prefetch > 0)
+		{
+			std::vector<std::string> buffer_items;
+			std::deque<std::string> ready_items;
+			for (auto record: buffer)
+			{
+				buffer_items.push_back(py::cast<std::string>(record));
+			}
+			for (auto record: ready)
+			{
+				ready_items.push_back(py::cast<std::string>(record));
+			}
+			py::gil_scoped_release release;
+			m_prefetcher.reset();
+			m_prefetcher.reset(new RecordPrefetcher(std::move(ranges), m_buffsize, rnd, m_prefetch, m_interleave, std::move(buffer_items), std::move(ready_items)));
+		}
+		else
+		{
+			if (ready.size() > 0)
+			{
+				throw runtime_error("State that has prefetched records can only be restored with prefetching enabled");
+			}
+			std::vector<py::object> buffer_items;
+			for (auto record: buffer)
+			{
+				buffer_items.push_back(py::reinterpret_borrow<py::object>(record));
+			}
+			m_files.reset(new RecordFileIterator(std::move(ranges), m_interleave));
+			m_buffer.reset(new ShuffleBuffer<py::object>(m_buffsize, rnd, std::move(buffer_items)));
+		}
+	}
+
 private:
-	std::mt19937_64 m_rnd;
-	std::vector<std::string> m_filenames;
-	std::vector<py::object> m_buffer;
+	std::unique_ptr<RecordFileIterator> m_files;
+	std::unique_ptr<ShuffleBuffer<py::object> > m_buffer;
+	std::unique_ptr<RecordPrefetcher> m_prefetcher;
 	int m_buffsize;
-	RecordReader* m_rr;
-	int m_current_file;
+	int m_prefetch;
+	InterleaveOptions m_interleave;
 };
 
 
@@ -256,82 +372,82 @@ public:
 	ParsedRecordYielderRandomized(const ParsedRecordYielderRandomized&) = delete; // non construction-copyable
 	ParsedRecordYielderRandomized& operator=( const ParsedRecordYielderRandomized&) = delete; // non copyable
 
-	explicit ParsedRecordYielderRandomized(py::object parser, std::vector<std::string>& filenames, int buffsize, uint64_t seed, int epoch)
+	explicit ParsedRecordYielderRandomized(py::object parser, std::vector<std::string>& filenames, int buffsize, uint64_t seed, int epoch, int prefetch=0,
+	                                       int shard_index=0, int num_shards=1, int cycle_length=1, int block_length=1,
+	                                       bool deterministic=true):
+			m_buffsize(buffsize), m_prefetch(prefetch), m_interleave(cycle_length, block_length, deterministic)
 	{
 		m_parser_obj = parser;
 		m_parser = py::cast<Records::RecordParser*>(m_parser_obj);
-		m_filenames = filenames;
-		m_buffsize = buffsize;
+		std::vector<std::string> shuffled_filenames = filenames;
 		uint64_t hash = ((uint64_t)std::hash<size_t>{}(seed)) ^ ((uint64_t)std::hash<int>{}(epoch) << 1);
 		std::mt19937_64 shuffle_rnd(hash);
-		std::shuffle(m_filenames.begin(), m_filenames.end(), shuffle_rnd);
+		std::shuffle(shuffled_filenames.begin(), shuffled_filenames.end(), shuffle_rnd);
+
+		std::mt19937_64 rnd(std::hash<int>{}(hash) ^ ((uint64_t)std::hash<int>{}(seed) << 1));
 
-		m_current_file = 0;
-		m_rr = nullptr;
-		m_rnd = std::mt19937_64(std::hash<int>{}(hash) ^ ((uint64_t)std::hash<int>{}(seed) << 1));
+		// Shuffled order is the same for all shards, so they are split consistently for each epoch
+		std::vector<RecordRange> ranges = shard_record_files_nogil(shuffled_filenames, shard_index, num_shards);
+
+		if (prefetch > 0)
+		{
+			m_prefetcher.reset(new RecordPrefetcher(std::move(ranges), buffsize, rnd, prefetch, m_interleave));
+		}
+		else
+		{
+			m_files.reset(new RecordFileIterator(std::move(ranges), m_interleave));
+			m_buffer.reset(new ShuffleBuffer<std::string>(buffsize, rnd));
+		}
 	}
 
 	virtual ~ParsedRecordYielderRandomized()
 	{
-		delete m_rr;
+		py::gil_scoped_release release;
+		m_prefetcher.reset();
 	}
 
 	void FillBuffer()
 	{
-		while (m_buffer.size() < m_buffsize)
+		while (!m_buffer->full())
 		{
-			if (m_current_file >= m_filenames.size())
-			{
-				return;
-			}
-
-			if (m_rr == nullptr)
-			{
-				m_rr = new RecordReader(m_filenames[m_current_file]);
-			}
-
 			std::string str;
 			auto alloc = [&str](size_t size)
 			{
 				str.resize(size + sizeof(uint32_t));
 				return &str[0];
 			};
-			auto status = m_rr->GetNext(alloc);
-			if (!status.ok() || status.is_eof())
+			if (!m_files->Next(alloc))
 			{
-				if (status.is_eof())
-				{
-					delete m_rr;
-					m_rr = nullptr;
-					++m_current_file;
-					continue;
-				}
-				else
-				{
-					throw runtime_error("Error while iterating RecordReader at offset: %zd", m_rr->offset());
-				}
-			}
-			auto index = m_rnd() % (m_buffer.size() + 1);
-			if (index == m_buffer.size())
-			{
-				m_buffer.push_back(std::move(str));
-			}
-			else
-			{
-				m_buffer.push_back(std::move(m_buffer[index]));
-				m_buffer[index] = std::move(str);
+				return;
 			}
+			m_buffer->Push(std::move(str));
 		}
 	}
 
-	py::object GetNext()
+	// Takes next record either from the prefetcher or from the shuffle buffer. Returns false if there are no more.
+	bool Pop(std::string& record)
 	{
+		if (m_prefetcher)
+		{
+			py::gil_scoped_release release;
+			return m_prefetcher->Pop(record);
+		}
+
 		FillBuffer();
 
-		if (!m_buffer.empty())
+		if (m_buffer->empty())
+		{
+			return false;
+		}
+		record = m_buffer->Pop();
+		return true;
+	}
+
+	py::object GetNext()
+	{
+		std::string value;
+		if (Pop(value))
 		{
-			std::string value = std::move(m_buffer.back());
-			m_buffer.pop_back();
 			return m_parser->ParseSingleExample(value);
 		}
 		else
@@ -343,35 +459,119 @@ public:
 	py::list GetNextN(int n)
 	{
 		std::vector<std::string>  batch;
-		for (int i = 0; i < n; ++i)
+		if (m_prefetcher)
 		{
-			FillBuffer();
-
-			if (!m_buffer.empty())
+			// Whole batch is taken with GIL released once, not once per record
+			py::gil_scoped_release release;
+			std::string value;
+			while (batch.size() < (size_t)n && m_prefetcher->Pop(value))
 			{
-				std::string value = std::move(m_buffer.back());
-				m_buffer.pop_back();
 				batch.push_back(std::move(value));
 			}
-			else if(batch.size() > 0)
+		}
+		else
+		{
+			std::string value;
+			while (batch.size() < (size_t)n && Pop(value))
 			{
-				return m_parser->ParseExample(batch);
+				batch.push_back(std::move(value));
 			}
-			else
+		}
+		if (batch.empty())
+		{
+			throw py::stop_iteration();
+		}
+		return m_parser->ParseExample(batch);
+	}
+
+	// Same as RecordYielderRandomized::GetState
+	py::dict GetState(bool include_buffer)
+	{
+		std::vector<RecordRange> ranges;
+		std::mt19937_64 rnd;
+		std::vector<std::string> buffer_items;
+		std::deque<std::string> ready_items;
+		if (m_prefetcher)
+		{
+			// Prefetcher guards its state with its own lock, waiting for it does not need GIL
+			py::gil_scoped_release release;
+			m_prefetcher->GetState(ranges, rnd, buffer_items, ready_items);
+		}
+		else
+		{
+			// Files and buffer are used by the calling thread, so they are read with GIL held
+			ranges = m_files->Remaining();
+			rnd = m_buffer->rnd();
+			buffer_items = m_buffer->items();
+			// Records in the buffer have crc padding, unlike records of the prefetcher
+			for (auto& record: buffer_items)
 			{
-				throw py::stop_iteration();
+				record.resize(record.size() - sizeof(uint32_t));
+			}
+		}
+		py::dict state;
+		py::list buffer;
+		py::list ready;
+		if (include_buffer)
+		{
+			for (const auto& record: buffer_items)
+			{
+				buffer.append(py::bytes(record));
+			}
+			for (const auto& record: ready_items)
+			{
+				ready.append(py::bytes(record));
+			}
+		}
+		state["ranges"] = ranges_to_list(ranges);
+		state["rng"] = rng_to_string(rnd);
+		state["buffer"] = buffer;
+		state["ready"] = ready;
+		return state;
+	}
+
+	void SetState(const py::dict& state)
+	{
+		std::vector<RecordRange> ranges = ranges_from_list(state["ranges"]);
+		std::mt19937_64 rnd = rng_from_string(py::cast<std::string>(state["rng"]));
+		std::vector<std::string> buffer_items;
+		std::deque<std::string> ready_items;
+		for (auto record: py::cast<py::list>(state["buffer"]))
+		{
+			buffer_items.push_back(py::cast<std::string>(record));
+		}
+		for (auto record: py::cast<py::list>(state["ready"]))
+		{
+			ready_items.push_back(py::cast<std::string>(record));
+		}
+		if (m_prefetch > 0)
+		{
+			py::gil_scoped_release release;
+			m_prefetcher.reset();
+			m_prefetcher.reset(new RecordPrefetcher(std::move(ranges), m_buffsize, rnd, m_prefetch, m_interleave, std::move(buffer_items), std::move(ready_items)));
+		}
+		else
+		{
+			if (!ready_items.empty())
+			{
+				throw runtime_error("State that has prefetched records can only be restored with prefetching enabled");
+			}
+			for (auto& record: buffer_items)
+			{
+				record.resize(record.size() + sizeof(uint32_t));
 			}
+			m_files.reset(new RecordFileIterator(std::move(ranges), m_interleave));
+			m_buffer.reset(new ShuffleBuffer<std::string>(m_buffsize, rnd, std::move(buffer_items)));
 		}
-		return std::move(m_parser->ParseExample(batch));
 	}
 
 private:
-	std::mt19937_64 m_rnd;
-	std::vector<std::string> m_filenames;
-	std::vector<std::string> m_buffer;
+	std::unique_ptr<RecordFileIterator> m_files;
+	std::unique_ptr<ShuffleBuffer<std::string> > m_buffer;
+	std::unique_ptr<RecordPrefetcher> m_prefetcher;
 	int m_buffsize;
-	RecordReader* m_rr;
-	int m_current_file;
+	int m_prefetch;
+	InterleaveOptions m_interleave;
 	py::object m_parser_obj;
 	Records::RecordParser* m_parser;
 };
@@ -0,0 +1,166 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "thread_pool.h"
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+
+ThreadPool::ThreadPool(int worker_count): m_stop(false)
+{
+	if (worker_count < 1)
+	{
+		throw runtime_error("Number of workers must be positive, got %d", worker_count);
+	}
+	for (int i = 0; i < worker_count; ++i)
+	{
+		m_workers.emplace_back(&ThreadPool::Run, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	for (auto& worker: m_workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::Enqueue(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(std::move(task));
+	}
+	m_cv.notify_one();
+}
+
+void ThreadPool::Run()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [this]{ return m_stop || !m_tasks.empty(); });
+			if (m_stop && m_tasks.empty())
+			{
+				return;
+			}
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+		task();
+	}
+}
+
+namespace
+{
+	// State of one ParallelFor call. Shared with helper tasks, which may get scheduled after the call has returned.
+	struct ParallelForState
+	{
+		ParallelForState(size_t n, const std::function<void(size_t)>& func): n(n), func(func), next(0), running(0)
+		{
+		}
+
+		void Work()
+		{
+			size_t i;
+			while ((i = next++) < n)
+			{
+				try
+				{
+					func(i);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!error)
+					{
+						error = std::current_exception();
+					}
+					next = n;
+				}
+			}
+		}
+
+		size_t n;
+		const std::function<void(size_t)>& func;
+		std::atomic<size_t> next;
+		int running;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+}
+
+void ThreadPool::ParallelFor(size_t n, const std::function<void(size_t)>& func, int max_workers)
+{
+	if (n == 0)
+	{
+		return;
+	}
+	if (max_workers < 1 || max_workers > size() + 1)
+	{
+		max_workers = size() + 1;
+	}
+	size_t helpers = std::min((size_t)max_workers, n) - 1;
+
+	auto state = std::make_shared<ParallelForState>(n, func);
+
+	for (size_t i = 0; i < helpers; ++i)
+	{
+		Enqueue([state]()
+		{
+			{
+				// Helpers that start after all indices were taken must not touch `func`, it may not exist anymore
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if (state->next >= state->n)
+				{
+					return;
+				}
+				++state->running;
+			}
+			state->Work();
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				--state->running;
+			}
+			state->cv.notify_all();
+		});
+	}
+
+	state->Work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cv.wait(lock, [&state]{ return state->running == 0; });
+	if (state->error)
+	{
+		std::rethrow_exception(state->error);
+	}
+}
+
+ThreadPool& ThreadPool::Default()
+{
+	// Intentionally leaked, joining threads during unloading of the module may deadlock. Calling thread takes part in
+	// ParallelFor, so one hardware thread is left for it.
+	static ThreadPool* pool = new ThreadPool(std::max(1, (int)std::thread::hardware_concurrency() - 1));
+	return *pool;
+}
@@ -0,0 +1,59 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include "common.h"
+
+
+// Persistent pool of worker threads. Workers never touch python objects, all work submitted to the pool must be
+// GIL-free.
+class HIDDEN ThreadPool
+{
+public:
+	ThreadPool(const ThreadPool&) = delete; // non construction-copyable
+	ThreadPool& operator=( const ThreadPool&) = delete; // non copyable
+
+	explicit ThreadPool(int worker_count);
+
+	~ThreadPool();
+
+	int size() const { return (int)m_workers.size(); }
+
+	// Calls `func(i)` for each i in [0, n) and blocks until all calls are done. Calling thread takes part in the
+	// work, at most `max_workers` threads are used in total (all workers of the pool if `max_workers` < 1).
+	// If any call throws, remaining indices are skipped and the first exception is rethrown on the calling thread.
+	// Can be called from a worker of the pool.
+	void ParallelFor(size_t n, const std::function<void(size_t)>& func, int max_workers = -1);
+
+	// Pool that is shared by all native stages. Has one worker less than the number of hardware threads (but at least
+	// one), so that together with the calling thread a parallel stage does not oversubscribe the cores.
+	static ThreadPool& Default();
+
+private:
+	void Enqueue(std::function<void()> task);
+
+	void Run();
+
+	std::vector<std::thread> m_workers;
+	std::deque<std::function<void()> > m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stop;
+};
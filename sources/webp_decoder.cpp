@@ -0,0 +1,225 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "webp_decoder.h"
+#include <webp/decode.h>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <memory>
+
+
+namespace
+{
+// Size of the chunks, in which image is read in incremental mode
+const size_t kChunkSize = 64 * 1024;
+
+const char* StatusString(VP8StatusCode status)
+{
+	switch (status)
+	{
+		case VP8_STATUS_OK: return "ok";
+		case VP8_STATUS_OUT_OF_MEMORY: return "out of memory";
+		case VP8_STATUS_INVALID_PARAM: return "invalid param";
+		case VP8_STATUS_BITSTREAM_ERROR: return "bitstream error";
+		case VP8_STATUS_UNSUPPORTED_FEATURE: return "unsupported feature";
+		case VP8_STATUS_SUSPENDED: return "suspended";
+		case VP8_STATUS_USER_ABORT: return "user abort";
+		case VP8_STATUS_NOT_ENOUGH_DATA: return "not enough data";
+		default: return "unknown error";
+	}
+}
+
+struct WebPOutputInfo
+{
+	size_t height = 0;
+	size_t width = 0;
+	int channels = 0;
+	bool scaled = false;
+};
+
+// Returns size of the output. Returns false if `data` does not contain the whole header yet
+bool GetOutputInfo(const uint8_t* data, size_t size, const WebPOptions& options, WebPOutputInfo& info)
+{
+	if (options.channels != 0 && options.channels != 3 && options.channels != 4)
+	{
+		throw runtime_error("Error reading file WebP. Number of channels must be 0, 3 or 4, got %d", options.channels);
+	}
+
+	WebPBitstreamFeatures features;
+	VP8StatusCode status = WebPGetFeatures(data, size, &features);
+	if (status == VP8_STATUS_NOT_ENOUGH_DATA)
+	{
+		return false;
+	}
+	if (status != VP8_STATUS_OK)
+	{
+		throw runtime_error("Error reading file WebP. Can't read header: %s", StatusString(status));
+	}
+	if (features.has_animation)
+	{
+		throw runtime_error("Error reading file WebP. Animated images are not supported");
+	}
+
+	info.channels = options.channels != 0 ? options.channels : (features.has_alpha ? 4 : 3);
+	info.height = features.height;
+	info.width = features.width;
+	info.scaled = false;
+	if (options.height != 0 && options.width != 0)
+	{
+		info.height = options.height;
+		info.width = options.width;
+		info.scaled = true;
+	}
+	else if (options.min_side != 0)
+	{
+		double scale = double(options.min_side) / std::min(features.height, features.width);
+		info.height = std::max<size_t>(1, (size_t)std::round(features.height * scale));
+		info.width = std::max<size_t>(1, (size_t)std::round(features.width * scale));
+		info.scaled = true;
+	}
+	return true;
+}
+
+void InitConfig(WebPDecoderConfig& config, const WebPOutputInfo& info, uint8_t* dst)
+{
+	if (!WebPInitDecoderConfig(&config))
+	{
+		throw runtime_error("Error reading file WebP. libwebp version mismatch");
+	}
+	if (info.scaled)
+	{
+		config.options.use_scaling = 1;
+		config.options.scaled_width = (int)info.width;
+		config.options.scaled_height = (int)info.height;
+	}
+	// Decoding directly to the output array
+	config.output.colorspace = info.channels == 4 ? MODE_RGBA : MODE_RGB;
+	config.output.is_external_memory = 1;
+	config.output.u.RGBA.rgba = dst;
+	config.output.u.RGBA.stride = (int)(info.width * info.channels);
+	config.output.u.RGBA.size = info.height * info.width * info.channels;
+}
+
+ndarray_uint8 MakeOutput(const WebPOutputInfo& info)
+{
+	return ndarray_uint8(std::array<size_t, 3>({info.height, info.width, (size_t)info.channels}));
+}
+}
+
+
+void decode_webp_to(const void* data, size_t size, const WebPOptions& options, const ImageAllocator& alloc)
+{
+	if (data == nullptr)
+	{
+		throw runtime_error("Error reading file WebP. Got nullptr to decompress");
+	}
+
+	WebPOutputInfo info;
+	if (!GetOutputInfo((const uint8_t*)data, size, options, info))
+	{
+		throw runtime_error("Error reading file WebP. Unexpected end of data");
+	}
+
+	WebPDecoderConfig config;
+	InitConfig(config, info, alloc(info.height, info.width, info.channels));
+	VP8StatusCode status = WebPDecode((const uint8_t*)data, size, &config);
+	WebPFreeDecBuffer(&config.output);
+	if (status != VP8_STATUS_OK)
+	{
+		throw runtime_error("Error reading file WebP. libwebp has signaled an error: %s", StatusString(status));
+	}
+}
+
+py::object decode_webp(const void* data, size_t size, const WebPOptions& options)
+{
+	py::object result;
+	{
+		py::gil_scoped_release release;
+		decode_webp_to(data, size, options, [&result](size_t height, size_t width, int channels)
+		{
+			// Only allocation of the output needs GIL
+			py::gil_scoped_acquire acquire;
+			ndarray_uint8 ar(std::array<size_t, 3>({height, width, (size_t)channels}));
+			result = ar;
+			return ar.mutable_data();
+		});
+	}
+	return result;
+}
+
+py::object decode_webp_incremental(const std::function<size_t(uint8_t* dst, size_t size)>& read,
+                                   const WebPOptions& options)
+{
+	WebPOutputInfo info;
+	std::vector<uint8_t> head;
+	{
+		py::gil_scoped_release release;
+		// Reading until the header is complete
+		while (true)
+		{
+			size_t offset = head.size();
+			head.resize(offset + kChunkSize);
+			size_t read_size = read(head.data() + offset, kChunkSize);
+			head.resize(offset + read_size);
+			if (GetOutputInfo(head.data(), head.size(), options, info))
+			{
+				break;
+			}
+			if (read_size == 0)
+			{
+				throw runtime_error("Error reading file WebP. Unexpected end of data");
+			}
+		}
+	}
+
+	ndarray_uint8 result = MakeOutput(info);
+	uint8_t* ptr = result.mutable_data();
+	{
+		py::gil_scoped_release release;
+		WebPDecoderConfig config;
+		InitConfig(config, info, ptr);
+
+		std::unique_ptr<WebPIDecoder, void(*)(WebPIDecoder*)> idec(WebPIDecode(nullptr, 0, &config), WebPIDelete);
+		if (!idec)
+		{
+			throw runtime_error("Error reading file WebP. Can't create incremental decoder");
+		}
+
+		// Decoder copies appended data, so the chunk buffer is reused
+		std::vector<uint8_t>& chunk = head;
+		size_t chunk_size = head.size();
+		while (true)
+		{
+			VP8StatusCode status = WebPIAppend(idec.get(), chunk.data(), chunk_size);
+			if (status == VP8_STATUS_OK)
+			{
+				break;
+			}
+			if (status != VP8_STATUS_SUSPENDED)
+			{
+				throw runtime_error("Error reading file WebP. libwebp has signaled an error: %s", StatusString(status));
+			}
+			chunk.resize(kChunkSize);
+			chunk_size = read(chunk.data(), kChunkSize);
+			if (chunk_size == 0)
+			{
+				throw runtime_error("Error reading file WebP. Unexpected end of data");
+			}
+		}
+		idec.reset();
+		WebPFreeDecBuffer(&config.output);
+	}
+	return result;
+}
@@ -0,0 +1,43 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include "common.h"
+#include "image_transforms.h"
+#include <functional>
+
+struct WebPOptions
+{
+	// Number of channels of the output: 3 - RGB, 4 - RGBA. Zero picks RGBA if the image has alpha, RGB otherwise.
+	int channels = 0;
+	// Size of the output. If both `height` and `width` are set, image is scaled to exactly that size. Otherwise, if
+	// `min_side` is set, image is scaled preserving aspect ratio, so that its shorter side is `min_side` pixels.
+	// Scaling is done by the decoder while decoding.
+	size_t height = 0;
+	size_t width = 0;
+	size_t min_side = 0;
+};
+
+// Decodes WebP image directly to ndarray of shape [H, W, C] and uint8 dtype. GIL is released during decoding.
+py::object decode_webp(const void* data, size_t size, const WebPOptions& options = WebPOptions());
+
+// Same as above, but output memory is requested from `alloc`. Does not require GIL.
+void decode_webp_to(const void* data, size_t size, const WebPOptions& options, const ImageAllocator& alloc);
+
+// Same as `decode_webp`, but file is read in chunks, each one is decoded before the next one is read, so the whole file
+// is never buffered. `read` reads up to `size` bytes to `dst` and returns number of bytes read, zero if there is no
+// more data.
+// `read` is called without GIL being held.
+py::object decode_webp_incremental(const std::function<size_t(uint8_t* dst, size_t size)>& read,
+                                   const WebPOptions& options = WebPOptions());
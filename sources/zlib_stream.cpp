@@ -0,0 +1,170 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#include "zlib_stream.h"
+#include "common.h"
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+
+ZlibInputStream::ZlibInputStream(fsal::File* file, Format format, size_t chunk_size):
+		m_file(file), m_position(0), m_stream_end(false), m_exhausted(false), m_front(0), m_back_ready(false), m_file_end(false),
+		m_stop(false), m_file_status(true)
+{
+	memset(&m_zstream, 0, sizeof(m_zstream));
+	int window_bits = format == Format::GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+	if (inflateInit2(&m_zstream, window_bits) != Z_OK)
+	{
+		throw runtime_error("Can't initialize zlib: %s", m_zstream.msg ? m_zstream.msg : "unknown error");
+	}
+	m_chunks[0].data.resize(chunk_size);
+	m_chunks[1].data.resize(chunk_size);
+	m_thread = std::thread(&ZlibInputStream::Run, this);
+}
+
+ZlibInputStream::~ZlibInputStream()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	m_thread.join();
+	inflateEnd(&m_zstream);
+}
+
+void ZlibInputStream::Run()
+{
+	try
+	{
+		while (true)
+		{
+			int back = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cv.wait(lock, [this]{ return !m_back_ready || m_stop; });
+				if (m_stop)
+				{
+					return;
+				}
+				back = 1 - m_front;
+			}
+			// Back buffer is not touched by the consumer until it is marked as ready
+			Chunk& chunk = m_chunks[back];
+			size_t read = 0;
+			fsal::Status status = m_file->Read(chunk.data.data(), chunk.data.size(), &read);
+			if (!status.ok() && !status.is_eof())
+			{
+				throw runtime_error("Error reading compressed file: %s", m_file->GetPath().c_str());
+			}
+			chunk.size = read;
+			bool end = status.is_eof() || read == 0;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_back_ready = true;
+				if (end)
+				{
+					m_file_end = true;
+					m_file_status = status;
+				}
+			}
+			m_cv.notify_all();
+			if (end)
+			{
+				return;
+			}
+		}
+	}
+	catch (...)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_error = std::current_exception();
+		}
+		m_cv.notify_all();
+	}
+}
+
+bool ZlibInputStream::NextChunk()
+{
+	if (m_exhausted)
+	{
+		return false;
+	}
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cv.wait(lock, [this]{ return m_back_ready || m_error; });
+	if (m_error)
+	{
+		std::rethrow_exception(m_error);
+	}
+	m_front = 1 - m_front;
+	m_back_ready = false;
+	m_exhausted = m_file_end;
+	lock.unlock();
+	m_cv.notify_all();
+
+	Chunk& chunk = m_chunks[m_front];
+	m_zstream.next_in = chunk.data.data();
+	m_zstream.avail_in = (uInt)chunk.size;
+	return chunk.size > 0;
+}
+
+fsal::Status ZlibInputStream::Read(uint8_t* dst, size_t size, size_t* read)
+{
+	m_zstream.next_out = dst;
+	m_zstream.avail_out = 0;
+	// avail_out is 32 bit, larger reads are given to zlib in parts
+	size_t left = size;
+	while (m_zstream.avail_out > 0 || left > 0)
+	{
+		if (m_zstream.avail_out == 0)
+		{
+			uInt part = (uInt)std::min<size_t>(left, UINT_MAX);
+			m_zstream.avail_out = part;
+			left -= part;
+		}
+		if (m_zstream.avail_in == 0)
+		{
+			if (!NextChunk())
+			{
+				break;
+			}
+		}
+		if (m_stream_end)
+		{
+			// Concatenated gzip members are read as a single stream
+			inflateReset(&m_zstream);
+			m_stream_end = false;
+		}
+		int result = inflate(&m_zstream, Z_NO_FLUSH);
+		if (result == Z_STREAM_END)
+		{
+			m_stream_end = true;
+		}
+		else if (result != Z_OK && result != Z_BUF_ERROR)
+		{
+			throw runtime_error("Error decompressing file %s: %s", m_file->GetPath().c_str(), m_zstream.msg ? m_zstream.msg : "unknown error");
+		}
+	}
+	size_t done = size - left - m_zstream.avail_out;
+	m_position += done;
+	*read = done;
+	if (done == size)
+	{
+		return true;
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_file_status;
+}
@@ -0,0 +1,80 @@
+//   Copyright 2019-2020 Stanislav Pidhorskyi
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+
+#pragma once
+#include <inttypes.h>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <condition_variable>
+#include <fsal.h>
+#include <zlib.h>
+#include "compressed_stream.h"
+
+
+// Sequential stream that inflates a file compressed with zlib or gzip. Compressed data is read in chunks on a
+// background thread, so reading of the next chunk overlaps with inflating of the current one. Two chunk buffers are
+// allocated once and reused, data is inflated directly to the destination.
+class ZlibInputStream: public CompressedInputStream
+{
+public:
+	ZlibInputStream(const ZlibInputStream&) = delete; // non construction-copyable
+	ZlibInputStream& operator=( const ZlibInputStream&) = delete; // non copyable
+
+	enum class Format
+	{
+		ZLIB,
+		GZIP
+	};
+
+	// `file` is read from its current position and must outlive the stream
+	ZlibInputStream(fsal::File* file, Format format, size_t chunk_size = 256 * 1024);
+
+	~ZlibInputStream() override;
+
+	fsal::Status Read(uint8_t* dst, size_t size, size_t* read) override;
+
+	uint64_t Tell() const override { return m_position; }
+
+private:
+	struct Chunk
+	{
+		std::vector<uint8_t> data;
+		size_t size = 0;
+	};
+
+	// Waits for the next chunk from the background thread. Returns false if there are no more chunks
+	bool NextChunk();
+
+	void Run();
+
+	fsal::File* m_file;
+	z_stream m_zstream;
+	uint64_t m_position;
+	bool m_stream_end;
+	// Set when the last chunk was taken
+	bool m_exhausted;
+
+	Chunk m_chunks[2];
+	int m_front;
+	bool m_back_ready;
+	bool m_file_end;
+	bool m_stop;
+	fsal::Status m_file_status;
+	std::exception_ptr m_error;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::thread m_thread;
+};
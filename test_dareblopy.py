@@ -4,6 +4,13 @@ import PIL.Image
 import zipfile
 import numpy as np
 import pickle
+import tempfile
+import os
+import shutil
+import struct
+import gzip
+import zlib
+import ctypes
 import dareblopy as db
 
 
@@ -77,6 +84,165 @@ class FileAndImageReadingOps(unittest.TestCase):
 
         self.assertTrue(mean_error < 0.5)
 
+    def test_reading_to_numpy_downscaled(self):
+        # test_image.jpg is 224x224, it can be decoded at 224 * M / 8 resolution
+        for use_turbo in [False, True]:
+            ndarray = db.read_jpg_as_numpy("test_utils/test_image.jpg", use_turbo, target_size=100)
+            self.assertEqual(ndarray.shape, (112, 112, 3))
+
+            ndarray = db.read_jpg_as_numpy("test_utils/test_image.jpg", use_turbo, target_size=(60, 120))
+            self.assertEqual(ndarray.shape, (140, 140, 3))
+
+            ndarray = db.read_jpg_as_numpy("test_utils/test_image.jpg", use_turbo, scale=0.25)
+            self.assertEqual(ndarray.shape, (56, 56, 3))
+
+            ndarray = db.read_jpg_as_numpy("test_utils/test_image.jpg", use_turbo, target_size=1000)
+            self.assertEqual(ndarray.shape, (224, 224, 3))
+
+    def test_reading_crop_to_numpy(self):
+        ndarray_gt = db.read_jpg_as_numpy("test_utils/test_image.jpg", True)
+
+        # Crop of the same size as the output is not resized
+        crop = db.read_jpg_crop_as_numpy("test_utils/test_image.jpg", (50, 60), crop=(30, 40, 50, 60))
+        self.assertTrue(np.all(crop == ndarray_gt[30:80, 40:100]))
+
+        crop1 = db.read_jpg_crop_as_numpy("test_utils/test_image.jpg", 32, seed=42)
+        crop2 = db.read_jpg_crop_as_numpy("test_utils/test_image.jpg", 32, seed=42)
+        self.assertEqual(crop1.shape, (32, 32, 3))
+        self.assertTrue(np.all(crop1 == crop2))
+
+        out = np.zeros((16, 24, 3), dtype=np.uint8)
+        db.read_jpg_crop_as_numpy("test_utils/test_image.jpg", (16, 24), crop=(0, 0, 224, 224), out=out)
+        self.assertTrue(np.any(out != 0))
+
+    def test_reading_to_numpy_from_several_threads(self):
+        from threading import Thread
+
+        # Decoded on this thread, one for each backend
+        ndarrays_gt = {use_turbo: db.read_jpg_as_numpy("test_utils/test_image.jpg", use_turbo)
+                       for use_turbo in [False, True]}
+        results = []
+
+        def _worker(use_turbo):
+            for _ in range(20):
+                results.append((use_turbo, db.read_jpg_as_numpy("test_utils/test_image.jpg", use_turbo)))
+
+        threads = [Thread(target=_worker, args=(i % 2 == 0,)) for i in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        self.assertEqual(len(results), 8 * 20)
+        for use_turbo, ndarray in results:
+            self.assertEqual(ndarray.shape, ndarrays_gt[use_turbo].shape)
+            self.assertTrue(np.all(ndarray == ndarrays_gt[use_turbo]))
+
+    def test_reading_batch_to_numpy(self):
+        ndarray_gt = db.read_jpg_as_numpy("test_utils/test_image.jpg", True)
+        b = db.open_as_bytes("test_utils/test_image.jpg")
+
+        batch = db.read_jpgs_as_numpy(["test_utils/test_image.jpg", b, "test_utils/test_image.jpg", b], threads=2)
+        self.assertEqual(batch.shape, (4,) + ndarray_gt.shape)
+        for ndarray in batch:
+            self.assertTrue(np.all(ndarray == ndarray_gt))
+
+        out = np.zeros((2,) + ndarray_gt.shape, dtype=np.uint8)
+        result = db.read_jpgs_as_numpy([b, b], out=out)
+        self.assertIs(result, out)
+        self.assertTrue(np.all(out[1] == ndarray_gt))
+
+    def test_reading_png_to_numpy(self):
+        image = PIL.Image.open("test_utils/test_image2.png").convert('RGB')
+        ndarray1 = np.array(image)
+
+        ndarray2 = db.read_png_as_numpy("test_utils/test_image2.png", channels=3)
+        self.assertTrue(np.all(ndarray1 == ndarray2))
+
+        ndarray3 = db.read_png_as_numpy("test_utils/test_image2.png", channels=4)
+        self.assertTrue(np.all(ndarray3[:, :, :3] == ndarray1))
+        self.assertTrue(np.all(ndarray3[:, :, 3] == 255))
+
+    def test_reading_16bit_png_to_numpy(self):
+        ndarray1 = (np.arange(32 * 48, dtype=np.uint16) * 40).reshape(32, 48)
+        with tempfile.TemporaryDirectory() as directory:
+            filename = os.path.join(directory, 'test16.png')
+            PIL.Image.fromarray(ndarray1, 'I;16').save(filename)
+
+            ndarray2 = db.read_png_as_numpy(filename)
+            self.assertEqual(ndarray2.dtype, np.uint16)
+            self.assertTrue(np.all(ndarray2[:, :, 0] == ndarray1))
+
+            ndarray3 = db.read_png_as_numpy(filename, keep_16bit=False)
+            self.assertEqual(ndarray3.dtype, np.uint8)
+
+    def test_reading_webp_to_numpy(self):
+        image = PIL.Image.open("test_utils/test_image.jpg")
+        ndarray1 = np.array(image)
+        with tempfile.TemporaryDirectory() as directory:
+            filename = os.path.join(directory, 'test.webp')
+            image.save(filename, lossless=True)
+
+            ndarray2 = db.read_webp_as_numpy(filename)
+            self.assertTrue(np.all(ndarray1 == ndarray2))
+
+            ndarray3 = db.read_webp_as_numpy(filename, channels=4)
+            self.assertTrue(np.all(ndarray3[:, :, :3] == ndarray1))
+            self.assertTrue(np.all(ndarray3[:, :, 3] == 255))
+
+            h, w = ndarray1.shape[:2]
+            ndarray4 = db.read_webp_as_numpy(filename, target_size=(h // 2, w // 3))
+            self.assertEqual(ndarray4.shape, (h // 2, w // 3, 3))
+
+            ndarray5 = db.read_webp_as_numpy(filename, target_size=100)
+            self.assertEqual(min(ndarray5.shape[:2]), 100)
+
+    def test_reading_image_to_numpy(self):
+        ndarray1 = np.array(PIL.Image.open("test_utils/test_image.jpg"))
+        ndarray2 = np.array(PIL.Image.open("test_utils/test_image2.png").convert('RGB'))
+
+        ndarray3 = db.read_image_as_numpy("test_utils/test_image.jpg")
+        self.assertTrue(np.all(ndarray1 == ndarray3))
+
+        ndarray4 = db.read_image_as_numpy("test_utils/test_image2.png", channels=3)
+        self.assertTrue(np.all(ndarray2 == ndarray4))
+
+        with open("test_utils/test_image2.png", 'rb') as f:
+            ndarray5 = db.read_image_as_numpy(f.read(), channels=3, layout='CHW')
+        self.assertTrue(np.all(ndarray2.transpose(2, 0, 1) == ndarray5))
+
+        ndarray6 = db.read_image_as_numpy("test_utils/test_image2.png", channels=1, target_size=(50, 70))
+        self.assertEqual(ndarray6.shape, (50, 70, 1))
+
+        # Same target gives the same shape for all formats, JPEGs are not left at the size of DCT scaling
+        batch = db.read_images_as_numpy(["test_utils/test_image.jpg", "test_utils/test_image2.png"],
+                                        channels=3, target_size=(60, 120))
+        self.assertEqual([x.shape for x in batch], [(60, 120, 3), (60, 120, 3)])
+        self.assertEqual(min(db.read_image_as_numpy("test_utils/test_image.jpg", target_size=50).shape[:2]), 50)
+
+        archive = db.open_zip_archive("test_utils/test_image_archive.zip")
+        ndarray7 = archive.read_image_as_numpy('0.jpg')
+        self.assertTrue(np.all(archive.read_jpg_as_numpy('0.jpg', True) == ndarray7))
+
+        with open("test_utils/test_image2.png", 'rb') as f:
+            batch = db.read_images_as_numpy(["test_utils/test_image.jpg", f.read()], channels=3, threads=2)
+        self.assertEqual(len(batch), 2)
+        self.assertTrue(np.all(batch[0] == ndarray3))
+        self.assertTrue(np.all(batch[1] == ndarray4))
+
+    def test_reading_grayscale_jpg_to_numpy(self):
+        image = PIL.Image.open("test_utils/test_image.jpg").convert('L')
+        with tempfile.TemporaryDirectory() as directory:
+            filename = os.path.join(directory, 'gray.jpg')
+            image.save(filename, quality=95)
+            ndarray_gt = np.array(PIL.Image.open(filename))
+
+            # Both backends return a single channel
+            for use_turbo in [False, True]:
+                ndarray = db.read_jpg_as_numpy(filename, use_turbo)
+                self.assertEqual(ndarray.shape, ndarray_gt.shape + (1,))
+                self.assertLessEqual(np.abs(ndarray[:, :, 0].astype(np.int16) - ndarray_gt).max(), 2)
+
     def test_reading_to_bytes_from_zip(self):
         archive = zipfile.ZipFile("test_utils/test_image_archive.zip", 'r')
         s = archive.open('0.jpg')
@@ -101,6 +267,15 @@ class FileAndImageReadingOps(unittest.TestCase):
 
         self.assertTrue(np.all(ndarray1 == ndarray2))
 
+    def test_reading_batch_to_numpy_from_zip(self):
+        archive = db.open_zip_archive("test_utils/test_image_archive.zip")
+        ndarray_gt = archive.read_jpg_as_numpy('0.jpg', True)
+
+        batch = archive.read_jpgs_as_numpy(['0.jpg', '0.jpg', '0.jpg'])
+        self.assertEqual(batch.shape, (3,) + ndarray_gt.shape)
+        for ndarray in batch:
+            self.assertTrue(np.all(ndarray == ndarray_gt))
+
 
 class TFRecordsReading(unittest.TestCase):
     def test_reading_record(self):
@@ -120,6 +295,133 @@ class TFRecordsReading(unittest.TestCase):
 
         self.assertEqual(records_gt, records)
 
+    def test_record_index(self):
+        with tempfile.TemporaryDirectory() as directory:
+            filenames = []
+            for i in range(4):
+                filenames.append(os.path.join(directory, 'test-small-r%02d.tfrecords' % i))
+                shutil.copy('test_utils/test-small-r%02d.tfrecords' % i, filenames[-1])
+
+            metadata = [db.RecordReader(f).get_metadata() for f in filenames]
+
+            db.build_record_indices(filenames)
+            for f, m in zip(filenames, metadata):
+                self.assertTrue(os.path.exists(f + '.idx'))
+                rr = db.RecordReader(f)
+                self.assertTrue(rr.has_index)
+                self.assertEqual(rr.get_metadata(), m)
+
+                records = list(db.RecordReader(f))
+                self.assertEqual(rr.read_record_at(7), records[7])
+                self.assertEqual(rr.read_record_at(m[2] - 1), records[-1])
+
+            self.assertFalse(db.RecordReader(filenames[0], load_index=False).has_index)
+
+            # Corrupted indices are rejected: a length past the end of the file, and a truncated index
+            with open(filenames[0] + '.idx', 'rb') as f:
+                index = f.read()
+            header_size = 8 + 8 + 8
+            with open(filenames[0] + '.idx', 'wb') as f:
+                f.write(index[:header_size + 8] + struct.pack('<Q', 1 << 40) + index[header_size + 16:])
+            with self.assertRaises(RuntimeError):
+                db.RecordReader(filenames[0])
+            with open(filenames[0] + '.idx', 'wb') as f:
+                f.write(index[:-16])
+            with self.assertRaises(RuntimeError):
+                db.RecordReader(filenames[0])
+
+    def test_reading_compressed_records(self):
+        with tempfile.TemporaryDirectory() as directory:
+            with open('test_utils/test-small-r00.tfrecords', 'rb') as f:
+                data = f.read()
+            records = list(db.RecordReader('test_utils/test-small-r00.tfrecords'))
+
+            filename_gzip = os.path.join(directory, 'test.tfrecords.gz')
+            with gzip.open(filename_gzip, 'wb') as f:
+                f.write(data)
+            filename_zlib = os.path.join(directory, 'test.tfrecords.zlib')
+            with open(filename_zlib, 'wb') as f:
+                f.write(zlib.compress(data))
+
+            self.assertEqual(list(db.RecordReader(filename_gzip)), records)
+            self.assertEqual(list(db.RecordReader(filename_zlib)), records)
+            self.assertEqual(list(db.RecordReader(filename_gzip, compression=db.Compression.gzip)), records)
+            self.assertEqual(list(db.RecordYielderBasic([filename_gzip, filename_zlib])), records + records)
+
+    def test_reading_lz4_records(self):
+        with tempfile.TemporaryDirectory() as directory:
+            records = list(db.RecordReader('test_utils/test-small-r00.tfrecords'))
+
+            filename_lz4 = os.path.join(directory, 'test.tfrecords.lz4')
+            with db.RecordWriter(filename_lz4, compression=db.Compression.lz4) as writer:
+                for record in records:
+                    writer.write(record)
+            filename_plain = os.path.join(directory, 'test.tfrecords')
+            with db.RecordWriter(filename_plain) as writer:
+                for record in records:
+                    writer.write(record)
+
+            with open('test_utils/test-small-r00.tfrecords', 'rb') as f:
+                data = f.read()
+            with open(filename_plain, 'rb') as f:
+                self.assertEqual(f.read(), data)
+            self.assertLess(os.path.getsize(filename_lz4), len(data))
+
+            self.assertEqual(list(db.RecordReader(filename_lz4)), records)
+            self.assertEqual(list(db.RecordReader(filename_lz4, compression=db.Compression.lz4)), records)
+            self.assertEqual(list(db.RecordYielderBasic([filename_lz4, filename_plain])), records + records)
+
+    def test_reading_records_buffered(self):
+        filename = 'test_utils/test-small-r00.tfrecords'
+        records = list(db.RecordReader(filename))
+        for buffer_size in [8192, 65536, 4 * 1024 * 1024]:
+            rr = db.RecordReader(filename, buffer_size=buffer_size)
+            self.assertEqual(rr.get_metadata(), db.RecordReader(filename).get_metadata())
+            self.assertEqual(list(db.RecordReader(filename, buffer_size=buffer_size)), records)
+
+        # Record that does not fit into the buffer is read directly, records around it go through the buffer
+        with tempfile.TemporaryDirectory() as directory:
+            filename = os.path.join(directory, 'test.tfrecords')
+            records = [b'small', bytes(range(256)) * 80, b'small again']
+            with db.RecordWriter(filename) as writer:
+                for record in records:
+                    writer.write(record)
+            self.assertEqual(list(db.RecordReader(filename, buffer_size=8192)), records)
+
+    def test_record_dataset(self):
+        filenames = ['test_utils/test-small-r00.tfrecords',
+                     'test_utils/test-small-r01.tfrecords',
+                     'test_utils/test-small-r02.tfrecords',
+                     'test_utils/test-small-r03.tfrecords']
+        records = []
+        for f in filenames:
+            records += list(db.RecordReader(f))
+
+        dataset = db.RecordDataset(filenames)
+        self.assertEqual(len(dataset), len(records))
+        self.assertEqual(dataset[0], records[0])
+        self.assertEqual(dataset[123], records[123])
+        self.assertEqual(dataset[-1], records[-1])
+
+        order = dataset.permutation(seed=1, epoch=3)
+        self.assertEqual(sorted(order.tolist()), list(range(len(records))))
+        self.assertTrue(np.all(order == dataset.permutation(seed=1, epoch=3)))
+        self.assertFalse(np.all(order == dataset.permutation(seed=1, epoch=4)))
+
+        batch = dataset.get_batch(order[:64])
+        self.assertEqual(batch, [records[i] for i in order[:64]])
+
+        # More records than reads that are kept in flight
+        batch = dataset.get_batch(order)
+        self.assertEqual(batch, [records[i] for i in order])
+
+        # Positional reads, which are used if io_uring is not available
+        dataset = db.RecordDataset(filenames, use_io_uring=False)
+        self.assertFalse(dataset.uses_io_uring)
+        self.assertEqual(dataset[-1], records[-1])
+        batch = dataset.get_batch(order)
+        self.assertEqual(batch, [records[i] for i in order])
+
     def test_record_yielder(self):
         record_yielder = db.RecordYielderBasic(['test_utils/test-small-r00.tfrecords',
                                                 'test_utils/test-small-r01.tfrecords',
@@ -147,6 +449,124 @@ class TFRecordsReading(unittest.TestCase):
 
         self.assertEqual(records_gt, records)
 
+    def test_record_yielder_sharding(self):
+        with tempfile.TemporaryDirectory() as directory:
+            filenames = []
+            for i in range(4):
+                filenames.append(os.path.join(directory, 'test-small-r%02d.tfrecords' % i))
+                shutil.copy('test_utils/test-small-r%02d.tfrecords' % i, filenames[-1])
+            records = list(db.RecordYielderBasic(filenames))
+
+            # Splitting by record requires index files
+            with self.assertRaises(RuntimeError):
+                db.RecordYielderBasic(filenames, shard_index=0, num_shards=8)
+            db.build_record_indices(filenames)
+
+            # 2 and 4 shards are split by file, 8 shards by record
+            for num_shards in [2, 4, 8]:
+                shards = [list(db.RecordYielderBasic(filenames, shard_index=i, num_shards=num_shards))
+                          for i in range(num_shards)]
+                self.assertEqual(sum(shards, []), records)
+                self.assertTrue(all(len(shard) > 0 for shard in shards))
+                if num_shards == 8:
+                    self.assertLessEqual(max(map(len, shards)) - min(map(len, shards)), 1)
+
+                shards = [list(db.RecordYielderRandomized(filenames, 16, 1, 2, shard_index=i, num_shards=num_shards))
+                          for i in range(num_shards)]
+                self.assertEqual(sorted(sum(shards, [])), sorted(records))
+                again = list(db.RecordYielderRandomized(filenames, 16, 1, 2, shard_index=1, num_shards=num_shards))
+                self.assertEqual(again, shards[1])
+
+    def test_record_yielder_state(self):
+        filenames = ['test_utils/test-small-r00.tfrecords',
+                     'test_utils/test-small-r01.tfrecords',
+                     'test_utils/test-small-r02.tfrecords',
+                     'test_utils/test-small-r03.tfrecords']
+        for prefetch in [0, 8]:
+            record_yielder = db.RecordYielderRandomized(filenames, 32, 5, 1, prefetch)
+            head = record_yielder.next_n(70)
+            state = pickle.loads(pickle.dumps(record_yielder.get_state()))
+            tail = list(record_yielder)
+
+            resumed = db.RecordYielderRandomized(filenames, 32, 5, 1, prefetch)
+            resumed.set_state(state)
+            self.assertEqual(list(resumed), tail)
+            self.assertEqual(len(head) + len(tail), 200)
+
+            # Without buffer, records of the shuffle buffer and the prefetch queue are skipped
+            record_yielder = db.RecordYielderRandomized(filenames, 32, 5, 1, prefetch)
+            record_yielder.next_n(70)
+            state = record_yielder.get_state()
+            small_state = record_yielder.get_state(include_buffer=False)
+            self.assertEqual(small_state['buffer'], [])
+            self.assertEqual(small_state['ready'], [])
+            tail = list(record_yielder)
+            resumed = db.RecordYielderRandomized(filenames, 32, 5, 1, prefetch)
+            resumed.set_state(small_state)
+            rest = list(resumed)
+            self.assertEqual(len(rest), len(tail) - len(state['buffer']) - len(state['ready']))
+            self.assertTrue(set(rest) <= set(tail))
+
+        record_yielder = db.RecordYielderBasic(filenames)
+        record_yielder.next_n(70)
+        state = record_yielder.get_state()
+        tail = list(record_yielder)
+        resumed = db.RecordYielderBasic(filenames)
+        resumed.set_state(state)
+        self.assertEqual(list(resumed), tail)
+
+    def test_parsed_record_yielder_state(self):
+        filenames = ['test_utils/test-small-r00.tfrecords',
+                     'test_utils/test-small-r01.tfrecords',
+                     'test_utils/test-small-r02.tfrecords',
+                     'test_utils/test-small-r03.tfrecords']
+        parser = db.RecordParser({'data': db.FixedLenFeature([3, 32, 32], db.uint8)}, False)
+
+        def images(yielder):
+            return [data.tobytes() for data, in yielder]
+
+        for prefetch in [0, 8]:
+            record_yielder = db.ParsedRecordYielderRandomized(parser, filenames, 32, 5, 1, prefetch)
+            head = record_yielder.next_n(70)[0]
+            state = pickle.loads(pickle.dumps(record_yielder.get_state()))
+            small_state = record_yielder.get_state(include_buffer=False)
+            self.assertEqual(small_state['buffer'], [])
+            self.assertEqual(small_state['ready'], [])
+            tail = images(record_yielder)
+            self.assertEqual(len(head) + len(tail), 200)
+
+            resumed = db.ParsedRecordYielderRandomized(parser, filenames, 32, 5, 1, prefetch)
+            resumed.set_state(state)
+            self.assertEqual(images(resumed), tail)
+
+            resumed = db.ParsedRecordYielderRandomized(parser, filenames, 32, 5, 1, prefetch)
+            resumed.set_state(small_state)
+            rest = images(resumed)
+            self.assertEqual(len(rest), len(tail) - len(state['buffer']) - len(state['ready']))
+            self.assertTrue(set(rest) <= set(tail))
+
+    def test_record_yielder_interleave(self):
+        filenames = ['test_utils/test-small-r00.tfrecords',
+                     'test_utils/test-small-r01.tfrecords',
+                     'test_utils/test-small-r02.tfrecords',
+                     'test_utils/test-small-r03.tfrecords']
+        files = [list(db.RecordYielderBasic([filename])) for filename in filenames]
+
+        # Blocks of 2 records are taken from the first two files in turn, then from the other two
+        expected = []
+        for a, b in [(files[0], files[1]), (files[2], files[3])]:
+            for i in range(0, len(a), 2):
+                expected += a[i:i + 2] + b[i:i + 2]
+        records = list(db.RecordYielderBasic(filenames, cycle_length=2, block_length=2))
+        self.assertEqual(records, expected)
+
+        records = list(db.RecordYielderBasic(filenames, cycle_length=3, deterministic=False))
+        self.assertEqual(sorted(records), sorted(sum(files, [])))
+
+        records = list(db.RecordYielderRandomized(filenames, 16, 1, 2, prefetch=8, cycle_length=3))
+        self.assertEqual(records, list(db.RecordYielderRandomized(filenames, 16, 1, 2, cycle_length=3)))
+        self.assertEqual(sorted(records), sorted(sum(files, [])))
+
     def test_record_yielder_randomized(self):
         record_yielder = db.RecordYielderRandomized(['test_utils/test-small-r00.tfrecords',
                                                      'test_utils/test-small-r01.tfrecords',
@@ -191,6 +611,28 @@ class TFRecordsReading(unittest.TestCase):
         # TODO: Check if sequence is random? For small `buffer_size` it's going to be random only at local scale.
         print(index)
 
+    def test_record_yielder_randomized_prefetch(self):
+        filenames = ['test_utils/test-small-r00.tfrecords',
+                     'test_utils/test-small-r01.tfrecords',
+                     'test_utils/test-small-r02.tfrecords',
+                     'test_utils/test-small-r03.tfrecords']
+
+        def read_all(yielder):
+            records = []
+            while True:
+                try:
+                    records += yielder.next_n(32)
+                except StopIteration:
+                    break
+            return records
+
+        records = read_all(db.RecordYielderRandomized(filenames, buffer_size=16, seed=0, epoch=0))
+        records_prefetched = read_all(db.RecordYielderRandomized(filenames, buffer_size=16, seed=0, epoch=0,
+                                                                 prefetch=8))
+
+        # Prefetching must not change the order of records
+        self.assertEqual(records, records_prefetched)
+
 
 class TFRecordsParsing(unittest.TestCase):
     def setUp(self):
@@ -255,6 +697,40 @@ class TFRecordsParsing(unittest.TestCase):
         data = parser.parse_example(self.records)[0]
         self.assertTrue(np.all(data == self.images_gt))
 
+    def test_parsing_records_in_batch_parallel(self):
+        features_alternative = {
+            'data': db.FixedLenFeature([3, 32, 32], db.uint8)
+        }
+
+        for worker_count in [1, 4, 0]:
+            parser = db.RecordParser(features_alternative, True, worker_count)
+            data = parser.parse_example(self.records)[0]
+            self.assertTrue(np.all(data == self.images_gt))
+
+            # Errors of worker threads are raised in the calling thread
+            with self.assertRaises(RuntimeError):
+                parser.parse_example(self.records[:10] + [self.records[10][:-1]] + self.records[11:])
+
+    def test_parsing_records_from_mmap(self):
+        features_alternative = {
+            'data': db.FixedLenFeature([3, 32, 32], db.uint8)
+        }
+
+        parser = db.RecordParser(features_alternative, False)
+
+        views = []
+        for file in ['test_utils/test-small-r00.tfrecords',
+                     'test_utils/test-small-r01.tfrecords',
+                     'test_utils/test-small-r02.tfrecords',
+                     'test_utils/test-small-r03.tfrecords']:
+            views += list(db.RecordReader(file, mmap=True))
+
+        self.assertEqual([bytes(v) for v in views], self.records)
+        self.assertFalse(views[0].flags.writeable)
+
+        data = parser.parse_example(views)[0]
+        self.assertTrue(np.all(data == self.images_gt))
+
     def test_parsing_single_record_inplace(self):
         features = {
             'shape': db.FixedLenFeature([3], db.int64),
@@ -285,6 +761,207 @@ class TFRecordsParsing(unittest.TestCase):
             parser.parse_single_example_inplace(record, [data], 0)
             self.assertTrue(np.all(data == image_gt))
 
+    def test_parsing_wire_format(self):
+        def varint(x):
+            x &= (1 << 64) - 1
+            out = b''
+            while x >= 0x80:
+                out += bytes([(x & 0x7F) | 0x80])
+                x >>= 7
+            return out + bytes([x])
+
+        def field(number, payload):
+            return varint(number << 3 | 2) + varint(len(payload)) + payload
+
+        def entry(key, feature):
+            return field(1, field(1, key.encode()) + field(2, feature))
+
+        # Non-packed int64 values, packed floats, a key that is repeated and an unknown field
+        int64_list = field(3, b''.join(varint(1 << 3) + varint(x) for x in [5, -7, 300]))
+        float_list = field(2, field(1, np.asarray([1.5, -2.0], dtype=np.float32).tobytes()))
+        example = field(1, entry('a', float_list) + entry('b', float_list) + varint(7 << 3 | 0) + varint(1)) + \
+            field(1, entry('a', int64_list))
+
+        parser = db.RecordParser({'a': db.FixedLenFeature([3], db.int64),
+                                  'b': db.FixedLenFeature([2], db.float32)})
+        a, b = parser.parse_single_example(example)
+        self.assertEqual(list(a), [5, -7, 300])
+        self.assertEqual(list(b), [1.5, -2.0])
+
+        with self.assertRaises(RuntimeError):
+            parser.parse_single_example(example[:-1])
+
+    def test_parsing_var_len_features(self):
+        features = {
+            'shape': db.VarLenFeature(db.int64),
+            'data': db.VarLenFeature(db.uint8),
+            'missing': db.VarLenFeature(db.float32)
+        }
+        parser = db.RecordParser(features)
+
+        (shape, shape_splits), (data, data_splits), (missing, missing_splits) = parser.parse_example(self.records)
+        self.assertTrue(np.all(shape_splits == np.arange(len(self.records) + 1) * 3))
+        self.assertTrue(np.all(shape.reshape(-1, 3) == [3, 32, 32]))
+        self.assertTrue(np.all(data_splits == np.arange(len(self.records) + 1) * 3 * 32 * 32))
+        self.assertTrue(np.all(data.reshape(-1, 3, 32, 32) == self.images_gt))
+        self.assertEqual(missing.shape, (0,))
+        self.assertTrue(np.all(missing_splits == 0))
+
+        shape, data, missing = parser.parse_single_example(self.records[0])
+        self.assertEqual(list(shape), [3, 32, 32])
+        self.assertTrue(np.all(data.reshape(3, 32, 32) == self.images_gt[0]))
+
+    def test_parsing_native_strings(self):
+        parser = db.RecordParser({'data': db.FixedLenFeature([], db.string)}, native_strings=True)
+
+        data, offsets = parser.parse_example(self.records)[0]
+        self.assertEqual(offsets.dtype, np.int64)
+        self.assertEqual(len(offsets), len(self.records) + 1)
+        for i, image_gt in enumerate(self.images_gt):
+            image = data[offsets[i]:offsets[i + 1]]
+            self.assertTrue(np.all(image.reshape(3, 32, 32) == image_gt))
+
+        data, offsets = parser.parse_single_example(self.records[1])[0]
+        self.assertTrue(np.all(data.reshape(3, 32, 32) == self.images_gt[1]))
+        self.assertTrue(np.all(offsets == [0, 3 * 32 * 32]))
+
+        parser = db.RecordParser({'data': db.VarLenFeature(db.string)}, native_strings=True)
+        data, offsets, row_splits = parser.parse_example(self.records)[0]
+        self.assertTrue(np.all(row_splits == np.arange(len(self.records) + 1)))
+        self.assertTrue(np.all(data.reshape(-1, 3, 32, 32) == self.images_gt))
+
+    def test_parsing_records_in_batch_out(self):
+        features = {
+            'data': db.FixedLenFeature([3, 32, 32], db.uint8),
+            'id': db.VarLenFeature(db.int64)
+        }
+        images_gt = np.stack(self.images_gt)
+
+        parser = db.RecordParser({'data': features['data']})
+        out = np.zeros([len(self.records), 3, 32, 32], dtype=np.uint8)
+        data = parser.parse_example(self.records, out=[out])[0]
+        self.assertIs(data, out)
+        self.assertTrue(np.all(out == images_gt))
+
+        with self.assertRaises(RuntimeError):
+            parser.parse_example(self.records, out=[out[:-1]])
+        with self.assertRaises(RuntimeError):
+            parser.parse_example(self.records, out=[out.astype(np.float32)])
+        with self.assertRaises(RuntimeError):
+            parser.parse_example(self.records, out=[])
+
+        parser = db.RecordParser(features)
+        with self.assertRaises(RuntimeError):
+            parser.parse_example(self.records, out=[None, np.zeros([len(self.records)], dtype=np.int64)])
+
+        # Buffers of the ring are reused once the arrays are released, including for a smaller last batch
+        parser = db.RecordParser({'data': features['data']}, batch_buffers=2)
+        batches = [self.records[i:i + 16] for i in range(0, len(self.records), 16)]
+        for epoch in range(2):
+            held = []
+            for i, batch in enumerate(batches):
+                data = parser.parse_example(batch)[0]
+                self.assertTrue(np.all(data == images_gt[i * 16:i * 16 + len(batch)]))
+                held.append(data)
+                if len(held) > 3:
+                    held.pop(0)
+            for i, data in enumerate(held):
+                self.assertTrue(np.all(data == images_gt[(len(batches) - len(held) + i) * 16:][:len(data)]))
+
+        # Released buffer is handed out again, while a held one is not
+        del held, data
+        first = parser.parse_example(batches[0])[0]
+        address = first.__array_interface__['data'][0]
+        del first
+        second = parser.parse_example(batches[1])[0]
+        self.assertEqual(second.__array_interface__['data'][0], address)
+        third = parser.parse_example(batches[2])[0]
+        self.assertFalse(np.shares_memory(second, third))
+        self.assertTrue(np.all(second == images_gt[16:32]))
+
+    def test_parsing_dtype_conversion(self):
+        features = {
+            'shape': db.FixedLenFeature([3], db.int64, out_dtype=db.int32),
+            'data': db.FixedLenFeature([3, 32, 32], db.uint8, out_dtype=db.float32, scale=1 / 255.)
+        }
+        images_gt = np.stack(self.images_gt).astype(np.float32) * np.float32(1 / 255.)
+
+        parser = db.RecordParser(features, batch_buffers=2)
+        shape, data = parser.parse_example(self.records)
+        self.assertEqual(shape.dtype, np.int32)
+        self.assertEqual(data.dtype, np.float32)
+        self.assertTrue(np.all(shape == [3, 32, 32]))
+        self.assertTrue(np.allclose(data, images_gt))
+
+        shape, data = parser.parse_single_example(self.records[1])
+        self.assertEqual(shape.dtype, np.int32)
+        self.assertTrue(np.allclose(data, images_gt[1]))
+
+        values = np.asarray([0.0, -1.5, 1 / 3., 65504.0, 1e6, 1e-7, np.inf, np.nan], dtype=np.float32)
+        # Example with a single feature 'f', that has packed float values
+        float_list = b'\x12' + bytes([len(values) * 4 + 2]) + b'\x0a' + bytes([len(values) * 4]) + values.tobytes()
+        entry = b'\x0a\x01f\x12' + bytes([len(float_list)]) + float_list
+        example = b'\x0a' + bytes([len(entry) + 2]) + b'\x0a' + bytes([len(entry)]) + entry
+
+        half, = db.RecordParser({'f': db.FixedLenFeature([8], db.float32, out_dtype=db.float16)}).parse_example([example])
+        self.assertEqual(half.dtype, np.float16)
+        self.assertTrue(np.array_equal(half[0], values.astype(np.float16), equal_nan=True))
+
+        bfloat16, = db.RecordParser({'f': db.FixedLenFeature([8], db.float32, out_dtype=db.bfloat16)}).parse_example([example])
+        self.assertEqual(bfloat16.dtype, np.uint16)
+        widened = (bfloat16[0].astype(np.uint32) << 16).view(np.float32)
+        self.assertTrue(np.allclose(widened, values, rtol=1 / 128., equal_nan=True))
+
+        def dlpack_dtype(array):
+            # Code and bits of the tensor dtype, which follows data pointer, device and ndim
+            get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+            get_pointer.restype = ctypes.c_void_p
+            get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+            capsule = array.__dlpack__()
+            code, bits = ctypes.string_at(get_pointer(capsule, b'dltensor') + 20, 2)
+            return code, bits
+
+        # Through DLPack, bfloat16 outputs are exported as bfloat16, not as uint16 arrays that numpy holds them in
+        parser = db.RecordParser({'f': db.FixedLenFeature([8], db.float32, out_dtype=db.bfloat16)})
+        self.assertEqual(parser.output_dtypes, [db.bfloat16])
+        exported, = db.to_dlpack(parser.parse_example([example]), parser.output_dtypes)
+        self.assertEqual(dlpack_dtype(exported), (4, 16))
+        self.assertEqual(dlpack_dtype(db.to_dlpack(exported.array)), (1, 16))
+        with self.assertRaises(RuntimeError):
+            db.DLPackArray(values, dtype=db.bfloat16)
+        with self.assertRaises(RuntimeError):
+            db.to_dlpack(parser.parse_example([example]), [])
+
+        with self.assertRaises(RuntimeError):
+            db.RecordParser({'data': db.FixedLenFeature([], db.string, out_dtype=db.float32)})
+        with self.assertRaises(RuntimeError):
+            db.RecordParser({'shape': db.FixedLenFeature([3], db.int64, scale=0.5)})
+
+    @unittest.skipUnless(hasattr(np, 'from_dlpack'), 'numpy.from_dlpack is not available')
+    def test_parsing_dlpack(self):
+        features = {
+            'data': db.FixedLenFeature([3, 32, 32], db.uint8),
+            'id': db.VarLenFeature(db.int64)
+        }
+        parser = db.RecordParser(features, batch_buffers=1)
+
+        data, (values, row_splits) = db.to_dlpack(parser.parse_example(self.records))
+        self.assertEqual(data.__dlpack_device__(), (1, 0))
+        images = np.from_dlpack(data)
+        self.assertTrue(np.shares_memory(images, data.array))
+
+        # Memory of the ring buffer is held by the consumer, next batch gets a new buffer
+        del data
+        data = parser.parse_example(self.records)[0]
+        self.assertFalse(np.shares_memory(images, data))
+        self.assertTrue(np.all(images == np.stack(self.images_gt)))
+        self.assertEqual(np.from_dlpack(row_splits).dtype, np.int64)
+
+        with self.assertRaises(RuntimeError):
+            db.to_dlpack(db.RecordParser({'data': db.FixedLenFeature([], db.string)}).parse_example(self.records))
+        with self.assertRaises(RuntimeError):
+            db.to_dlpack('data')
+
 
 class DatasetIterator(unittest.TestCase):
     def setUp(self):